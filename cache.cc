@@ -1,3 +1,12 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "cache.h"
 
 template<>
@@ -15,3 +24,174 @@ NameCache<PoolAllocator<> >::max_capacity = 0;
 template<>
 time_t
 NameCache<PoolAllocator<> >::item_lifetime = 0;
+
+template<>
+time_t
+NameCache<PoolAllocator<> >::min_ttl = 0;
+
+template<>
+time_t
+NameCache<PoolAllocator<> >::max_ttl = 0;
+
+template<>
+time_t
+NameCache<PoolAllocator<> >::negative_lifetime = 0;
+
+template<>
+time_t
+NameCache<PoolAllocator<> >::stale_lifetime = 0;
+
+NameCacheSnapshot::NameCacheSnapshot(const char *path)
+{
+    std::string pattern(path);
+    pattern += ".[0-9]*";
+    glob_t g;
+    if (glob(pattern.c_str(), 0, nullptr, &g) != 0)
+        return; // no snapshots yet
+
+    for (size_t i = 0; i < g.gl_pathc; ++i) {
+        int fd = open(g.gl_pathv[i], O_RDONLY);
+        if (fd < 0)
+            continue;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= header_size) {
+            void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                files.push_back(Mapping(data, st.st_size));
+            }
+        }
+        close(fd);
+    }
+    globfree(&g);
+}
+
+NameCacheSnapshot::~NameCacheSnapshot()
+{
+    for (auto &f: files)
+        munmap(f.first, f.second);
+}
+
+size_t
+NameCacheSnapshot::load(Cache &cache) const
+{
+    time_t now = time(nullptr);
+    size_t loaded = 0;
+    std::vector<const char *> records;
+
+    for (auto &f: files) {
+        const char *p = (const char *) f.first;
+        const char *end = p + f.second;
+        uint32_t v, count;
+        memcpy(&v, p + 4, sizeof(v));
+        memcpy(&count, p + 4 + sizeof(v), sizeof(count));
+        if (memcmp(p, "EVXC", 4) != 0 || v != version)
+            continue;
+
+        records.clear();
+        records.reserve(count);
+        for (p += header_size; p + record_head <= end && records.size() < count; ) {
+            uint8_t addr_count = p[record_head - 2];
+            uint8_t length = p[record_head - 1];
+            size_t size = record_head + addr_count * addr_size + length;
+            if (p + size > end)
+                break; // truncated
+            records.push_back(p);
+            p += size;
+        }
+
+        // records are in MRU order, so load from the end to keep it
+        for (auto r = records.rbegin(); r != records.rend(); ++r) {
+            const char *rec = *r;
+            int64_t expires;
+            memcpy(&expires, rec, sizeof(expires));
+            rec += sizeof(expires);
+            bool negative = rec[0];
+            uint8_t addr_count = rec[1];
+            uint8_t length = rec[2];
+            rec += 3;
+
+            HostAddresses addrs;
+            for (unsigned i = 0; i < addr_count; ++i, rec += addr_size) {
+                HostAddress a;
+                a.family = rec[0];
+                memcpy(&a.v6, rec + 1, sizeof(a.v6));
+                if (a.family == AF_INET || a.family == AF_INET6)
+                    addrs.add(a);
+            }
+
+            if (expires <= now || length == 0 || length > DomainName::max_name)
+                continue;
+
+            if (!negative && addrs.empty())
+                continue;
+
+            DomainName name(buffer::istring(rec, length));
+            if (negative)
+                cache.restore(name, DomainValue(expires - now));
+            else
+                cache.restore(name, DomainValue(addrs, expires - now));
+            ++loaded;
+        }
+    }
+    return loaded;
+}
+
+bool
+NameCacheSnapshot::save(const Cache &cache, const char *path, int index)
+{
+    std::string final_path(path);
+    std::string tmp_path(path);
+    final_path += "." + std::to_string(index);
+    tmp_path += ".tmp." + std::to_string(index);
+
+    FILE *f = fopen(tmp_path.c_str(), "w");
+    if (!f)
+        return true;
+
+    uint32_t v = version;
+    uint32_t count = 0; // patched after records are written
+    bool err =
+        fwrite("EVXC", 4, 1, f) != 1 ||
+        fwrite(&v, sizeof(v), 1, f) != 1 ||
+        fwrite(&count, sizeof(count), 1, f) != 1;
+
+    time_t now = time(nullptr);
+    cache.for_each_mru([&](const DomainName &name, const DomainValue &value) {
+        if (err || value.expired(now))
+            return;
+        buffer::istring n = name.str();
+        int64_t expires = value.ctime + value.ttl;
+        uint8_t flags[3] = { uint8_t(value.negative), value.addrs.count, uint8_t(n.size()) };
+        err =
+            fwrite(&expires, sizeof(expires), 1, f) != 1 ||
+            fwrite(flags, sizeof(flags), 1, f) != 1;
+        for (unsigned i = 0; !err && i < value.addrs.count; ++i) {
+            char a[addr_size] = {};
+            a[0] = value.addrs.addr[i].family;
+            memcpy(a + 1, &value.addrs.addr[i].v6,
+                value.addrs.addr[i].family == AF_INET6 ? sizeof(in6_addr) : sizeof(in_addr));
+            err = fwrite(a, sizeof(a), 1, f) != 1;
+        }
+        if (!err)
+            err = fwrite(n.data(), n.size(), 1, f) != 1;
+        if (!err)
+            ++count;
+    });
+
+    if (!err)
+        err =
+            fseek(f, 4 + sizeof(v), SEEK_SET) != 0 ||
+            fwrite(&count, sizeof(count), 1, f) != 1;
+
+    if (fclose(f) != 0)
+        err = true;
+
+    if (err || rename(tmp_path.c_str(), final_path.c_str()) != 0) {
+        int save_errno = errno;
+        unlink(tmp_path.c_str());
+        errno = save_errno;
+        return true;
+    }
+    return false;
+}
@@ -2,9 +2,13 @@
 #ifndef __evx_cache_h
 #define __evx_cache_h
 
+#include <algorithm>
 #include <list>
 #include <map>
+#include <vector>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <cstring>
 #include "pool.h"
 #include "buffer_string.h"
 
@@ -58,18 +62,142 @@ struct DomainName
     }
 };
 
+struct HostAddress
+{
+    sa_family_t family; // AF_INET or AF_INET6
+    union
+    {
+        in_addr v4;
+        in6_addr v6;
+    };
+
+    HostAddress() : family {AF_UNSPEC} {}
+
+    HostAddress(const in_addr &addr) :
+        family {AF_INET},
+        v4 (addr)
+    {}
+
+    HostAddress(const in6_addr &addr) :
+        family {AF_INET6},
+        v6 (addr)
+    {}
+
+    bool operator== (const HostAddress &op) const
+    {
+        if (family != op.family)
+            return false;
+        return family == AF_INET ?
+            v4.s_addr == op.v4.s_addr :
+            memcmp(&v6, &op.v6, sizeof(v6)) == 0;
+    }
+
+    socklen_t
+    sockaddr(sockaddr_storage &sa, uint16_t port) const
+    {
+        memset(&sa, 0, sizeof(sa));
+        if (family == AF_INET6) {
+            sockaddr_in6 &sa6 = (sockaddr_in6 &) sa;
+            sa6.sin6_family = AF_INET6;
+            sa6.sin6_port = htons(port);
+            sa6.sin6_addr = v6;
+            return sizeof(sa6);
+        }
+        sockaddr_in &sa4 = (sockaddr_in &) sa;
+        sa4.sin_family = AF_INET;
+        sa4.sin_port = htons(port);
+        sa4.sin_addr = v4;
+        return sizeof(sa4);
+    }
+};
+
+/* All A and AAAA records of name */
+struct HostAddresses
+{
+    static const unsigned max_count = 8;
+    uint8_t count = 0;
+    uint8_t rotation = 0; // start of next rotated() copy
+    HostAddress addr[max_count];
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    bool contains(const HostAddress &a) const
+    {
+        return std::find(addr, addr + count, a) != addr + count;
+    }
+
+    // false if there is no room left
+    bool add(const HostAddress &a)
+    {
+        if (contains(a))
+            return true;
+        if (count == max_count)
+            return false;
+        addr[count++] = a;
+        return true;
+    }
+
+    /* Copy for connecting: each family is rotated (to spread load over
+       addresses), then families are interleaved starting with IPv6
+       (RFC 8305, section 4). */
+    void rotated(HostAddresses &out)
+    {
+        HostAddress v6[max_count], v4[max_count];
+        unsigned n6 = 0, n4 = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            if (addr[i].family == AF_INET6)
+                v6[n6++] = addr[i];
+            else
+                v4[n4++] = addr[i];
+        }
+        out.count = 0;
+        for (unsigned i = 0; i < n6 || i < n4; ++i) {
+            if (i < n6)
+                out.addr[out.count++] = v6[(i + rotation) % n6];
+            if (i < n4)
+                out.addr[out.count++] = v4[(i + rotation) % n4];
+        }
+        rotation++;
+    }
+};
+
 struct DomainValue
 {
     typedef std::list<void *>::iterator proxy_iterator;
     proxy_iterator list_it;
     time_t ctime;
-    in_addr host_ip;
+    time_t ttl;
+    bool negative; // failed resolution (NXDOMAIN, SERVFAIL, etc.)
+    bool refreshing = false; // served stale, background refresh is scheduled
+    HostAddresses addrs;
 
-    DomainValue(in_addr &_host_ip) :
-        host_ip {_host_ip}
+    DomainValue(const HostAddresses &_addrs, time_t _ttl) :
+        ttl {_ttl},
+        negative {false},
+        addrs (_addrs)
     {
         ctime = time(nullptr);
     }
+
+    DomainValue(time_t _ttl) :
+        ttl {_ttl},
+        negative {true}
+    {
+        ctime = time(nullptr);
+    }
+
+    bool expired(time_t now) const
+    {
+        return ctime + ttl < now;
+    }
+
+    bool stale(time_t now, time_t stale_lifetime) const
+    {
+        return !negative && ctime + ttl + stale_lifetime >= now;
+    }
 };
 
 template <class Alloc>
@@ -77,7 +205,11 @@ class NameCache : public std::map<DomainName, DomainValue, std::less<DomainName>
 {
     typedef std::map<DomainName, DomainValue, std::less<DomainName>, Alloc> map;
     static size_t max_capacity;
-    static time_t item_lifetime;
+    static time_t item_lifetime; // for records of unknown TTL
+    static time_t min_ttl;
+    static time_t max_ttl;
+    static time_t negative_lifetime; // 0 turns off negative caching
+    static time_t stale_lifetime; // 0 turns off serving of expired items
 
     typedef std::list<typename map::iterator, Alloc> list;
     typedef typename list::iterator list_iterator;
@@ -86,11 +218,44 @@ class NameCache : public std::map<DomainName, DomainValue, std::less<DomainName>
     static const bool NO_COPY = false;
 
 public:
+    enum Result
+    {
+        MISS = 0,
+        HIT,
+        NEGATIVE_HIT,
+        STALE_HIT // expired item is served, caller must refresh it
+    };
+
+    struct Stats
+    {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t negative_hits = 0;
+        size_t stale_hits = 0;
+    } stats; // per thread, as cache itself
+
+    static const time_t unknown_ttl = -1;
+
     static
-    void init_static(size_t _max_capacity, time_t _lifetime)
+    void init_static(size_t _max_capacity, time_t _lifetime,
+                     time_t _min_ttl = 0, time_t _max_ttl = 86400,
+                     time_t _negative_lifetime = 0,
+                     time_t _stale_lifetime = 0)
     {
         max_capacity = _max_capacity;
         item_lifetime = _lifetime;
+        min_ttl = _min_ttl;
+        max_ttl = _max_ttl;
+        negative_lifetime = _negative_lifetime;
+        stale_lifetime = _stale_lifetime;
+    }
+
+    static
+    time_t clamp_ttl(time_t ttl)
+    {
+        if (ttl == unknown_ttl)
+            return item_lifetime;
+        return std::max(min_ttl, std::min(ttl, max_ttl));
     }
 
     NameCache()
@@ -98,43 +263,132 @@ public:
         assert(max_capacity);
     }
 
-    bool get(in_addr &host_ip, DomainName &name)
+    Result get(HostAddresses &addrs, DomainName &name)
     {
         auto it = map::find(name);
-        if (it == map::end())
-            return false;
+        if (it == map::end()) {
+            stats.misses++;
+            return MISS;
+        }
 
         list_iterator *l_it = (list_iterator *) (void *) &it->second.list_it;
         assert(**l_it == it);
 
-        if (it->second.ctime + item_lifetime < time(nullptr)) {
-            map::erase(it);
-            mru.erase(*l_it);
-            return false;
+        time_t now = time(nullptr);
+        if (it->second.expired(now)) {
+            if (!it->second.stale(now, stale_lifetime)) {
+                map::erase(it);
+                mru.erase(*l_it);
+                stats.misses++;
+                return MISS;
+            }
+            mru.splice(mru.begin(), mru, *l_it);
+            it->second.addrs.rotated(addrs);
+            stats.stale_hits++;
+            if (it->second.refreshing)
+                return HIT;
+            it->second.refreshing = true;
+            return STALE_HIT;
         }
 
-        host_ip = it->second.host_ip;
-
         // most recently used goes to top:
         mru.splice(mru.begin(), mru, *l_it);
-        return true;
+
+        if (it->second.negative) {
+            stats.negative_hits++;
+            return NEGATIVE_HIT;
+        }
+
+        it->second.addrs.rotated(addrs);
+        stats.hits++;
+        return HIT;
     }
 
-    bool get(in_addr &host_ip, buffer::istring &name)
+    Result get(HostAddresses &addrs, buffer::istring &name)
     {
         DomainName d(name, NO_COPY);
-        return get(host_ip, d);
+        return get(addrs, d);
     }
 
-    bool get(in_addr &host_ip, const char *name)
+    Result get(HostAddresses &addrs, const char *name)
     {
         buffer::istring s(name);
-        return get(host_ip, s);
+        return get(addrs, s);
+    }
+
+    void insert(const HostAddresses &addrs, DomainName &name, time_t ttl = unknown_ttl)
+    {
+        insert_value(name, DomainValue(addrs, clamp_ttl(ttl)));
+    }
+
+    void insert(const HostAddresses &addrs, buffer::istring &name, time_t ttl = unknown_ttl)
+    {
+        DomainName d(name, NO_COPY);
+        return insert(addrs, d, ttl);
+    }
+
+    void insert(const HostAddresses &addrs, const char *name, time_t ttl = unknown_ttl)
+    {
+        buffer::istring s(name);
+        return insert(addrs, s, ttl);
+    }
+
+    void insert_negative(DomainName &name)
+    {
+        if (negative_lifetime)
+            insert_value(name, DomainValue(negative_lifetime));
+    }
+
+    void insert_negative(buffer::istring &name)
+    {
+        DomainName d(name, NO_COPY);
+        return insert_negative(d);
+    }
+
+    void insert_negative(const char *name)
+    {
+        buffer::istring s(name);
+        return insert_negative(s);
+    }
+
+    // Refresh failed: keep serving stale item, next STALE_HIT will retry
+    void refresh_failed(buffer::istring &name)
+    {
+        DomainName d(name, NO_COPY);
+        auto it = map::find(d);
+        if (it != map::end())
+            it->second.refreshing = false;
     }
 
-    void insert(in_addr &host_ip, DomainName &name)
+    // Iterate items from most to least recently used
+    template <class Func>
+    void for_each_mru(Func f) const
+    {
+        for (auto &it: mru)
+            f(it->first, it->second);
+    }
+
+    // Item from snapshot keeps its remaining TTL (not clamped again)
+    void restore(DomainName &name, const DomainValue &value)
+    {
+        insert_value(name, value);
+    }
+
+private:
+    void insert_value(DomainName &name, const DomainValue &value)
     {
         list_iterator l_it;
+        auto it = map::find(name);
+        if (it != map::end()) {
+            // refreshed item is updated in place
+            DomainValue::proxy_iterator saved = it->second.list_it;
+            it->second = value;
+            it->second.list_it = saved;
+            l_it = *(list_iterator *) (void *) &saved;
+            mru.splice(mru.begin(), mru, l_it);
+            return;
+        }
+
         if (map::size() == max_capacity) {
             // erase least recently used
             l_it = --mru.end();
@@ -142,30 +396,22 @@ public:
             mru.erase(l_it);
         }
         std::pair<typename map::iterator, bool> res =
-            map::insert(typename map::value_type(name, DomainValue(host_ip)));
+            map::insert(typename map::value_type(name, value));
         if (!res.second)
             return;
         mru.push_front(res.first);
         l_it = mru.begin();
         res.first->second.list_it = *(DomainValue::proxy_iterator *)(void *)&l_it;
     }
-
-    void insert(in_addr &host_ip, buffer::istring &name)
-    {
-        DomainName d(name, NO_COPY);
-        return insert(host_ip, d);
-    }
-
-    void insert(in_addr &host_ip, const char *name)
-    {
-        buffer::istring s(name);
-        return insert(host_ip, s);
-    }
 };
 
 typedef std::_List_node<std::_Rb_tree_iterator<std::pair<DomainName const, DomainValue> > > ListNode;
 typedef std::_Rb_tree_node<std::pair<DomainName const, DomainValue> > MapNode;
 
+// defined in cache.cc; declared here so that other units don't assume own TLS init
+template<> thread_local Pool<ListNode>* PoolAllocator<ListNode>::pool;
+template<> thread_local Pool<MapNode>* PoolAllocator<MapNode>::pool;
+
 class NameCacheInit
 {
     Pool<MapNode> map_pool;
@@ -178,12 +424,14 @@ public:
         PoolAllocator<ListNode>::init_thread(list_pool);
     }
 
-    NameCacheInit(size_t pool_size, time_t lifetime) :
+    NameCacheInit(size_t pool_size, time_t lifetime, time_t min_ttl,
+                  time_t max_ttl, time_t negative_lifetime, time_t stale_lifetime) :
         map_pool(pool_size),
         list_pool(pool_size)
     {
         init_thread();
-        NameCache<PoolAllocator<> >::init_static(pool_size, lifetime);
+        NameCache<PoolAllocator<> >::init_static(
+            pool_size, lifetime, min_ttl, max_ttl, negative_lifetime, stale_lifetime);
     }
 };
 
@@ -192,10 +440,42 @@ class NameCacheOnPool :
     public NameCache<PoolAllocator<> >
 {
 public:
-    NameCacheOnPool(size_t pool_size, time_t lifetime) :
-        NameCacheInit(pool_size, lifetime)
+    NameCacheOnPool(size_t pool_size, time_t lifetime, time_t min_ttl,
+                    time_t max_ttl, time_t negative_lifetime, time_t stale_lifetime) :
+        NameCacheInit(pool_size, lifetime, min_ttl, max_ttl, negative_lifetime, stale_lifetime)
     {
     }
 };
 
+/* Compact binary snapshot of name cache for warm restarts. Each accept thread
+   saves its own cache into <path>.<index>; on startup all these files are
+   mmapped and loaded into every thread's cache.
+
+   File format (host byte order):
+   header: "EVXC", uint32_t version, uint32_t count
+   record: int64_t expires, uint8_t negative, uint8_t addr_count, uint8_t length,
+           addr_count * (uint8_t family, char addr[16]), char name[length]
+*/
+class NameCacheSnapshot
+{
+    static const uint32_t version = 2;
+    static const size_t header_size = 4 + sizeof(uint32_t) * 2;
+    static const size_t record_head = sizeof(int64_t) + 3;
+    static const size_t addr_size = 1 + sizeof(in6_addr);
+    typedef std::pair<void *, size_t> Mapping;
+    std::vector<Mapping> files;
+
+public:
+    typedef NameCache<PoolAllocator<> > Cache;
+
+    NameCacheSnapshot(const char *path);
+    ~NameCacheSnapshot();
+
+    // returns count of loaded items
+    size_t load(Cache &cache) const;
+
+    // true means error (errno is set)
+    static bool save(const Cache &cache, const char *path, int index);
+};
+
 #endif // __evx_cache_h
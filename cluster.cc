@@ -0,0 +1,184 @@
+#include <arpa/inet.h>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include "cluster.h"
+
+Clusters clusters;
+
+bool
+UpstreamServer::parse(std::string s)
+{
+    port = 80;
+    size_t colon;
+    if (s[0] == '[') {
+        size_t end = s.find(']');
+        if (end == std::string::npos)
+            return true;
+        colon = end + 1 < s.size() ? end + 1 : std::string::npos;
+        if (colon != std::string::npos && s[colon] != ':')
+            return true;
+        s = s.substr(1, end - 1) + s.substr(end + 1);
+        if (colon != std::string::npos)
+            colon -= 2;
+    } else {
+        colon = s.rfind(':');
+    }
+    if (colon != std::string::npos) {
+        char *end;
+        long port = strtol(s.c_str() + colon + 1, &end, 10);
+        if (*end || port < 1 || port > 65535)
+            return true;
+        this->port = port;
+        s.resize(colon);
+    }
+    if (inet_pton(AF_INET, s.c_str(), &addr.v4) == 1) {
+        addr.family = AF_INET;
+        return false;
+    }
+    if (inet_pton(AF_INET6, s.c_str(), &addr.v6) == 1) {
+        addr.family = AF_INET6;
+        return false;
+    }
+    return true;
+}
+
+bool
+Clusters::add(const char *spec, bool hashed)
+{
+    const char *eq = strchr(spec, '=');
+    if (!eq || eq == spec || !eq[1])
+        return true;
+
+    Cluster c;
+    c.index = clusters.size();
+    c.host.assign(spec, eq);
+    if (find(buffer::istring(c.host.data(), c.host.size())))
+        return true;
+
+    for (const char *p = eq + 1; *p;) {
+        const char *comma = strchr(p, ',');
+        size_t n = comma ? comma - p : strlen(p);
+        UpstreamServer server;
+        if (!n || server.parse(std::string(p, n)))
+            return true;
+        c.servers.push_back(server);
+        p += comma ? n + 1 : n;
+    }
+    if (hashed)
+        c.build_table();
+    clusters.push_back(std::move(c));
+    return false;
+}
+
+/* Each server walks its own permutation of slots (offset and skip
+   come from server address) and takes next free slot in turn. */
+void
+Cluster::build_table()
+{
+    static const uint16_t free_slot = UINT16_MAX;
+    size_t n = servers.size();
+    std::vector<uint32_t> offset(n), skip(n), next(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        const UpstreamServer &s = servers[i];
+        uint64_t h = s.addr.family == AF_INET ?
+            hash_key((const char *) &s.addr.v4, sizeof(s.addr.v4)) :
+            hash_key((const char *) &s.addr.v6, sizeof(s.addr.v6));
+        h = hash_key((const char *) &s.port, sizeof(s.port), h);
+        offset[i] = h % table_size;
+        skip[i] = (h >> 32) % (table_size - 1) + 1;
+    }
+
+    table.assign(table_size, free_slot);
+    for (size_t filled = 0; filled < table_size;) {
+        for (size_t i = 0; i < n && filled < table_size; ++i) {
+            uint32_t slot;
+            do
+                slot = (offset[i] + (uint64_t) next[i]++ * skip[i]) % table_size;
+            while (table[slot] != free_slot);
+            table[slot] = i;
+            ++filled;
+        }
+    }
+}
+
+const Cluster *
+Clusters::find(const buffer::istring &host) const
+{
+    for (const Cluster &c: clusters)
+        if (host == buffer::istring(c.host.data(), c.host.size()))
+            return &c;
+    return nullptr;
+}
+
+void
+Balancer::init(const Clusters &clusters, unsigned max_fails_, double eject_time_, uint32_t seed_)
+{
+    max_fails = max_fails_;
+    eject_time = eject_time_;
+    if (seed_)
+        seed = seed_;
+    loads.resize(clusters.size());
+    for (size_t i = 0; i < clusters.size(); ++i)
+        loads[i].resize(clusters[i].servers.size());
+}
+
+unsigned
+Balancer::pick(const Cluster &c, double now, uint64_t key)
+{
+    std::vector<Load> &l = loads[c.index];
+    unsigned n = l.size();
+    unsigned a = 0;
+    if (!c.table.empty()) {
+        a = c.lookup(key);
+        // keys of other servers stay in place
+        for (uint64_t i = 1; i <= 8 && l[a].ejected_until > now; ++i)
+            a = c.lookup(hash_key((const char *) &i, sizeof(i), key));
+    } else if (n > 1) {
+        // two different servers
+        a = random() % n;
+        unsigned b = random() % (n - 1);
+        if (b >= a)
+            ++b;
+        bool ejected_a = l[a].ejected_until > now;
+        bool ejected_b = l[b].ejected_until > now;
+        if (ejected_a != ejected_b ? ejected_a : cost(l[b]) < cost(l[a]))
+            a = b;
+    }
+    l[a].in_flight++;
+    stats.picks++;
+    return a;
+}
+
+void
+Balancer::response(const Cluster &c, unsigned server, double latency)
+{
+    Load &l = loads[c.index][server];
+    // first sample is taken as is
+    l.latency = l.latency ? l.latency + (latency - l.latency) * 0.25 : latency;
+    l.fails = 0;
+}
+
+void
+Balancer::finish(const Cluster &c, unsigned server)
+{
+    Load &l = loads[c.index][server];
+    assert(l.in_flight);
+    if (l.in_flight)
+        l.in_flight--;
+}
+
+void
+Balancer::fail(const Cluster &c, unsigned server, double now)
+{
+    Load &l = loads[c.index][server];
+    assert(l.in_flight);
+    if (l.in_flight)
+        l.in_flight--;
+    stats.failures++;
+    if (max_fails && ++l.fails >= max_fails) {
+        l.ejected_until = now + eject_time;
+        stats.ejections++;
+    }
+}
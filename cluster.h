@@ -0,0 +1,144 @@
+#pragma once
+#ifndef __evx_cluster_h
+#define __evx_cluster_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "buffer_string.h"
+#include "cache.h"
+
+// FNV-1a, h continues hashing of previous data
+inline uint64_t
+hash_key(const char *data, size_t size, uint64_t h = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+struct UpstreamServer
+{
+    HostAddress addr;
+    uint16_t port;
+
+    // ADDR[:PORT], IPv6 address is in brackets; true means error
+    bool parse(std::string s);
+};
+
+/* Servers of one Host (--upstream): requests to the host go to them
+   instead of addresses it resolves to. */
+struct Cluster
+{
+    unsigned index; // in Clusters
+    std::string host;
+    std::vector<UpstreamServer> servers;
+
+    /* Maglev lookup table (--upstream-hash), slot value is server index.
+       Every server owns nearly equal share of slots; when a server is
+       removed from the list, mostly its own slots change owner. */
+    static const size_t table_size = 65537; // prime, much larger than servers count
+    std::vector<uint16_t> table;
+
+    void build_table();
+
+    unsigned lookup(uint64_t key) const
+    {
+        return table[key % table.size()];
+    }
+};
+
+/* Filled from options before accept threads are started, read-only afterwards */
+class Clusters
+{
+    std::vector<Cluster> clusters;
+
+public:
+    /* spec is HOST=ADDR[:PORT][,ADDR[:PORT]...], IPv6 address is in brackets;
+       hashed cluster chooses server by request key; true means error */
+    bool add(const char *spec, bool hashed = false);
+    const Cluster *find(const buffer::istring &host) const;
+
+    size_t size() const
+    {
+        return clusters.size();
+    }
+
+    const Cluster &operator[] (size_t i) const
+    {
+        return clusters[i];
+    }
+};
+
+extern Clusters clusters;
+
+/* Load of cluster servers as seen by one accept thread. Server is chosen
+   by power of two choices: of two random servers the one with lower
+   cost wins, cost is in-flight requests weighted by EWMA of response
+   latency. Hashed cluster takes server from its table instead, while it
+   is ejected the key is rehashed. After max_fails consecutive failures
+   server is ejected for eject_time (unless all candidates are ejected);
+   first failure after ejection ejects it again. */
+class Balancer
+{
+    struct Load
+    {
+        unsigned in_flight = 0;
+        double latency = 0; // EWMA, seconds
+        unsigned fails = 0; // consecutive
+        double ejected_until = 0;
+    };
+
+    std::vector<std::vector<Load>> loads; // by Cluster::index
+    unsigned max_fails = 0;
+    double eject_time = 0;
+    uint32_t seed = 2463534242;
+
+    uint32_t random()
+    {
+        // xorshift32
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    static double cost(const Load &l)
+    {
+        // 1 ms floor: servers with no latency yet are compared by in-flight
+        return (l.in_flight + 1) * (l.latency + 0.001);
+    }
+
+public:
+    struct Stats
+    {
+        size_t picks = 0;
+        size_t failures = 0;
+        size_t ejections = 0;
+    } stats;
+
+    // max_fails == 0 turns off ejection
+    void init(const Clusters &clusters, unsigned max_fails_, double eject_time_, uint32_t seed_);
+
+    // Server index in cluster, its request is counted in flight
+    unsigned pick(const Cluster &c, double now, uint64_t key = 0);
+    // Response head is received after latency seconds
+    void response(const Cluster &c, unsigned server, double latency);
+    // Request of pick() is not in flight anymore
+    void finish(const Cluster &c, unsigned server);
+    void fail(const Cluster &c, unsigned server, double now);
+
+    bool ejected(const Cluster &c, unsigned server, double now) const
+    {
+        return loads[c.index][server].ejected_until > now;
+    }
+    unsigned in_flight(const Cluster &c, unsigned server) const
+    {
+        return loads[c.index][server].in_flight;
+    }
+};
+
+#endif // __evx_cluster_h
@@ -1,13 +1,55 @@
+
 #include "pool.h"
 #include "connection.h"
 
 INIT_POOL(Proxy);
 
-Proxy::Proxy(struct ev_loop* event_loop_, int conn_fd, NameCacheOnPool *_name_cache) :
+thread_local OnEventLoop::EventStats OnEventLoop::event_stats;
+thread_local std::vector<OnEventLoop *> OnEventLoop::dirty;
+thread_local ev_prepare OnEventLoop::apply_watcher;
+thread_local TimerWheel OnEventLoop::timers;
+thread_local ev_timer OnEventLoop::timers_watcher;
+thread_local Uring *OnEventLoop::uring;
+thread_local Proxy::BufferingStats Proxy::buffering_stats;
+thread_local Proxy::TunnelStats Proxy::tunnel_stats;
+thread_local Proxy::AcceptStats Proxy::accept_stats;
+std::vector<uint16_t> Proxy::connect_ports;
+thread_local UpstreamPool Proxy::upstreams;
+thread_local Balancer Proxy::balancer;
+thread_local SourcePool Proxy::sources;
+
+void
+OnEventLoop::init_thread(struct ev_loop *event_loop, Uring *uring_)
+{
+    uring = uring_;
+    ev_prepare_init(&apply_watcher, apply_callback);
+    ev_prepare_start(event_loop, &apply_watcher);
+    // keep prepare watcher from holding ev_run()
+    ev_unref(event_loop);
+
+    timers.start(ev_now(event_loop));
+    ev_timer_init(&timers_watcher, timers_callback, timers.tick_length(), timers.tick_length());
+    ev_timer_start(event_loop, &timers_watcher);
+    ev_unref(event_loop);
+}
+
+void
+OnEventLoop::apply_callback(EV_P_ ev_prepare *w, int revents)
+{
+    for (OnEventLoop *conn: dirty)
+        if (conn)
+            conn->apply_events();
+    dirty.clear();
+}
+
+Proxy::Proxy(struct ev_loop* event_loop_, int conn_fd, Resolver *_resolver) :
     frontend_buffer({ buffer_holder[0], buf_size }),
     backend_buffer({ buffer_holder[1], buf_size }),
-    parser(frontend_buffer, backend_buffer, conn_fd),
-    name_cache{_name_cache},
+    parser(frontend_buffer, backend_buffer),
+    resolver{_resolver},
+    spool(OPT_VALUE_RESPONSE_BUFFER_MEMORY,
+        OPT_VALUE_RESPONSE_BUFFER_MAX * 1024 * 1024,
+        OPT_ARG(BUFFER_DIR)),
     frontend(event_loop_, conn_fd, *this),
     backend(event_loop_, *this)
 {
@@ -15,6 +57,159 @@ Proxy::Proxy(struct ev_loop* event_loop_, int conn_fd, NameCacheOnPool *_name_ca
     frontend_buffer.debug_prefix("F: ");
     backend_buffer.debug_prefix("B: ");
 #endif
+    timer.callback = timeout_callback;
+    timer.data = this;
+    set_timeout(HEADER_TIMEOUT);
+}
+
+void
+Proxy::first_read()
+{
+    // with io_uring data comes with first receive completion
+    if (OnEventLoop::uring)
+        return;
+    accept_stats.reads++;
+    if (!frontend.read_callback() && progress != REQUEST_STARTED)
+        accept_stats.heads++;
+}
+
+void
+Proxy::set_timeout(Timeout t)
+{
+    long value;
+    switch (t) {
+    case HEADER_TIMEOUT:
+        value = OPT_VALUE_CLIENT_HEADER_TIMEOUT;
+        break;
+    case CONNECT_TIMEOUT:
+        value = OPT_VALUE_CONNECT_TIMEOUT;
+        break;
+    case FIRST_BYTE_TIMEOUT:
+        value = OPT_VALUE_FIRST_BYTE_TIMEOUT;
+        break;
+    case BODY_TIMEOUT:
+        value = OPT_VALUE_BODY_TIMEOUT;
+        break;
+    case TUNNEL_TIMEOUT:
+        value = OPT_VALUE_TUNNEL_TIMEOUT;
+        break;
+    case IDLE_TIMEOUT:
+    default:
+        value = OPT_VALUE_KEEPALIVE_TIMEOUT;
+        break;
+    }
+    timeout = t;
+    if (value)
+        OnEventLoop::timers.arm(timer, value);
+    else
+        OnEventLoop::timers.cancel(timer);
+}
+
+const buffer::string GATEWAY_TIMEOUT(
+    "HTTP/1.1 504 Gateway Timeout\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+);
+
+void
+Proxy::timeout_expired()
+{
+    OnEventLoop::event_stats.timeouts++;
+    debug("timeout ", timeout, " expired; progress: ", progress);
+    switch (timeout) {
+    case CONNECT_TIMEOUT:
+        if (!backend.connected()) {
+            // replies 502 or releases proxy
+            set_timeout(CONNECT_TIMEOUT);
+            backend.abort_connect(ETIMEDOUT);
+            return;
+        }
+        break;
+    case FIRST_BYTE_TIMEOUT:
+        if (progress < RESPONSE_HEAD_FINISHED && frontend.buffer.empty()) {
+            // second expiration (while sending error) releases proxy
+            set_timeout(FIRST_BYTE_TIMEOUT);
+            backend.finish_server(true);
+            backend.terminate();
+            progress = RESPONSE_FINISHED;
+            debug("B: changed progress: ", progress);
+            parser.client_keep_alive = false;
+            backend.buffer.reset();
+            spool.clear();
+            frontend.set_error(GATEWAY_TIMEOUT, ETIMEDOUT);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    release();
+}
+
+/* Connection becomes raw tunnel (CONNECT or protocol upgrade), HTTP is
+   not parsed anymore. Data which is in buffers already (reply to client,
+   data client sent early) goes first. */
+void
+Proxy::start_tunnel()
+{
+    debug("tunnel established");
+    progress = TUNNEL;
+    if (!OnEventLoop::uring) {
+        client_relay.open();
+        server_relay.open();
+    }
+    set_timeout(TUNNEL_TIMEOUT);
+    frontend.start_only_events(EV_READ | (backend.buffer.empty() ? 0 : EV_WRITE));
+    backend.start_only_events(EV_READ | (frontend.buffer.empty() ? 0 : EV_WRITE));
+}
+
+bool
+Proxy::relay_read(Relay &r, OnEventLoop &src, OnEventLoop &dst, IOBuffer &buf)
+{
+    bool full;
+    if (r.read(src.fd(), buf, full, src.uring_channel()) < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return false;
+        debug("tunnel read: ", strerror(errno));
+        release();
+        return true;
+    }
+    // destination passes FIN when data is drained
+    if (full || r.eof)
+        src.stop_events(EV_READ);
+    dst.start_events(EV_WRITE);
+    set_timeout(TUNNEL_TIMEOUT);
+    return false;
+}
+
+bool
+Proxy::relay_write(Relay &r, OnEventLoop &src, OnEventLoop &dst, IOBuffer &buf)
+{
+    ssize_t n = r.write(dst.fd(), buf, dst.uring_channel());
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return false;
+        debug("tunnel write: ", strerror(errno));
+        release();
+        return true;
+    }
+    if (n > 0)
+        set_timeout(TUNNEL_TIMEOUT);
+    if (!r.drained(buf))
+        return false;
+
+    dst.stop_events(EV_WRITE);
+    if (!r.eof) {
+        src.start_events(EV_READ);
+        return false;
+    }
+    if (client_relay.shut && server_relay.shut) {
+        debug("tunnel finished");
+        release();
+        return true;
+    }
+    return false;
 }
 
 Proxy::Frontend::Frontend(
@@ -27,7 +222,8 @@ Proxy::Frontend::Frontend(
     parser {proxy.parser},
     buffer {proxy.frontend_buffer},
     backend {proxy.backend},
-    name_cache {proxy.name_cache}
+    resolver {proxy.resolver},
+    spool {proxy.spool}
 {
     debug("Proxy::Frontend created");
 }
@@ -50,11 +246,17 @@ F::R: Proxy::Frontend keeps receiving request body into its buffer, until buffer
 B::W: Backend keeps sending its buffer. When its buffer is empty, it swaps buffers with Proxy::Frontend.
 F::R: When Proxy::Frontend finishes receiving request body, it stops its EV_READ and sets REQUEST_FINISHED status.
 B::W: When both buffers are empty and status is REQUEST_FINISHED, Backend starts EV_READ.
+F::R: With --request-buffering Proxy::Frontend doesn't connect Backend until request body is finished:
+      full buffer is moved to spool instead. Backend sends spool contents before swapping buffers.
 B::R: Backend keeps receiving Server response into its buffer. After first data received
       it starts Proxy::Frontend EV_WRITE.
 F::W: Proxy::Frontend keeps sending its buffer. When its buffer is empty, it swaps buffers with Backend.
 B::R: When Backend finishes receiving response, it stops its EV_READ and sets RESPONSE_FINISHED status.
-F::W: When both buffers are empty and status is RESPONSE_FINISHED, Proxy::Frontend either:
+      Persistent server connection is parked into Proxy::upstreams right then.
+B::R: With --response-buffering Backend doesn't wait for Proxy::Frontend: when its buffer is full,
+      it moves buffer contents to spool and keeps receiving. Proxy::Frontend takes spool contents
+      before swapping buffers.
+F::W: When both buffers (and spool) are empty and status is RESPONSE_FINISHED, Proxy::Frontend either:
     a) drops status, stops EV_WRITE and starts EV_READ in case of keepalive connection;
     b) terminates.
 
@@ -65,9 +267,17 @@ input buffer have: recv_begin, recv_max, read_begin, read_
 bool
 Proxy::Frontend::read_callback()
 {
+    if (progress == TUNNEL)
+        return proxy.relay_read(proxy.client_relay, *this, backend, buffer);
+
+    if (buffering && buffer.free_size() == 0 && spool_request()) {
+        proxy.release();
+        return true;
+    }
+
     buffer::string recv_chunk;
     // 'buffer' semantics is across multiple calls, recv_chunk points to last portion received
-    IOBuffer::Status err = buffer.recv(conn_watcher.fd, recv_chunk);
+    IOBuffer::Status err = buffer.recv(conn_watcher.fd, recv_chunk, 0, channel);
 
     switch (err) {
     case IOBuffer::BUFFER_FULL:
@@ -93,6 +303,8 @@ Proxy::Frontend::read_callback()
     HTTPParser::Status s;
     switch (progress) {
     case REQUEST_STARTED:
+        if (proxy.timeout == IDLE_TIMEOUT)
+            proxy.set_timeout(HEADER_TIMEOUT);
         s = parser.parse_head(recv_chunk);
 
         switch (s) {
@@ -115,6 +327,16 @@ Proxy::Frontend::read_callback()
             }
         #endif
 
+            if (parser.connect_request)
+                return connect_tunnel();
+
+            // request head may be overwritten before server is chosen
+            route = routes.current()->find(parser.host, parser.request_uri);
+            if (route && !route->table.empty()) {
+                request_key = hash_key(parser.host.data(), parser.host.size());
+                request_key = hash_key(parser.request_uri.data(), parser.request_uri.size(), request_key);
+            }
+
             progress =
                 parser.content_length == 0 ||
                 parser.content_length == HTTPParser::cl_unset && !parser.chunked ?
@@ -122,41 +344,24 @@ Proxy::Frontend::read_callback()
                     REQUEST_HEAD_FINISHED;
 
             debug("F: changed progress: ", progress);
-            if (backend.connected()) {
-                in_addr new_ip = host_ip;
-                if (parser.host != host) {
-                    if (set_host(parser.host) || resolve_host(new_ip)) {
-                        debug("F: host resolution failed!");
-                        proxy.release();
-                        return true;
-                    }
-                }
-                if (parser.port != port || new_ip.s_addr != host_ip.s_addr) {
-                    backend.terminate();
-                    host_ip = new_ip;
-                    port = parser.port;
-                    if (backend.connect(host_ip, port)) {
-                        debug("F: backend connection failed!");
-                        proxy.release();
-                        return true;
-                    }
-                    debug("F: connected to ", host, ":", port);
-                } else {
-                    backend.start_only_events(EV_WRITE);
-                    // FIXME: probably, FIN is coming from previous response
-                    // and we just stopped EV_READ...
-                }
-            } else {
-                port = parser.port;
-                if (set_host(parser.host) ||
-                    resolve_host(host_ip) ||
-                    backend.connect(host_ip, port))
+            if (progress == REQUEST_HEAD_FINISHED && ENABLED_OPT(REQUEST_BUFFERING)) {
+                // server is not bothered until whole request is here
+                if (parser.host != host &&
+                    (set_host(parser.host) || (!route && resolve_host(addrs))))
                 {
-                    debug("F: backend connection (or host resolution) failed!");
+                    debug("F: host resolution failed!");
                     proxy.release();
                     return true;
                 }
-                debug("F: connected to ", host, ":", parser.port);
+                // request head is overwritten by body while buffering
+                parser.host = host;
+                buffering = true;
+                spool.limit(OPT_VALUE_REQUEST_BUFFER_MEMORY,
+                    OPT_VALUE_REQUEST_BUFFER_MAX * 1024 * 1024);
+                proxy.set_timeout(BODY_TIMEOUT);
+            } else if (start_backend()) {
+                proxy.release();
+                return true;
             }
 
             if (progress == REQUEST_FINISHED)
@@ -181,6 +386,16 @@ Proxy::Frontend::read_callback()
         case HTTPParser::PROCEED: // reached body end
             progress = REQUEST_FINISHED;
             debug("F: changed progress: ", progress);
+            if (buffering) {
+                buffering = false;
+                if (start_backend()) {
+                    proxy.release();
+                    return true;
+                }
+                goto REQUEST_FINISHED;
+            }
+            if (backend.connected())
+                proxy.set_timeout(FIRST_BYTE_TIMEOUT);
             backend.start_events(EV_WRITE);
             goto REQUEST_FINISHED;
         case HTTPParser::TERMINATE:
@@ -189,13 +404,16 @@ Proxy::Frontend::read_callback()
             return true;
         case HTTPParser::CONTINUE:
         default:
-            backend.start_events(EV_WRITE);
+            if (!buffering)
+                backend.start_events(EV_WRITE);
             return false;
         } // switch (HTTPParser::Status)
 
     case REQUEST_FINISHED:
     default:
-        error("F: unexpected data on finished request!");
+        // client of upgrade may send data before server switched protocols
+        if (!parser.upgrade_request)
+            error("F: unexpected data on finished request!");
     REQUEST_FINISHED:
         // We can't disable READ, because any time client may tear connection.
         ;
@@ -206,16 +424,39 @@ Proxy::Frontend::read_callback()
 bool
 Proxy::Frontend::write_callback()
 {
-    if (buffer.empty()) {
+    if (progress == TUNNEL)
+        return proxy.relay_write(proxy.server_relay, backend, *this, backend.buffer);
+
+    if (buffer.empty() && !spool.empty()) {
+        buffer.reset();
+        ssize_t n = spool.read(const_cast<char *>(buffer.end()), buffer.free_size());
+        if (n < 0) {
+            error("F: reading response buffer failed: ", strerror(errno));
+            proxy.release();
+            return true;
+        }
+        buffer.grow(n);
+        backend.start_events(EV_READ);
+    } else if (buffer.empty()) {
         if (backend.buffer.empty()) {
-            if (progress == RESPONSE_FINISHED) {
+            if (progress == RESPONSE_FINISHED && (!proxy.gzip || proxy.gzip->finished())) {
                 debug("F: Response finished!");
-                if (parser.keep_alive) {
+                if (proxy.gzip) {
+                    proxy.gzip->release();
+                    proxy.gzip = nullptr;
+                }
+                backend.finish_server(false);
+                backend.idle = parser.keep_alive && backend.connected();
+                if (parser.client_keep_alive) {
+                    if (!parser.keep_alive)
+                        backend.terminate();
                     parser.restart_request(buffer);
                     buffer.reset();
                     backend.buffer.reset();
+                    spool.clear();
                     progress = REQUEST_STARTED;
                     debug("F: changed progress: ", progress);
+                    proxy.set_timeout(IDLE_TIMEOUT);
                     start_only_events(EV_READ);
                     return false;
                 }
@@ -231,7 +472,7 @@ Proxy::Frontend::write_callback()
         backend.start_events(EV_READ);
     }
 
-    IOBuffer::Status err = buffer.send(conn_watcher.fd);
+    IOBuffer::Status err = buffer.send(conn_watcher.fd, channel);
 
     switch (err) {
     case IOBuffer::SHUTDOWN:
@@ -247,38 +488,120 @@ Proxy::Frontend::write_callback()
 }
 
 
-void
-Proxy::Frontend::set_error(const buffer::string &err, int err_no)
+/* Connect to server of parsed request (or reuse connection to it);
+   true means error. Host routed to --upstream cluster is not resolved:
+   its server is chosen by balancer for every request. */
+bool
+Proxy::Frontend::start_backend()
 {
-    buffer.reset();
-    buffer.appendm(err, strerror(err_no), " (", err_no, ")");
-    start_only_events(EV_WRITE);
+    uint32_t server_port = parser.port;
+    backend.cluster = route;
+    if (backend.cluster) {
+        if (set_host(parser.host))
+            return true;
+        backend.request_time = ev_now(event_loop);
+        backend.server = balancer.pick(*backend.cluster, backend.request_time, request_key);
+        const UpstreamServer &s = backend.cluster->servers[backend.server];
+        addrs = HostAddresses();
+        addrs.add(s.addr);
+        server_port = s.port;
+    } else if (!backend.connected() || parser.host != host) {
+        if (set_host(parser.host) || resolve_host(addrs)) {
+            debug("F: host resolution failed!");
+            return true;
+        }
+    }
+    if (backend.connected() &&
+        (parser.connect_request || server_port != port || !addrs.contains(backend.peer)))
+    {
+        backend.release_connection();
+    }
+    backend.idle = false;
+    port = server_port;
+
+    if (backend.connected()) {
+        backend.start_only_events(EV_WRITE);
+        // FIXME: probably, FIN is coming from previous response
+        // and we just stopped EV_READ...
+    } else {
+        // idle connection from Proxy::upstreams is connected at once
+        // tunnel gets its own connection
+        if (backend.connect(addrs, port, !parser.connect_request)) {
+            debug("F: backend connection failed!");
+            return true;
+        }
+        debug("F: connecting to ", host, ":", port);
+    }
+    proxy.set_timeout(!backend.connected() ? CONNECT_TIMEOUT :
+        progress == REQUEST_FINISHED ? FIRST_BYTE_TIMEOUT : BODY_TIMEOUT);
+    return false;
 }
 
-bool Proxy::Frontend::resolve_host(in_addr &host_ip)
+const buffer::string FORBIDDEN(
+    "HTTP/1.1 403 Forbidden\r\n"
+    "Connection: close\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+);
+
+/* CONNECT head is parsed: server is connected directly (tunnel is not
+   routed), relay starts when connection is established (see
+   Backend::write_callback()). Client is not read meanwhile, data it sent
+   early waits in buffer. */
+bool
+Proxy::Frontend::connect_tunnel()
 {
-    if (name_cache && name_cache->get(host_ip, host))
+    progress = REQUEST_FINISHED;
+    debug("F: changed progress: ", progress);
+    stop_events(EV_READ);
+    route = nullptr;
+    if (std::find(connect_ports.begin(), connect_ports.end(), parser.port) == connect_ports.end()) {
+        debug("F: CONNECT to port ", parser.port, " is not allowed");
+        progress = RESPONSE_FINISHED;
+        parser.client_keep_alive = false;
+        backend.buffer.reset();
+        set_error(FORBIDDEN, EACCES);
         return false;
-
-    struct addrinfo hints, *res;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_family = AF_INET;
-
-    int err = getaddrinfo(host_cstr, NULL, &hints, &res);
-    if (err != 0) {
-        error("getaddrinfo: ", gai_strerror(err));
+    }
+    if (start_backend()) {
+        proxy.release();
         return true;
     }
+    return false;
+}
 
-    host_ip = ((sockaddr_in *) (res->ai_addr))->sin_addr;
-    freeaddrinfo(res);
+/* Move full buffer to spool while request body is buffered. Without spool
+   room the rest of request is streamed to server as usual. */
+bool
+Proxy::Frontend::spool_request()
+{
+    if (!spool.full()) {
+        bool spilled = spool.spilled();
+        if (!spool.write(buffer)) {
+            buffering_stats.request_bytes += buffer.size();
+            if (!spilled && spool.spilled())
+                buffering_stats.request_spilled++;
+            buffer.reset();
+            return false;
+        }
+        error("F: buffering request failed: ", strerror(errno));
+    }
+    debug("F: request buffer is exhausted, streaming the rest");
+    buffering = false;
+    return start_backend();
+}
 
-    if (name_cache)
-        name_cache->insert(host_ip, host);
+void
+Proxy::Frontend::set_error(const buffer::string &err, int err_no)
+{
+    buffer.reset();
+    buffer.appendm(err, strerror(err_no), " (", err_no, ")");
+    start_only_events(EV_WRITE);
+}
 
-    return false;
+bool Proxy::Frontend::resolve_host(HostAddresses &addrs)
+{
+    return resolver->resolve(host_cstr, host, addrs);
 }
 
 
@@ -290,34 +613,217 @@ Proxy::Backend::Backend(
     progress { proxy.progress },
     parser { proxy.parser },
     buffer { proxy.backend_buffer },
-    frontend { proxy.frontend }
+    frontend { proxy.frontend },
+    spool { proxy.spool }
 {
     debug("Proxy::Backend created");
     conn_watcher.fd = 0;
+    for (Attempt &a: attempts)
+        ev_init(&a.watcher, attempt_callback);
+    ev_init(&attempt_timer, attempt_timer_callback);
+    attempt_timer.data = this;
+}
+
+Proxy::Backend::~Backend()
+{
+    cancel_attempts();
+}
+
+bool
+Proxy::Backend::connect(const HostAddresses &addrs, uint32_t port, bool reuse)
+{
+    assert(!connected() && !active_attempts);
+    connect_port = port;
+    int fd = reuse ? upstreams.take(addrs, port, peer) : -1;
+    reused = fd >= 0;
+    deferred = false;
+    if (reused) {
+        debug("B: reusing idle connection");
+        hold_request(false);
+        start_connected(fd);
+        return false;
+    }
+    connect_addrs = addrs;
+    next_addr = 0;
+    last_error = 0;
+    return start_attempt(); // true means error
 }
 
+/* Start connection to next address; true means there is nothing left to try. */
 bool
-Proxy::Backend::connect(in_addr ip, uint32_t port)
+Proxy::Backend::start_attempt()
 {
-    conn_watcher.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if (conn_watcher.fd < 0) {
-        throw Errno("socket");;
+    while (next_addr < connect_addrs.count && active_attempts < max_attempts) {
+        const HostAddress &addr = connect_addrs.addr[next_addr++];
+        // client of tunnel may wait for server to speak first
+        bool fastopen = false;
+        int fd = sources.connect(addr, connect_port, !parser.connect_request, &fastopen);
+        if (fd < 0) {
+            last_error = errno;
+            debug("connect: ", strerror(errno));
+            continue;
+        }
+
+        Attempt *a = std::find_if(attempts, attempts + max_attempts,
+            [] (Attempt &a) { return !ev_is_active(&a.watcher); });
+        assert(a != attempts + max_attempts);
+        a->addr = addr;
+        a->deferred = fastopen;
+        // On connection error EV_READ is activated faster when you trying to write
+        ev_io_init(&a->watcher, attempt_callback, fd, EV_READ|EV_WRITE);
+        a->watcher.data = this;
+        ev_io_start(event_loop, &a->watcher);
+        active_attempts++;
+
+        ev_timer_stop(event_loop, &attempt_timer);
+        if (next_addr < connect_addrs.count) {
+            ev_timer_set(&attempt_timer, OPT_VALUE_CONNECT_ATTEMPT_DELAY / 1000., 0.);
+            ev_timer_start(event_loop, &attempt_timer);
+        }
+        return false;
     }
+    return active_attempts == 0;
+}
 
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    serv_addr.sin_addr = ip;
+void
+Proxy::Backend::attempt_finished(Attempt &a)
+{
+    int fd = a.watcher.fd;
+    int sockerr;
+    socklen_t optlen = sizeof(sockerr);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &sockerr, &optlen) < 0)
+        throw Errno("getsockopt");
 
-    int err = ::connect(conn_watcher.fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
-    if (err < 0 && errno != EINPROGRESS) {
-        debug("connect: ", strerror(errno));
-        return true;
+    ev_io_stop(event_loop, &a.watcher);
+    active_attempts--;
+
+    if (sockerr) {
+        debug("connect: ", strerror(sockerr));
+        close(fd);
+        last_error = sockerr;
+        if (start_attempt()) {
+            ev_timer_stop(event_loop, &attempt_timer);
+            error_callback(last_error);
+        }
+        return;
+    }
+
+    peer = a.addr;
+    deferred = a.deferred;
+    if (deferred)
+        hold_request(true);
+    cancel_attempts();
+    start_connected(fd);
+    proxy.set_timeout(progress == REQUEST_FINISHED ? FIRST_BYTE_TIMEOUT : BODY_TIMEOUT);
+}
+
+void
+Proxy::Backend::release_connection()
+{
+    // io_uring: request may be still in flight when server answers early
+    if (idle && connected() && flushed())
+        upstreams.put(detach_fd(), peer, connect_port);
+    else
+        terminate();
+    idle = false;
+}
+
+/* Response ended by Content-Length, chunks or bodiless status; server
+   connection of close-delimited one is not kept (see parser keep_alive). */
+void
+Proxy::Backend::finish_response()
+{
+    finish_server(false);
+    if (!parser.keep_alive)
+        return;
+    idle = true;
+    release_connection();
+}
+
+void
+Proxy::Backend::finish_server(bool failed)
+{
+    if (!cluster)
+        return;
+    if (failed)
+        balancer.fail(*cluster, server, ev_now(event_loop));
+    else
+        balancer.finish(*cluster, server);
+    cluster = nullptr;
+}
+
+void
+Proxy::Backend::cancel_attempts()
+{
+    for (Attempt &a: attempts) {
+        if (ev_is_active(&a.watcher)) {
+            ev_io_stop(event_loop, &a.watcher);
+            close(a.watcher.fd);
+        }
     }
+    active_attempts = 0;
+    ev_timer_stop(event_loop, &attempt_timer);
+}
 
-    // On connection error EV_READ is activated faster when you trying to write
-    start_conn_watcher<connect_callback>(EV_READ|EV_WRITE);
-    return false; // true means error
+/* Request received in full is held for sending again: of idempotent
+   method on reused connection, of any method on deferred one (server
+   which hasn't accepted connection hasn't got its SYN data). */
+void
+Proxy::Backend::hold_request(bool any_method)
+{
+    resend = buffer::string();
+    if (progress != REQUEST_FINISHED || !spool.empty() || !(any_method || parser.idempotent_request))
+        return;
+    // body which has come is moved after head, so request is in one buffer
+    if (!frontend.buffer.empty()) {
+        if (frontend.buffer.size() > buffer.free_size())
+            return;
+        buffer.append(frontend.buffer);
+        frontend.buffer.reset();
+    }
+    resend = buffer;
+}
+
+/* Connection is gone before response: reused one was closed by server
+   while it was idle, Fast Open one wasn't established at all. Request goes
+   on new connection to the same server or (as after any failed connect
+   attempt) to next address, if it is held; otherwise client gets 502. */
+bool
+Proxy::Backend::retry(int err)
+{
+    debug("B: ", reused ? "reused" : "Fast Open", " connection failed: ", strerror(err));
+    bool stale = reused;
+    if (stale)
+        upstreams.stats.stale++;
+    else
+        sources.stats.fastopen_failures++;
+    stop_all_events();
+    terminate();
+    reused = false;
+    deferred = false;
+    if (progress > REQUEST_FINISHED) {
+        progress = REQUEST_FINISHED;
+        debug("B: changed progress: ", progress);
+    }
+    if (progress < REQUEST_FINISHED || resend.empty()) {
+        resend = buffer::string();
+        return error_callback(err);
+    }
+    if (buffer.holds(resend))
+        buffer.assign(resend.begin(), resend.size());
+    resend = buffer::string();
+    if (stale) {
+        HostAddresses addrs;
+        addrs.add(peer);
+        if (connect(addrs, connect_port, false))
+            return error_callback(last_error);
+    } else {
+        last_error = err;
+        if (start_attempt())
+            return error_callback(last_error);
+    }
+    proxy.set_timeout(CONNECT_TIMEOUT);
+    return false;
 }
 
 const buffer::string BAD_GATEWAY(
@@ -331,27 +837,58 @@ bool
 Proxy::Backend::error_callback(int err)
 {
     debug("connect: ", strerror(err));
+    finish_server(true);
     if (progress != REQUEST_FINISHED) {
         proxy.release();
         return true;
     }
     progress = RESPONSE_FINISHED;
     debug("B: changed progress: ", progress);
+    parser.client_keep_alive = false;
     buffer.reset();
+    spool.clear(); // unsent request
     frontend.set_error(BAD_GATEWAY, err);
     stop_all_events();
     return false;
 }
 
 
+const buffer::string CONNECTION_ESTABLISHED(
+    "HTTP/1.1 200 Connection established\r\n"
+    "\r\n"
+);
+
 bool
 Proxy::Backend::write_callback()
 {
-    if (buffer.empty()) {
+    if (progress == TUNNEL)
+        return proxy.relay_write(proxy.client_relay, frontend, *this, frontend.buffer);
+    if (parser.connect_request) {
+        // reply goes to client as if it came from server
+        buffer.reset();
+        buffer.appendm(CONNECTION_ESTABLISHED);
+        tunnel_stats.connects++;
+        proxy.start_tunnel();
+        return false;
+    }
+
+    if (buffer.empty() && !spool.empty()) {
+        buffer.reset();
+        ssize_t n = spool.read(const_cast<char *>(buffer.end()), buffer.free_size());
+        if (n < 0) {
+            error("B: reading request buffer failed: ", strerror(errno));
+            proxy.release();
+            return true;
+        }
+        buffer.grow(n);
+    } else if (buffer.empty()) {
         if (frontend.buffer.empty()) {
             if (progress == REQUEST_FINISHED) {
                 // maybe do this in read_callback() ?
                 buffer.reset();
+                spool.limit(OPT_VALUE_RESPONSE_BUFFER_MEMORY,
+                    OPT_VALUE_RESPONSE_BUFFER_MAX * 1024 * 1024);
+                rechunk = false;
                 progress = RESPONSE_STARTED;
                 debug("B: changed progress: ", progress);
                 start_only_events(EV_READ);
@@ -367,11 +904,13 @@ Proxy::Backend::write_callback()
         frontend.start_events(EV_READ);
     }
 
-    IOBuffer::Status err = buffer.send(conn_watcher.fd);
+    IOBuffer::Status err = buffer.send(conn_watcher.fd, channel);
 
     switch (err) {
     case IOBuffer::SHUTDOWN:
     case IOBuffer::OTHER_ERROR:
+        if (unconfirmed())
+            return retry(errno);
         proxy.release();
         return true;
     case IOBuffer::WOULDBLOCK:
@@ -383,11 +922,218 @@ Proxy::Backend::write_callback()
 }
 
 
+const buffer::string TRANSFER_CHUNKED("Transfer-Encoding: chunked\r\n");
+const buffer::string CHUNK_END("\r\n");
+const buffer::string LAST_CHUNK("0\r\n\r\n");
+
+const buffer::string CONNECTION_CLOSE("Connection: close\r\n");
+const buffer::string CONNECTION_KEEP_ALIVE("Connection: keep-alive\r\n");
+
+/* Response head is in buffer, recv_chunk is the body part after it.
+   Connection header of server is about server connection, so it is
+   replaced by the one for client (if HTTP version of client needs it).
+   For re-chunking Transfer-Encoding is added and HTTP/1.0 status line
+   becomes HTTP/1.1. recv_chunk is moved along with the body. */
+void
+Proxy::Backend::rewrite_head(buffer::string &recv_chunk)
+{
+    rechunk = progress == RESPONSE_WAIT_SHUTDOWN && parser.can_rechunk();
+    parser.client_keep_alive = !parser.force_close &&
+        (progress != RESPONSE_WAIT_SHUTDOWN || rechunk);
+
+    const buffer::string *connection = nullptr;
+    if (!parser.client_keep_alive)
+        connection = &CONNECTION_CLOSE;
+    else if (parser.request_version <= 1000)
+        connection = &CONNECTION_KEEP_ALIVE;
+
+    const buffer::string &conn = parser.connection_header;
+    if (conn.empty() && !connection && !rechunk)
+        return;
+
+    assert(!(connection && rechunk));
+    assert(buffer.free_size() + conn.size() >= head_reserve);
+
+    if (rechunk && parser.response_version <= 1000)
+        memcpy(const_cast<char *>(parser.http_version.begin()), "1.1", 3);
+
+    const char *body = recv_chunk.begin();
+    if (!conn.empty()) {
+        buffer.erase(conn.begin(), conn.size());
+        body -= conn.size();
+    }
+    // before CRLF which ends the head
+    const buffer::string &add = rechunk ? TRANSFER_CHUNKED : *connection;
+    if (rechunk || connection) {
+        buffer.insert(body - 2, add);
+        body += add.size();
+    }
+    recv_chunk.assign(body, buffer.end());
+
+    if (rechunk) {
+        debug("B: passing close-delimited response chunked");
+        if (!recv_chunk.empty())
+            frame_chunk(recv_chunk);
+    }
+}
+
+// recv_chunk must be at the end of buffer
+void
+Proxy::Backend::frame_chunk(const buffer::string &recv_chunk)
+{
+    char size_line[sizeof("ffffffff\r\n")];
+    int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", recv_chunk.size());
+    buffer.insert(recv_chunk.begin(), buffer::string(size_line, n));
+    buffer.insert(buffer.end(), CHUNK_END);
+}
+
+/* Move full buffer to spool, so response can be received further
+   while client is busy. Without spool room it is backpressure as usual. */
+void
+Proxy::Backend::spool_response()
+{
+    if (spool.full())
+        return;
+
+    bool spilled = spool.spilled();
+    if (spool.write(buffer)) {
+        error("B: buffering response failed: ", strerror(errno));
+        return;
+    }
+    buffering_stats.response_bytes += buffer.size();
+    if (!spilled && spool.spilled())
+        buffering_stats.response_spilled++;
+    buffer.reset();
+}
+
+const buffer::string GZIP_HEADERS(
+    "Content-Encoding: gzip\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "\r\n"
+);
+
+// Chunked response of server would have to be de-chunked, it passes as is
+bool
+Proxy::Backend::can_compress() const
+{
+    if (!GzipStream::enabled() || !parser.accept_gzip || parser.no_transform ||
+        parser.chunked || !parser.content_encoding.empty() || !parser.can_rechunk())
+    {
+        return false;
+    }
+    return buffer::stol(parser.status_code) == 200 && GzipStream::compressible(parser.content_type);
+}
+
+/* Response head is in buffer, recv_chunk is the body part after it;
+   true means proxy is released. Content-Length and Connection of server
+   are dropped, head goes to spool with gzip headers, and chunks of
+   compressor follow it there (see compressed()). Buffer only receives
+   body from now on. */
+bool
+Proxy::Backend::start_gzip(buffer::string &recv_chunk)
+{
+    parser.client_keep_alive = true;
+    if (parser.response_version <= 1000)
+        memcpy(const_cast<char *>(parser.http_version.begin()), "1.1", 3);
+
+    // the later line goes first, so the other one stays in place
+    const buffer::string *lines[2] = {&parser.connection_header, &parser.content_length_header};
+    if (!lines[0]->empty() && !lines[1]->empty() && lines[0]->begin() < lines[1]->begin())
+        std::swap(lines[0], lines[1]);
+    const char *head_end = recv_chunk.begin() - 2; // before CRLF which ends the head
+    for (const buffer::string *line: lines) {
+        if (!line->empty()) {
+            buffer.erase(line->begin(), line->size());
+            head_end -= line->size();
+        }
+    }
+    if (spool.write(buffer::string(buffer.begin(), head_end)) || spool.write(GZIP_HEADERS)) {
+        error("B: buffering response failed: ", strerror(errno));
+        proxy.release();
+        return true;
+    }
+    recv_chunk.assign(head_end + 2, buffer.end());
+    debug("B: compressing response");
+    frontend.start_only_events(EV_WRITE);
+    return compress(recv_chunk);
+}
+
+// Body part goes to compressor; true means proxy is released
+bool
+Proxy::Backend::compress(buffer::string &recv_chunk)
+{
+    if (progress == RESPONSE_HEAD_FINISHED && !recv_chunk.empty()) {
+        buffer::string body = recv_chunk;
+        switch (parser.parse_body(body)) {
+        case HTTPParser::PROCEED:
+            progress = RESPONSE_FINISHED;
+            debug("B: changed progress: ", progress);
+            proxy.gzip->finish();
+            finish_response();
+            break;
+        case HTTPParser::TERMINATE:
+            error("B: parsing HTTP response body failed!");
+            proxy.release();
+            return true;
+        case HTTPParser::CONTINUE:
+        default:
+            break;
+        }
+    }
+    proxy.gzip->write(recv_chunk.data(), recv_chunk.size());
+    buffer.reset();
+    proxy.gzip->submit();
+    if (gzip_backlog())
+        stop_events(EV_READ);
+    return false;
+}
+
+bool
+Proxy::Backend::gzip_backlog() const
+{
+    return proxy.gzip->pending() >= GzipStream::block_size || spool.full() ||
+        (!ENABLED_OPT(RESPONSE_BUFFERING) && spool.size() >= GzipStream::block_size);
+}
+
+void
+Proxy::Backend::compressed()
+{
+    GzipStream *gzip = proxy.gzip;
+    if (!gzip->output.empty()) {
+        if (spool.write(gzip->output)) {
+            error("B: buffering response failed: ", strerror(errno));
+            proxy.release();
+            return;
+        }
+        gzip->output.clear();
+        frontend.start_events(EV_WRITE);
+    }
+    gzip->submit();
+    if (gzip->finished())
+        frontend.start_events(EV_WRITE);
+    else if (connected() && !gzip_backlog())
+        start_events(EV_READ);
+}
+
 bool
 Proxy::Backend::read_callback()
 {
+    if (progress == TUNNEL)
+        return proxy.relay_read(proxy.server_relay, *this, frontend, buffer);
+
+    if (proxy.gzip && gzip_backlog()) {
+        spurious_reads++;
+        stop_events(EV_READ);
+        return false;
+    }
+
+    // response head is parsed inside buffer, so it is never spooled
+    if (buffer.free_size() <= recv_reserve() && progress > RESPONSE_STARTED && ENABLED_OPT(RESPONSE_BUFFERING))
+        spool_response();
+
     buffer::string recv_chunk;
-    IOBuffer::Status err = buffer.recv(conn_watcher.fd, recv_chunk);
+    IOBuffer::Status err = buffer.recv(conn_watcher.fd, recv_chunk, recv_reserve(), channel);
 
     switch (err) {
     case IOBuffer::BUFFER_FULL:
@@ -395,16 +1141,32 @@ Proxy::Backend::read_callback()
         stop_events(EV_READ);
         return false;
     case IOBuffer::SHUTDOWN:
+        if (unconfirmed())
+            return retry(ECONNRESET);
         stop_all_events();
         close_fd();
         // TODO: check protocol, content-length, etc. to notify if its illegal to shutdown now
-        if (progress > REQUEST_STARTED) { // otherwise it is FIN from previous response
+        // otherwise it is FIN from previous response (idle while request is buffered)
+        if (progress > REQUEST_STARTED && !frontend.buffering) {
+            if (progress < RESPONSE_HEAD_FINISHED)
+                finish_server(true);
+            if (rechunk) {
+                buffer.insert(buffer.end(), LAST_CHUNK);
+                rechunk = false;
+            }
+            if (proxy.gzip && progress != RESPONSE_FINISHED) {
+                proxy.gzip->finish();
+                proxy.gzip->submit();
+            }
             progress = RESPONSE_FINISHED;
             debug("B: changed progress: ", progress);
             frontend.start_events(EV_WRITE);
         }
         return false;
     case IOBuffer::OTHER_ERROR:
+        if (unconfirmed())
+            return retry(errno);
+        finish_server(progress < RESPONSE_HEAD_FINISHED);
         proxy.release();
         return true;
     case IOBuffer::WOULDBLOCK:
@@ -415,6 +1177,12 @@ Proxy::Backend::read_callback()
 
     assert(progress >= REQUEST_FINISHED);
 
+    if (proxy.gzip && progress != RESPONSE_STARTED)
+        return compress(recv_chunk);
+
+    if (rechunk)
+        frame_chunk(recv_chunk);
+
     HTTPParser::Status s;
     switch (progress) {
     case RESPONSE_STARTED:
@@ -436,12 +1204,34 @@ Proxy::Backend::read_callback()
                 ", chunked: ", parser.chunked,
                 ", keep-alive: ", parser.keep_alive, ")");
         #endif
-            progress = parser.content_length == 0 ?
+            if (cluster)
+                balancer.response(*cluster, server, ev_now(event_loop) - request_time);
+
+            if (parser.upgrade_request && buffer::stol(parser.status_code) == 101) {
+                // head goes to client as is, frames follow it in buffer
+                debug("B: switching protocols");
+                tunnel_stats.upgrades++;
+                proxy.start_tunnel();
+                return false;
+            }
+
+            progress = parser.content_length == 0 || parser.bodiless_response() ?
                 RESPONSE_FINISHED :
                 (parser.content_length == HTTPParser::cl_unset && !parser.chunked ?
-                    (parser.keep_alive ? RESPONSE_FINISHED : RESPONSE_WAIT_SHUTDOWN) :
+                    RESPONSE_WAIT_SHUTDOWN :
                     RESPONSE_HEAD_FINISHED);
             debug("B: changed progress: ", progress);
+            proxy.set_timeout(BODY_TIMEOUT);
+            if (progress != RESPONSE_FINISHED && can_compress()) {
+                try {
+                    proxy.gzip = new GzipStream(gzip_done, &proxy);
+                } catch (std::bad_alloc &) {
+                    error("B: no memory for compression, passing response as is");
+                }
+                if (proxy.gzip)
+                    return start_gzip(recv_chunk);
+            }
+            rewrite_head(recv_chunk);
 
             // ... and start EV_WRITE when we finished the head.
             frontend.start_only_events(EV_WRITE);
@@ -490,15 +1280,16 @@ Proxy::Backend::read_callback()
     RESPONSE_WAIT_SHUTDOWN:
     case RESPONSE_WAIT_SHUTDOWN:
         // In case of non-persistent connection we just pass body of unknown size
-        // to frontend until we receive connection shutdown.
-        // TODO: maybe timeout it or put maxbody limit
+        // to frontend until we receive connection shutdown (or --body-timeout).
+        if (!recv_chunk.empty() || rechunk)
+            frontend.start_events(EV_WRITE);
         return false;
 
     case RESPONSE_FINISHED:
         error("B: unexpected data on finished response!");
+        return false;
     RESPONSE_FINISHED:
-        // We can't disable READ, because any time backend may tear connection.
-        ;
+        finish_response();
     } // switch (progress)
     return false;
 }
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <cassert>
+#include <vector>
 
 #include <netdb.h>
 #include <sys/unistd.h>
@@ -19,24 +20,145 @@
 #include "buffer_string.h"
 #include "http.h"
 #include "util.h"
-#include "cache.h"
+#include "resolver.h"
+#include "timer.h"
+#include "spool.h"
+#include "upstream.h"
+#include "route.h"
+#include "gzip.h"
+#include "relay.h"
+#include "uring.h"
 
 class OnEventLoop :
     public virtual non_copyable
 {
 protected:
     ev_io conn_watcher;
+    Uring::Channel *channel = nullptr; // instead of conn_watcher with io_uring
     size_t spurious_reads = 0;
     size_t spurious_writes = 0;
 
-    void close_fd()
+    void close_fd(bool shut = false)
     {
-        close(conn_watcher.fd);
+        if (channel) {
+            // closed when queued data is sent
+            channel->close(shut);
+            channel = nullptr;
+        } else {
+            if (shut)
+                shutdown(conn_watcher.fd, SHUT_RDWR);
+            // closed fd must not stay in event loop until next apply_events()
+            ev_io_stop(event_loop, &conn_watcher);
+            close(conn_watcher.fd);
+        }
+        conn_watcher.events = 0;
+        wanted_events = 0;
         conn_watcher.fd = 0;
     }
 
-private:
+    // fd is passed to new owner
+    int detach_fd()
+    {
+        int fd = conn_watcher.fd;
+        if (channel) {
+            channel->detach();
+            channel = nullptr;
+        } else {
+            ev_io_stop(event_loop, &conn_watcher);
+        }
+        conn_watcher.events = 0;
+        wanted_events = 0;
+        conn_watcher.fd = 0;
+        return fd;
+    }
+
+    // Nothing sent is still queued in user space (io_uring)
+    bool flushed() const
+    {
+        return !channel || channel->flushed();
+    }
+
     struct ev_loop *event_loop;
+
+public:
+    int fd() const
+    {
+        return conn_watcher.fd;
+    }
+
+    Uring::Channel *uring_channel() const
+    {
+        return channel;
+    }
+
+    /* Watcher mask changes are coalesced: start_events() and friends only
+       record wanted mask, and its net change is applied once per event loop
+       iteration (before polling). One request flips masks many times, but
+       only a few of the flips survive until next poll. */
+    struct EventStats
+    {
+        size_t transitions = 0; // mask changes requested
+        size_t updates = 0; // mask changes applied to watchers
+        size_t timeouts = 0; // expired connection timers
+    };
+    static thread_local EventStats event_stats;
+
+    // Connection timeouts of this thread (see Proxy::set_timeout())
+    static thread_local TimerWheel timers;
+    // Sockets of this thread go through it, not readiness watchers (--event-backend io_uring)
+    static thread_local Uring *uring;
+
+    // Must be called in event loop thread before running the loop
+    static void init_thread(struct ev_loop *event_loop, Uring *uring = nullptr);
+
+private:
+    int wanted_events = 0;
+    int dirty_index = -1; // position in dirty list, -1 if not there
+    static thread_local std::vector<OnEventLoop *> dirty;
+    static thread_local ev_prepare apply_watcher;
+
+    void set_events(int events)
+    {
+        if (events == wanted_events)
+            return;
+        wanted_events = events;
+        if (!conn_watcher.fd) // not connected yet (see Proxy::Backend::connect())
+            return;
+        event_stats.transitions++;
+        if (dirty_index < 0) {
+            dirty_index = dirty.size();
+            dirty.push_back(this);
+        }
+    }
+
+    void apply_events()
+    {
+        dirty_index = -1;
+        if (channel) {
+            channel->watch(wanted_events);
+            event_stats.updates++;
+            return;
+        }
+        if (!conn_watcher.fd || wanted_events == (conn_watcher.events & (EV_READ | EV_WRITE)))
+            return;
+        ev_io_stop(event_loop, &conn_watcher);
+        conn_watcher.events = wanted_events;
+        if (wanted_events)
+            ev_io_start(event_loop, &conn_watcher);
+        event_stats.updates++;
+    }
+
+    static void
+    apply_callback(EV_P_ ev_prepare *w, int revents);
+
+    static thread_local ev_timer timers_watcher;
+
+    static void
+    timers_callback(EV_P_ ev_timer *w, int revents)
+    {
+        timers.advance(ev_now(EV_A));
+    }
+
     ev_async async_watcher;
     bool async_task = false;
 
@@ -50,6 +172,8 @@ private:
     conn_callback (EV_P_ ev_io *w, int revents)
     {
         OnEventLoop *self = (OnEventLoop *)w->data;
+        // events stopped in this iteration are not applied yet
+        revents &= self->wanted_events;
         if (revents & EV_READ)
             if (self->read_callback()) {
                 return;
@@ -60,6 +184,13 @@ private:
             }
     }
 
+    static void
+    channel_callback(void *owner, int revents)
+    {
+        OnEventLoop *self = (OnEventLoop *)owner;
+        conn_callback(self->event_loop, &self->conn_watcher, revents);
+    }
+
     static void
     async_callback (EV_P_ ev_async *w, int revents)
     {
@@ -70,9 +201,7 @@ private:
             delete self;
             return;
         }
-        ev_io_stop(self->event_loop, &self->conn_watcher);
-        self->conn_watcher.events = EV_READ | EV_WRITE;
-        ev_io_start(self->event_loop, &self->conn_watcher);
+        self->set_events(EV_READ | EV_WRITE);
     }
 
 public:
@@ -81,10 +210,8 @@ public:
     {
         if (conn_watcher.fd) {
             debug("terminating connection");
-            ev_io_stop(event_loop, &conn_watcher);
             // No matter if it's not connected, ENOTCONN is not fatal
-            shutdown(conn_watcher.fd, SHUT_RDWR);
-            close_fd();
+            close_fd(true);
         }
     }
 
@@ -96,13 +223,11 @@ public:
     void start_events_(int events, const char* caller_name)
 #endif
     {
-        if (conn_watcher.events & events)
+        if (wanted_events & events)
             return;
 
-        ev_io_stop(event_loop, &conn_watcher);
-        conn_watcher.events |= events;
-        ev_io_start(event_loop, &conn_watcher);
-        debug("started events: ", events, "; running: ", conn_watcher.events, " [", caller_name, "]");
+        set_events(wanted_events | events);
+        debug("started events: ", events, "; running: ", wanted_events, " [", caller_name, "]");
     }
 
 #ifdef NDEBUG
@@ -113,15 +238,12 @@ public:
     void stop_events_(int events, const char* caller_name)
 #endif
     {
-        if (conn_watcher.events & events == 0)
+        if ((wanted_events & events) == 0)
             return;
 
-        ev_io_stop(event_loop, &conn_watcher);
-        conn_watcher.events &= ~events;
-
-        if (conn_watcher.events) {
-            ev_io_start(event_loop, &conn_watcher);
-            debug("stopped events: ", events, "; running: ", conn_watcher.events, " [", caller_name, "]");
+        set_events(wanted_events & ~events);
+        if (wanted_events) {
+            debug("stopped events: ", events, "; running: ", wanted_events, " [", caller_name, "]");
         } else {
             debug("stopped events: ", events, "; no events running [", caller_name, "]");
         }
@@ -129,17 +251,13 @@ public:
 
     void start_only_events(int events)
     {
-        if (conn_watcher.events)
-            ev_io_stop(event_loop, &conn_watcher);
-        conn_watcher.events = events;
-        ev_io_start(event_loop, &conn_watcher);
+        set_events(events);
         debug("started events: ", events);
     }
 
     void stop_all_events()
     {
-        ev_io_stop(event_loop, &conn_watcher);
-        conn_watcher.events = 0;
+        set_events(0);
         debug("stopped all events");
     }
 
@@ -159,8 +277,29 @@ protected:
         } else {
             ev_io_stop(event_loop, &conn_watcher);
             ev_io_init(&conn_watcher, conn_callback, conn_watcher.fd, EV_WRITE);
+            wanted_events = EV_WRITE;
+            ev_io_start(event_loop, &conn_watcher);
+        }
+    }
+
+    // fd was connected asynchronously by its owner
+    void start_connected(int fd, int events = EV_WRITE)
+    {
+        ev_io_init(&conn_watcher, conn_callback, fd, events);
+        conn_watcher.data = this;
+        wanted_events = events;
+        start_channel();
+    }
+
+    // Watcher is started, or io_uring takes I/O of its fd
+    void start_channel()
+    {
+        if (!uring) {
             ev_io_start(event_loop, &conn_watcher);
+            return;
         }
+        channel = uring->open(conn_watcher.fd, channel_callback, this);
+        channel->watch(wanted_events);
     }
 
     static void
@@ -175,20 +314,24 @@ public:
         event_loop { event_loop_ }
     {
         debug("OnEventLoop created");
+        ev_init(&conn_watcher, conn_callback);
         conn_watcher.fd = 0;
+        conn_watcher.events = 0;
         ev_async_init(&async_watcher, async_callback);
         async_watcher.data = this;
     }
 
+    // fd is non-blocking already (accept4(), socket(), socketpair())
     template <callback_f CALLBACK = conn_callback>
     void start_conn_watcher(int events = EV_READ)
     {
-        if (fcntl(conn_watcher.fd, F_SETFL, fcntl(conn_watcher.fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
-            throw Errno("fcntl");
-        }
         ev_io_init(&conn_watcher, CALLBACK, conn_watcher.fd, events);
         conn_watcher.data = this;
-        ev_io_start(event_loop, &conn_watcher);
+        wanted_events = events;
+        if (CALLBACK == conn_callback)
+            start_channel();
+        else
+            ev_io_start(event_loop, &conn_watcher);
     }
 
     OnEventLoop(struct ev_loop *event_loop_, int conn_fd, int events = EV_READ) :
@@ -201,6 +344,8 @@ public:
     virtual ~OnEventLoop()
     {
         terminate();
+        if (dirty_index >= 0)
+            dirty[dirty_index] = nullptr;
         debug("OnEventLoop destroying; spurious events: ", spurious_reads, " reads, ", spurious_writes, " writes");
     }
 };
@@ -284,6 +429,12 @@ public:
         return buffer.begin();
     }
 
+    // s is in memory of this buffer
+    bool holds(const buffer::string &s) const
+    {
+        return s.begin() >= buffer.begin() && s.end() <= buffer.end();
+    }
+
     IOBuffer& append(buffer::string &add)
     {
         size_t count = std::min(add.size(), free_size());
@@ -313,13 +464,36 @@ public:
         return *this;
     }
 
-    Status recv(int fd, buffer::string &recv_chunk)
+    // Shifts the rest of data; true means there is no space
+    bool insert(const_pointer pos, const buffer::string &str)
+    {
+        if (str.size() > free_size())
+            return true;
+        char *p = const_cast<char *>(pos);
+        memmove(p + str.size(), p, end() - pos);
+        str.copy(p);
+        grow(str.size());
+        return false;
+    }
+
+    void erase(const_pointer pos, size_type count)
+    {
+        char *p = const_cast<char *>(pos);
+        memmove(p, p + count, end() - pos - count);
+        shrink(count);
+    }
+
+    // reserve: free space which is left for caller; channel: fd is on io_uring
+    Status recv(int fd, buffer::string &recv_chunk, size_type reserve = 0,
+        Uring::Channel *channel = nullptr)
     {
         size_type free_size = IOBuffer::free_size();
-        if (free_size == 0) {
+        if (free_size <= reserve) {
             return BUFFER_FULL;
         }
-        ssize_t recv_size = ::recv(fd, const_cast<char*>(end()), free_size, 0);
+        char *dst = const_cast<char*>(end());
+        ssize_t recv_size = channel ? channel->recv(dst, free_size - reserve) :
+            ::recv(fd, dst, free_size - reserve, 0);
         if (recv_size == 0) {
             debug(prefix, "peer shutdown");
             return SHUTDOWN;
@@ -346,9 +520,10 @@ public:
         return OK;
     }
 
-    Status send(int fd)
+    Status send(int fd, Uring::Channel *channel = nullptr)
     {
-        ssize_t sent_size = ::send(fd, data(), size(), MSG_NOSIGNAL);
+        ssize_t sent_size = channel ? channel->send(data(), size()) :
+            ::send(fd, data(), size(), MSG_NOSIGNAL);
         if (sent_size < 0) {
             switch (errno) {
             case EWOULDBLOCK:
@@ -386,16 +561,44 @@ class Proxy :
         RESPONSE_STARTED,
         RESPONSE_HEAD_FINISHED,
         RESPONSE_WAIT_SHUTDOWN,
-        RESPONSE_FINISHED
+        RESPONSE_FINISHED,
+        TUNNEL // CONNECT or upgraded connection, see relay_read()
+    };
+
+    /* Deadline of current stage, only one is armed at a time.
+       Body timeout limits whole transfer of request or response body. */
+    enum Timeout
+    {
+        HEADER_TIMEOUT = 0, // client request head
+        CONNECT_TIMEOUT, // upstream connection
+        FIRST_BYTE_TIMEOUT, // upstream response head
+        BODY_TIMEOUT,
+        IDLE_TIMEOUT, // keep-alive client between requests
+        TUNNEL_TIMEOUT // no data in tunnel
     };
 
     Progress progress = REQUEST_STARTED;
+    Timeout timeout = HEADER_TIMEOUT;
+    TimerNode timer;
     static const size_t buf_size = 4096;
     char buffer_holder[2][buf_size];
     IOBuffer frontend_buffer;
     IOBuffer backend_buffer;
     HTTPParser parser;
-    NameCacheOnPool *name_cache;
+    Resolver *resolver;
+    /* Request (with --request-buffering) or response (with --response-buffering)
+       data which didn't fit into buffers. It goes before the buffer
+       of receiving side. */
+    Spool spool;
+    /* Compressor of response body (--gzip-types). Its chunks go to spool,
+       so all response data goes to client through spool then. */
+    GzipStream *gzip = nullptr;
+
+    static void
+    gzip_done(void *owner)
+    {
+        ((Proxy *) owner)->backend.compressed();
+    }
 
     struct Backend;
 
@@ -409,14 +612,18 @@ class Proxy :
         HTTPParser &parser;
         IOBuffer &buffer;
         Backend &backend;
-        NameCacheOnPool *&name_cache;
+        Resolver *&resolver;
+        Spool &spool;
 
         ssize_t sent_size = 0;
+        bool buffering = false; // request body goes to spool, backend is not started
+        const Cluster *route = nullptr; // cluster of request, see Routes
+        uint64_t request_key = 0; // Host and URI hash for --upstream-hash
 
         static const size_t max_host_size = 253;
         char host_cstr[max_host_size + 1];
         buffer::istring host;
-        in_addr host_ip;
+        HostAddresses addrs;
         uint32_t port = 0;
 
         bool
@@ -426,6 +633,8 @@ class Proxy :
                 error("Host size ", host.size(), " is too large!");
                 return true;
             }
+            if (_host.begin() == host_cstr) // already set by buffered request
+                return false;
             _host.copy(host_cstr, max_host_size);
             host_cstr[_host.size()] = 0;
             host.assign(host_cstr, _host.size());
@@ -440,7 +649,10 @@ class Proxy :
         { return false; }
 
         void set_error(const buffer::string &err, int err_no);
-        bool resolve_host(in_addr &host_ip);
+        bool resolve_host(HostAddresses &addrs);
+        bool start_backend();
+        bool connect_tunnel();
+        bool spool_request();
     };
 
     struct Backend :
@@ -453,28 +665,206 @@ class Proxy :
         HTTPParser &parser;
         IOBuffer &buffer;
         Frontend &frontend;
+        Spool &spool;
 
         // TODO: test with buf_size = 1, 2, 3, etc.
 
         Backend(struct ev_loop* event_loop_, Proxy &proxy_);
+        ~Backend();
 
-        bool connect(in_addr ip, uint32_t port);
+        // reuse: idle connection from Proxy::upstreams may be taken
+        bool connect(const HostAddresses &addrs, uint32_t port, bool reuse = true);
         bool connected() const
         {
             return conn_watcher.fd;
         }
 
+        void abort_connect(int err)
+        {
+            cancel_attempts();
+            error_callback(err);
+        }
+
+        HostAddress peer; // address of established connection
+        bool idle = false; // finished persistent response, may be parked
+        bool reused = false; // taken from Proxy::upstreams for this request
+        bool deferred = false; // Fast Open connection, server has not answered yet
+
+        // Parks idle connection into Proxy::upstreams, otherwise closes it
+        void release_connection();
+
+        // Output of compressor is taken into spool
+        void compressed();
+
+        // Server of --upstream cluster which got the request
+        const Cluster *cluster = nullptr;
+        unsigned server = 0;
+        ev_tstamp request_time = 0;
+
+        // Request is not in flight anymore (balancer load)
+        void finish_server(bool failed);
+
+        /* Response is received in full: persistent connection is parked
+           at once, while client may still be reading the response */
+        void finish_response();
+
     private:
         bool read_callback() override;
         bool write_callback() override;
         bool error_callback(int err) override;
+        void spool_response();
+
+        /* Close-delimited response is passed to HTTP/1.1 client in chunked
+           encoding, so client connection is kept alive. Every received portion
+           is framed in place, room for framing (and for headers added while
+           receiving response head) is reserved on receive. */
+        bool rechunk = false;
+        static const size_t rechunk_reserve =
+            sizeof("ffffffff\r\n") - 1 + sizeof("\r\n") - 1 + sizeof("0\r\n\r\n") - 1;
+        static const size_t head_reserve =
+            sizeof("Transfer-Encoding: chunked\r\n") - 1 + rechunk_reserve;
+
+        size_t recv_reserve() const
+        {
+            return rechunk ? rechunk_reserve :
+                progress == RESPONSE_STARTED ? head_reserve : 0;
+        }
+
+        void rewrite_head(buffer::string &recv_chunk);
+        void frame_chunk(const buffer::string &recv_chunk);
+
+        bool can_compress() const;
+        // true means proxy is released
+        bool start_gzip(buffer::string &recv_chunk);
+        bool compress(buffer::string &recv_chunk);
+        // Enough is waiting for compressor or client, server is not read
+        bool gzip_backlog() const;
+
+        /* Happy Eyeballs (RFC 8305): connection attempt to next address is
+           started each --connect-attempt-delay (or at once when previous
+           attempt failed), first established connection wins. */
+        struct Attempt
+        {
+            ev_io watcher; // must be first
+            HostAddress addr;
+            bool deferred; // see SourcePool::connect()
+        };
+        static const unsigned max_attempts = 3; // simultaneous
+        Attempt attempts[max_attempts];
+        unsigned active_attempts = 0;
+        ev_timer attempt_timer;
+        HostAddresses connect_addrs;
+        unsigned next_addr = 0;
+        uint16_t connect_port = 0;
+        int last_error = 0;
+
+        bool start_attempt();
+        void attempt_finished(Attempt &a);
+        void cancel_attempts();
+
+        /* Whole request as it was sent on reused or deferred connection
+           (empty if it can't be sent again): it stays in its buffer until
+           response is received into it. */
+        buffer::string resend;
+        void hold_request(bool any_method);
+
+        // Connection may fail as not established one (see retry())
+        bool
+        unconfirmed() const
+        {
+            return (reused || deferred) &&
+                (progress < RESPONSE_STARTED || (progress == RESPONSE_STARTED && buffer.empty()));
+        }
+
+        // true means proxy is released
+        bool retry(int err);
+
+        static void
+        attempt_callback(EV_P_ ev_io *w, int revents)
+        {
+            ((Backend *) w->data)->attempt_finished(*(Attempt *) w);
+        }
+
+        static void
+        attempt_timer_callback(EV_P_ ev_timer *w, int revents)
+        {
+            Backend *self = (Backend *) w->data;
+            if (self->start_attempt())
+                self->error_callback(self->last_error);
+        }
     };
 
     Frontend frontend;
     Backend backend;
 
+    Relay client_relay; // client to server
+    Relay server_relay; // server to client
+
+    void start_tunnel();
+    // true means proxy is released
+    bool relay_read(Relay &r, OnEventLoop &src, OnEventLoop &dst, IOBuffer &buf);
+    bool relay_write(Relay &r, OnEventLoop &src, OnEventLoop &dst, IOBuffer &buf);
+
+    void set_timeout(Timeout t);
+    void timeout_expired();
+
+    static void
+    timeout_callback(TimerNode *node)
+    {
+        ((Proxy *) node->data)->timeout_expired();
+    }
+
 public:
-    Proxy(struct ev_loop* event_loop_, int conn_fd, NameCacheOnPool *name_cache);
+    struct BufferingStats
+    {
+        size_t request_bytes = 0; // request data buffered
+        size_t request_spilled = 0; // requests which went to temporary file
+        size_t response_bytes = 0;
+        size_t response_spilled = 0;
+    };
+    static thread_local BufferingStats buffering_stats;
+
+    struct TunnelStats
+    {
+        size_t connects = 0; // established CONNECT tunnels
+        size_t upgrades = 0; // 101 Switching Protocols
+    };
+    static thread_local TunnelStats tunnel_stats;
+
+    struct AcceptStats
+    {
+        size_t reads = 0; // first reads of accepted connections
+        size_t heads = 0; // request heads parsed by them
+    };
+    static thread_local AcceptStats accept_stats;
+
+    // --connect-ports, set on startup
+    static std::vector<uint16_t> connect_ports;
+
+    static thread_local UpstreamPool upstreams;
+    static thread_local Balancer balancer;
+    static thread_local SourcePool sources; // of server connections
+
+    Proxy(struct ev_loop* event_loop_, int conn_fd, Resolver *resolver);
+    // Via received-by is via_name (" name\r\n"), local address if it is empty
+    void set_client(const buffer::string &via_name, const in_addr &local, const in_addr &peer)
+    {
+        parser.set_addresses(via_name, local, peer);
+    }
+    /* Request mostly comes along with connection (always with
+       --defer-accept), so it's read in accept callback instead of next
+       loop iteration. Proxy may be released. */
+    void first_read();
+    ~Proxy()
+    {
+        if (gzip)
+            gzip->release();
+        backend.finish_server(false);
+        backend.release_connection();
+        OnEventLoop::timers.cancel(timer);
+    }
 }; // class Connection
 
+DECLARE_POOL(Proxy);
+
 #endif // __udtproxy_connection_h
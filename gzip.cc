@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include "gzip.h"
+
+thread_local GzipStream::Stats GzipStream::stats;
+thread_local GzipStream::Queue GzipStream::queue;
+const size_t GzipStream::block_size;
+std::vector<std::string> GzipStream::types;
+int GzipStream::level = Z_DEFAULT_COMPRESSION;
+
+bool
+GzipStream::compressible(const buffer::string &content_type)
+{
+    size_t end = content_type.find(';');
+    if (end == buffer::string::npos)
+        end = content_type.size();
+    while (end && (content_type[end - 1] == ' ' || content_type[end - 1] == '\t'))
+        --end;
+    buffer::istring media(content_type.begin(), end);
+    size_t slash = media.find('/');
+    for (const std::string &t: types) {
+        if (media == t)
+            return true;
+        // type/*
+        if (t.size() > 2 && t.compare(t.size() - 2, 2, "/*") == 0 && slash == t.size() - 2 &&
+            buffer::istring(media.begin(), slash) == t.substr(0, slash))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+GzipStream::init_thread(struct ev_loop *event_loop, ThreadPool *workers)
+{
+    queue.event_loop = event_loop;
+    queue.workers = workers;
+    ev_async_init(&queue.watcher, queue_callback);
+    queue.watcher.data = &queue;
+    ev_async_start(event_loop, &queue.watcher);
+}
+
+bool
+GzipStream::enabled()
+{
+    return queue.workers && !types.empty();
+}
+
+GzipStream::GzipStream(done_f done_, void *owner_) :
+    owner_queue {&queue},
+    done_callback {done_},
+    owner {owner_}
+{
+    memset(&z, 0, sizeof(z));
+    // 16 in window bits: gzip header and trailer instead of zlib ones
+    if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::bad_alloc();
+    stats.responses++;
+}
+
+GzipStream::~GzipStream()
+{
+    deflateEnd(&z);
+}
+
+void
+GzipStream::release()
+{
+    if (running)
+        owner = nullptr;
+    else
+        delete this;
+}
+
+void
+GzipStream::submit()
+{
+    if (running || done || (input.empty() && !last))
+        return;
+    size_t n = std::min(input.size(), block_size);
+    block.assign(input, 0, n);
+    input.erase(0, n);
+    block_last = last && input.empty();
+    running = true;
+    DeflateTask task(this);
+    owner_queue->workers->add_task(task);
+}
+
+void
+GzipStream::DeflateTask::execute()
+{
+    stream->deflate_block();
+    stream->owner_queue->push(stream);
+}
+
+/* Full block means data is coming faster than it is compressed, so
+   output is not flushed to save ratio; otherwise client gets everything
+   compressed so far at once. */
+void
+GzipStream::deflate_block()
+{
+    int flush = block_last ? Z_FINISH : block.size() < block_size ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+    result.clear();
+    z.next_in = (Bytef *) block.data();
+    z.avail_in = block.size();
+    int err;
+    do {
+        size_t out = result.size();
+        size_t room = deflateBound(&z, z.avail_in) + 64;
+        result.resize(out + room);
+        z.next_out = (Bytef *) &result[out];
+        z.avail_out = room;
+        err = deflate(&z, flush);
+        result.resize(out + room - z.avail_out);
+    } while (err == Z_OK && (z.avail_in || z.avail_out == 0 || flush == Z_FINISH));
+    assert(err == Z_OK || err == Z_STREAM_END || err == Z_BUF_ERROR);
+    block.clear();
+
+    // zero size chunk would end the body
+    if (!result.empty()) {
+        char size_line[sizeof("ffffffff\r\n")];
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", result.size());
+        result.insert(0, size_line, n);
+        result += "\r\n";
+    }
+    if (block_last)
+        result += "0\r\n\r\n";
+}
+
+void
+GzipStream::Queue::push(GzipStream *s)
+{
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        done.push_back(s);
+    }
+    ev_async_send(event_loop, &watcher);
+}
+
+void
+GzipStream::Queue::apply()
+{
+    std::vector<GzipStream *> finished;
+    {
+        std::lock_guard<std::mutex> lock(mx);
+        finished.swap(done);
+    }
+
+    for (GzipStream *s: finished) {
+        s->running = false;
+        if (!s->owner) {
+            delete s;
+            continue;
+        }
+        if (s->block_last)
+            s->done = true;
+        stats.bytes_out += s->result.size();
+        s->output += s->result;
+        s->result.clear();
+        s->done_callback(s->owner);
+    }
+}
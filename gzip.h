@@ -0,0 +1,137 @@
+#pragma once
+#ifndef __evx_gzip_h
+#define __evx_gzip_h
+
+#include <ev.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "buffer_string.h"
+#include "threads.h"
+#include "util.h"
+
+/* gzip content coding of response body (--gzip-types). Deflate runs on
+   worker threads, event loop only hands input over and takes output back,
+   which is framed as HTTP chunks already. One block of a stream is in work
+   at a time, so output comes back in order. */
+class GzipStream :
+    public virtual non_copyable
+{
+public:
+    // Owner is notified in event loop thread when block is done
+    typedef void (*done_f)(void *owner);
+
+    static const size_t block_size = 65536; // input of one deflate run
+
+    struct Stats
+    {
+        size_t responses = 0;
+        size_t bytes_in = 0;
+        size_t bytes_out = 0;
+    };
+    static thread_local Stats stats;
+
+    // --gzip-types and --gzip-level, set on startup
+    static std::vector<std::string> types;
+    static int level;
+
+    // Media type of Content-Type value is in types ("text/*" matches subtypes)
+    static bool compressible(const buffer::string &content_type);
+
+    // Must be called in event loop thread before running the loop
+    static void init_thread(struct ev_loop *event_loop, ThreadPool *workers);
+    // Worker threads are there for this thread
+    static bool enabled();
+
+    // throws std::bad_alloc
+    GzipStream(done_f done_, void *owner_);
+
+    // Owner is gone: stream is deleted now or when its block is done
+    void release();
+
+    // Input to compress; submit() takes it to worker
+    void write(const char *data, size_t size)
+    {
+        input.append(data, size);
+        stats.bytes_in += size;
+    }
+    // No more input, gzip trailer goes after the last block
+    void finish()
+    {
+        last = true;
+    }
+    // Starts next block on worker, if any and none is in work
+    void submit();
+
+    bool busy() const
+    {
+        return running;
+    }
+    size_t pending() const
+    {
+        return input.size();
+    }
+    // Last chunk was produced (and maybe not taken yet)
+    bool finished() const
+    {
+        return done && !running;
+    }
+
+    // Chunks produced so far, caller clears it
+    std::string output;
+
+private:
+    class DeflateTask : public Task
+    {
+        GzipStream *stream;
+
+    public:
+        DeflateTask(GzipStream *stream_) :
+            stream {stream_}
+        {}
+
+        void execute() override;
+    };
+
+    struct Queue
+    {
+        struct ev_loop *event_loop = nullptr;
+        ThreadPool *workers = nullptr;
+        ev_async watcher;
+        std::mutex mx;
+        std::vector<GzipStream *> done; // guarded by mx
+
+        void push(GzipStream *s); // called from worker thread
+        void apply();
+    };
+    static thread_local Queue queue;
+
+    static void
+    queue_callback(EV_P_ ev_async *w, int revents)
+    {
+        ((Queue *) w->data)->apply();
+    }
+
+    ~GzipStream();
+
+    Queue *owner_queue; // of event loop thread
+    done_f done_callback;
+    void *owner;
+    z_stream z;
+
+    std::string input; // not taken yet
+    bool last = false;
+    bool done = false; // trailer is produced
+
+    // Worker side, event loop doesn't touch them while running
+    bool running = false;
+    std::string block;
+    bool block_last = false;
+    std::string result;
+
+    void deflate_block();
+};
+
+#endif // __evx_gzip_h
@@ -0,0 +1,792 @@
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+#include "connection.h"
+#include "h2.h"
+
+thread_local H2Connection::Stats H2Connection::stats;
+const size_t H2Connection::max_frame;
+const int64_t H2Connection::stream_window;
+const int64_t H2Connection::connection_window;
+
+static const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t preface_size = sizeof(client_preface) - 1;
+
+static void
+put32(char *p, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(p, &value, 4);
+}
+
+static uint32_t
+get32(const char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return ntohl(value);
+}
+
+// Hop-by-hop headers don't exist in HTTP/2
+static bool
+connection_header(const std::string &name)
+{
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+        name == "transfer-encoding" || name == "upgrade";
+}
+
+H2Connection::H2Connection(struct ev_loop *event_loop_, int fd, const in_addr &local_, const in_addr &peer_,
+        open_f open_, void *open_ctx_) :
+    event_loop {event_loop_},
+    local (local_),
+    peer (peer_),
+    open {open_},
+    open_ctx {open_ctx_},
+    in (head_size + max_frame)
+{
+    ev_io_init(&watcher, callback, fd, EV_READ);
+    watcher.data = this;
+    ev_io_start(event_loop, &watcher);
+    hpack.list_limit = max_header_list;
+    idle_timer.callback = idle_callback;
+    idle_timer.data = this;
+    if (OPT_VALUE_KEEPALIVE_TIMEOUT)
+        OnEventLoop::timers.arm(idle_timer, OPT_VALUE_KEEPALIVE_TIMEOUT);
+    stats.connections++;
+    debug("h2c: connection accepted");
+
+    // server preface
+    char settings[18] = {0, 3, 0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 6};
+    put32(settings + 2, max_streams);
+    put32(settings + 8, stream_window);
+    put32(settings + 14, max_header_list);
+    send_frame(SETTINGS, 0, 0, settings, sizeof(settings));
+    char credit[4];
+    put32(credit, connection_window - 65535);
+    send_frame(WINDOW_UPDATE, 0, 0, credit, sizeof(credit));
+}
+
+H2Connection::~H2Connection()
+{
+    debug("h2c: closing connection with ", streams.size(), " streams");
+    for (auto &i: streams) {
+        Stream *s = i.second;
+        ev_io_stop(event_loop, &s->watcher);
+        close(s->watcher.fd);
+        delete s;
+    }
+    ev_io_stop(event_loop, &watcher);
+    close(watcher.fd);
+    OnEventLoop::timers.cancel(idle_timer);
+}
+
+void
+H2Connection::idle_callback(TimerNode *node)
+{
+    ((H2Connection *) node->data)->close_connection(NO_ERROR);
+}
+
+// Sends GOAWAY (as much as socket takes at once) and deletes connection
+bool
+H2Connection::close_connection(Error err)
+{
+    if (err != NO_ERROR)
+        error("h2c: connection error ", err);
+    char payload[8];
+    put32(payload, last_id);
+    put32(payload + 4, err);
+    send_frame(GOAWAY, 0, 0, payload, sizeof(payload));
+    send(watcher.fd, out.data() + out_pos, out.size() - out_pos, MSG_NOSIGNAL | MSG_DONTWAIT);
+    delete this;
+    return true;
+}
+
+void
+H2Connection::update()
+{
+    int events = EV_READ | (out_pos < out.size() ? EV_WRITE : 0);
+    if (events == (watcher.events & (EV_READ | EV_WRITE)))
+        return;
+    ev_io_stop(event_loop, &watcher);
+    ev_io_set(&watcher, watcher.fd, events);
+    ev_io_start(event_loop, &watcher);
+}
+
+void
+H2Connection::callback(EV_P_ ev_io *w, int revents)
+{
+    H2Connection *self = (H2Connection *) w->data;
+    if ((revents & EV_READ) && self->read_frames())
+        return;
+    if ((revents & EV_WRITE) && self->write_frames())
+        return;
+    self->update();
+}
+
+bool
+H2Connection::read_frames()
+{
+    ssize_t n = recv(watcher.fd, &in[in_size], in.size() - in_size, 0);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return false;
+        delete this;
+        return true;
+    }
+    in_size += n;
+
+    size_t pos = 0;
+    if (!preface) {
+        if (memcmp(&in[0], client_preface, std::min(in_size, preface_size))) {
+            debug("h2c: no client preface");
+            delete this;
+            return true;
+        }
+        if (in_size < preface_size)
+            return false;
+        preface = true;
+        pos = preface_size;
+    }
+    while (in_size - pos >= head_size) {
+        const unsigned char *head = (const unsigned char *) &in[pos];
+        size_t size = head[0] << 16 | head[1] << 8 | head[2];
+        if (size > max_frame)
+            return close_connection(FRAME_SIZE_ERROR);
+        if (in_size - pos < head_size + size)
+            break;
+        uint32_t id = get32(&in[pos + 5]) & 0x7fffffff;
+        if (handle_frame((FrameType) head[3], head[4], id, &in[pos + head_size], size))
+            return true;
+        pos += head_size + size;
+    }
+    memmove(&in[0], &in[pos], in_size - pos);
+    in_size -= pos;
+    return false;
+}
+
+bool
+H2Connection::write_frames()
+{
+    if (out_pos < out.size()) {
+        ssize_t n = send(watcher.fd, out.data() + out_pos, out.size() - out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return false;
+            delete this;
+            return true;
+        }
+        out_pos += n;
+        if (out_pos == out.size()) {
+            out.clear();
+            out_pos = 0;
+        }
+    }
+    if (out_blocked && out.size() - out_pos < out_limit) {
+        out_blocked = false;
+        resume_streams();
+    }
+    if (goaway && streams.empty() && out.empty()) {
+        delete this;
+        return true;
+    }
+    return false;
+}
+
+void
+H2Connection::send_frame(FrameType type, uint8_t flags, uint32_t id, const char *data, size_t size)
+{
+    char head[head_size] = {char(size >> 16), char(size >> 8), char(size), char(type), char(flags)};
+    put32(head + 5, id);
+    out.append(head, head_size);
+    if (size)
+        out.append(data, size);
+    if (!(watcher.events & EV_WRITE))
+        update();
+}
+
+void
+H2Connection::send_reset(uint32_t id, Error err)
+{
+    char code[4];
+    put32(code, err);
+    send_frame(RST_STREAM, 0, id, code, sizeof(code));
+}
+
+// Window is returned by quarters, not to send WINDOW_UPDATE on every DATA
+void
+H2Connection::send_window_update(uint32_t id, int64_t &owed_, int64_t window)
+{
+    if (owed_ < window / 4)
+        return;
+    char credit[4];
+    put32(credit, owed_);
+    send_frame(WINDOW_UPDATE, 0, id, credit, sizeof(credit));
+    owed_ = 0;
+}
+
+bool
+H2Connection::handle_frame(FrameType type, uint8_t flags, uint32_t id, const char *data, size_t size)
+{
+    if (header_stream && (type != CONTINUATION || id != header_stream))
+        return close_connection(PROTOCOL_ERROR);
+
+    switch (type) {
+    case DATA:
+    {
+        if (!id)
+            return close_connection(PROTOCOL_ERROR);
+        // padding counts for flow control too, it is returned at once
+        size_t frame_size = size;
+        if (flags & PADDED) {
+            if (!size || (uint8_t) data[0] >= size)
+                return close_connection(PROTOCOL_ERROR);
+            size -= (uint8_t) data[0] + 1;
+            data++;
+        }
+        owed += frame_size - size;
+        auto i = streams.find(id);
+        if (i == streams.end() || i->second->request_end) {
+            if (id > last_id)
+                return close_connection(PROTOCOL_ERROR);
+            // stream is closed by us
+            owed += size;
+        } else {
+            Stream &s = *i->second;
+            s.owed += frame_size - size;
+            if (request_data(s, data, size))
+                break;
+            if (flags & END_STREAM)
+                end_request(s);
+        }
+        send_window_update(0, owed, connection_window);
+        break;
+    }
+    case HEADERS:
+    {
+        if (!id)
+            return close_connection(PROTOCOL_ERROR);
+        size_t padding = 0;
+        if (flags & PADDED) {
+            if (!size)
+                return close_connection(PROTOCOL_ERROR);
+            padding = (uint8_t) data[0];
+            data++;
+            size--;
+        }
+        if (flags & PRIORITY_FLAG) {
+            if (size < 5)
+                return close_connection(PROTOCOL_ERROR);
+            data += 5;
+            size -= 5;
+        }
+        if (padding > size)
+            return close_connection(PROTOCOL_ERROR);
+        header_block.assign(data, size - padding);
+        header_end_stream = flags & END_STREAM;
+        if (!(flags & END_HEADERS)) {
+            header_stream = id;
+            break;
+        }
+        return handle_headers(id, header_end_stream);
+    }
+    case CONTINUATION:
+        if (!header_stream)
+            return close_connection(PROTOCOL_ERROR);
+        header_block.append(data, size);
+        if (header_block.size() > 4 * max_frame)
+            return close_connection(PROTOCOL_ERROR);
+        if (flags & END_HEADERS) {
+            header_stream = 0;
+            return handle_headers(id, header_end_stream);
+        }
+        break;
+    case RST_STREAM:
+    {
+        auto i = streams.find(id);
+        if (i != streams.end()) {
+            stats.resets++;
+            close_stream(*i->second);
+        }
+        break;
+    }
+    case SETTINGS:
+        if (id)
+            return close_connection(PROTOCOL_ERROR);
+        if (flags & ACK)
+            break;
+        if (size % 6)
+            return close_connection(FRAME_SIZE_ERROR);
+        for (size_t i = 0; i < size; i += 6) {
+            uint16_t key = (uint8_t) data[i] << 8 | (uint8_t) data[i + 1];
+            uint32_t value = get32(data + i + 2);
+            // our encoder doesn't index, so table size is not interesting
+            if (key == 4) { // INITIAL_WINDOW_SIZE
+                if (value > 0x7fffffff)
+                    return close_connection(FLOW_CONTROL_ERROR);
+                for (auto &j: streams)
+                    j.second->send_window += value - initial_window;
+                initial_window = value;
+            }
+        }
+        send_frame(SETTINGS, ACK, 0);
+        resume_streams();
+        break;
+    case PING:
+        if (size != 8)
+            return close_connection(FRAME_SIZE_ERROR);
+        if (!(flags & ACK))
+            send_frame(PING, ACK, 0, data, size);
+        break;
+    case GOAWAY:
+        debug("h2c: got GOAWAY");
+        goaway = true;
+        if (streams.empty()) {
+            delete this;
+            return true;
+        }
+        break;
+    case WINDOW_UPDATE:
+    {
+        if (size != 4)
+            return close_connection(FRAME_SIZE_ERROR);
+        uint32_t credit = get32(data) & 0x7fffffff;
+        if (!id) {
+            if (!credit)
+                return close_connection(PROTOCOL_ERROR);
+            bool blocked = send_window <= 0;
+            send_window += credit;
+            if (blocked)
+                resume_streams();
+            break;
+        }
+        auto i = streams.find(id);
+        if (i == streams.end())
+            break;
+        if (!credit) {
+            reset_stream(*i->second, PROTOCOL_ERROR);
+            break;
+        }
+        i->second->send_window += credit;
+        update(*i->second);
+        break;
+    }
+    case PUSH_PROMISE:
+        return close_connection(PROTOCOL_ERROR);
+    case PRIORITY:
+    default:
+        break;
+    }
+    return false;
+}
+
+/* Request is passed as HTTP/1.1 with Connection: close: Proxy closes
+   its end after response, it is the end of stream. */
+bool
+H2Connection::handle_headers(uint32_t id, bool end_stream)
+{
+    // block is decoded anyway, dynamic table depends on it
+    Hpack::Headers headers;
+    if (hpack.decode(header_block.data(), header_block.size(), headers))
+        return close_connection(COMPRESSION_ERROR);
+
+    auto i = streams.find(id);
+    if (i != streams.end()) {
+        // trailers are not passed
+        if (end_stream)
+            end_request(*i->second);
+        return false;
+    }
+    if (!(id & 1))
+        return close_connection(PROTOCOL_ERROR);
+    if (id <= last_id || goaway)
+        return false;
+    last_id = id;
+    if (streams.size() >= max_streams) {
+        stats.refused++;
+        send_reset(id, REFUSED_STREAM);
+        return false;
+    }
+    if (hpack.list_truncated()) {
+        stats.large_heads++;
+        std::string block;
+        Hpack::encode_status(block, 431);
+        send_frame(HEADERS, END_HEADERS | END_STREAM, id, block.data(), block.size());
+        // rest of request is not needed
+        if (!end_stream)
+            send_reset(id, NO_ERROR);
+        return false;
+    }
+
+    std::string method, path, authority, host, cookie, fields;
+    bool content_length = false;
+    for (const Hpack::Field &f: headers) {
+        const std::string &name = f.name;
+        if (name.empty() || name.find_first_of("\r\n:", 1) != std::string::npos ||
+            f.value.find_first_of(std::string("\r\n\0", 3)) != std::string::npos)
+        {
+            send_reset(id, PROTOCOL_ERROR);
+            return false;
+        }
+        if (name[0] == ':') {
+            // :scheme is not needed by server
+            if (name == ":method")
+                method = f.value;
+            else if (name == ":path")
+                path = f.value;
+            else if (name == ":authority")
+                authority = f.value;
+        } else if (name == "cookie") {
+            // crumbs are joined back (RFC 7540 8.1.2.5)
+            if (!cookie.empty())
+                cookie += "; ";
+            cookie += f.value;
+        } else if (name == "host") {
+            host = f.value;
+        } else if (!connection_header(name) && name != "te" && name != "expect") {
+            content_length = content_length || name == "content-length";
+            fields += name + ": " + f.value + "\r\n";
+        }
+    }
+    if (authority.empty())
+        authority = host;
+    bool tunnel = method == "CONNECT";
+    if (method.empty() || authority.empty() || (path.empty() && !tunnel)) {
+        send_reset(id, PROTOCOL_ERROR);
+        return false;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+        error("h2c: socketpair: ", strerror(errno));
+        stats.refused++;
+        send_reset(id, REFUSED_STREAM);
+        return false;
+    }
+    if (open(open_ctx, fds[0], local, peer)) {
+        close(fds[0]);
+        close(fds[1]);
+        stats.refused++;
+        send_reset(id, REFUSED_STREAM);
+        return false;
+    }
+    Stream &s = *new_stream(id, fds[1]);
+    s.tunnel = tunnel;
+    s.request_chunked = !end_stream && !content_length && !tunnel;
+    s.request = method + ' ' + (tunnel ? authority : path) + " HTTP/1.1\r\n"
+        "Host: " + authority + "\r\n" + fields;
+    if (!cookie.empty())
+        s.request += "Cookie: " + cookie + "\r\n";
+    if (s.request_chunked)
+        s.request += "Transfer-Encoding: chunked\r\n";
+    s.request += "Connection: close\r\n\r\n";
+    if (end_stream)
+        end_request(s);
+    else
+        stream_write(s);
+    return false;
+}
+
+H2Connection::Stream *
+H2Connection::new_stream(uint32_t id, int fd)
+{
+    Stream *s = new Stream;
+    s->conn = this;
+    s->id = id;
+    s->send_window = initial_window;
+    ev_io_init(&s->watcher, stream_callback, fd, 0);
+    s->watcher.data = s;
+    streams[id] = s;
+    stats.streams++;
+    OnEventLoop::timers.cancel(idle_timer);
+    return s;
+}
+
+void
+H2Connection::update(Stream &s)
+{
+    bool backlog = out.size() - out_pos >= out_limit;
+    if (backlog)
+        out_blocked = true;
+    int events = (!backlog && s.send_window > 0 && send_window > 0 ? EV_READ : 0) |
+        (s.request.empty() ? 0 : EV_WRITE);
+    if (events == (s.watcher.events & (EV_READ | EV_WRITE)))
+        return;
+    ev_io_stop(event_loop, &s.watcher);
+    ev_io_set(&s.watcher, s.watcher.fd, events);
+    if (events)
+        ev_io_start(event_loop, &s.watcher);
+}
+
+void
+H2Connection::resume_streams()
+{
+    for (auto &i: streams)
+        update(*i.second);
+}
+
+void
+H2Connection::stream_callback(EV_P_ ev_io *w, int revents)
+{
+    Stream *s = (Stream *) w->data;
+    H2Connection *self = s->conn;
+    uint32_t id = s->id;
+    if (revents & EV_WRITE)
+        self->stream_write(*s);
+    // stream may be closed
+    if ((revents & EV_READ) && self->streams.count(id))
+        self->stream_read(*s);
+}
+
+// true means stream is closed
+bool
+H2Connection::request_data(Stream &s, const char *data, size_t size)
+{
+    if (!size)
+        return false;
+    if (s.request.size() > 2 * stream_window) {
+        // client ignores window
+        reset_stream(s, FLOW_CONTROL_ERROR);
+        return true;
+    }
+    if (s.request_chunked) {
+        char size_line[sizeof("ffffffff\r\n")];
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+        s.request.append(size_line, n);
+        s.request.append(data, size);
+        s.request += "\r\n";
+    } else {
+        s.request.append(data, size);
+    }
+    s.payload += size;
+    stream_write(s);
+    return false;
+}
+
+void
+H2Connection::end_request(Stream &s)
+{
+    if (s.request_end)
+        return;
+    s.request_end = true;
+    if (s.request_chunked)
+        s.request += "0\r\n\r\n";
+    stream_write(s);
+}
+
+void
+H2Connection::stream_write(Stream &s)
+{
+    if (!s.request.empty()) {
+        ssize_t n = send(s.watcher.fd, s.request.data(), s.request.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            // Proxy has closed, its response may be still there
+            s.request.clear();
+            s.payload = 0;
+        } else if (n > 0) {
+            s.request.erase(0, n);
+            // framing of chunked body goes along with payload
+            int64_t credit = std::min<int64_t>(n, s.payload);
+            s.payload -= credit;
+            s.owed += credit;
+            owed += credit;
+            if (!s.request_end)
+                send_window_update(s.id, s.owed, stream_window);
+            send_window_update(0, owed, connection_window);
+        }
+    }
+    // END_STREAM of CONNECT is half-close of tunnel
+    if (s.request.empty() && s.request_end && s.tunnel)
+        shutdown(s.watcher.fd, SHUT_WR);
+    update(s);
+}
+
+void
+H2Connection::stream_read(Stream &s)
+{
+    char buf[max_frame];
+    size_t room = std::min<int64_t>(std::min(s.send_window, send_window), max_frame);
+    if (!room) {
+        update(s);
+        return;
+    }
+    ssize_t n = recv(s.watcher.fd, buf, room, 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        reset_stream(s, INTERNAL_ERROR);
+        return;
+    }
+    if (n == 0) {
+        if (!s.head_sent) {
+            reset_stream(s, INTERNAL_ERROR);
+            return;
+        }
+        send_frame(DATA, END_STREAM, s.id);
+        close_stream(s);
+        return;
+    }
+
+    if (s.head_sent) {
+        send_response_body(s, buf, n);
+        update(s);
+        return;
+    }
+    s.head.append(buf, n);
+    // 1xx heads go first
+    while (!s.head_sent) {
+        size_t end = s.head.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            if (s.head.size() > max_response_head)
+                reset_stream(s, INTERNAL_ERROR);
+            return;
+        }
+        end += 4;
+        if (send_response_head(s, end)) {
+            reset_stream(s, INTERNAL_ERROR);
+            return;
+        }
+        if (!s.head_sent)
+            s.head.erase(0, end);
+        else if (end < s.head.size())
+            send_response_body(s, s.head.data() + end, s.head.size() - end);
+    }
+    std::string().swap(s.head);
+    update(s);
+}
+
+/* Status line and header lines of Proxy are HEADERS (and CONTINUATION);
+   interim (1xx) response is HEADERS without END_STREAM as well, final
+   response follows it. */
+bool
+H2Connection::send_response_head(Stream &s, size_t size)
+{
+    const std::string &head = s.head;
+    size_t sp = head.find(' ');
+    if (sp == std::string::npos || sp + 4 > size)
+        return true;
+    unsigned status = strtoul(head.c_str() + sp + 1, nullptr, 10);
+    // 101 Switching Protocols is not defined in HTTP/2
+    if (status < 100 || status == 101 || status > 999)
+        return true;
+    bool interim = status < 200;
+
+    std::string block;
+    Hpack::encode_status(block, status);
+    for (size_t pos = head.find("\r\n") + 2; pos < size - 2;) {
+        size_t eol = head.find("\r\n", pos);
+        size_t colon = head.find(':', pos);
+        size_t line = pos;
+        pos = eol + 2;
+        if (colon > eol)
+            continue;
+        std::string name = head.substr(line, colon - line);
+        std::transform(name.begin(), name.end(), name.begin(), tolower);
+        size_t value = std::min(head.find_first_not_of(" \t", colon + 1), eol);
+        size_t value_end = eol;
+        while (value_end > value && (head[value_end - 1] == ' ' || head[value_end - 1] == '\t'))
+            --value_end;
+        if (name == "transfer-encoding" && !interim) {
+            s.chunked = strcasestr(head.substr(value, value_end - value).c_str(), "chunked");
+            continue;
+        }
+        if (!connection_header(name))
+            Hpack::encode(block, name, head.substr(value, value_end - value));
+    }
+
+    for (size_t pos = 0;;) {
+        size_t n = std::min(block.size() - pos, max_frame);
+        bool last = pos + n == block.size();
+        send_frame(pos ? CONTINUATION : HEADERS, last ? END_HEADERS : 0, s.id, block.data() + pos, n);
+        if (last)
+            break;
+        pos += n;
+    }
+    s.head_sent = !interim;
+    return false;
+}
+
+static int
+hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+void
+H2Connection::send_response_body(Stream &s, const char *data, size_t size)
+{
+    std::string decoded;
+    if (s.chunked) {
+        for (const char *p = data, *end = data + size; p < end;) {
+            switch (s.chunk_state) {
+            case Stream::CHUNK_SIZE:
+            {
+                char c = *p++;
+                int digit = hex_digit(c);
+                if (digit >= 0)
+                    s.chunk_left = s.chunk_left * 16 + digit;
+                else if (c == '\n')
+                    s.chunk_state = s.chunk_left ? Stream::CHUNK_DATA : Stream::CHUNK_TRAILER;
+                else if (c != '\r')
+                    s.chunk_state = Stream::CHUNK_EXT;
+                break;
+            }
+            case Stream::CHUNK_EXT:
+                if (*p++ == '\n')
+                    s.chunk_state = s.chunk_left ? Stream::CHUNK_DATA : Stream::CHUNK_TRAILER;
+                break;
+            case Stream::CHUNK_DATA:
+            {
+                size_t n = std::min<size_t>(s.chunk_left, end - p);
+                decoded.append(p, n);
+                p += n;
+                s.chunk_left -= n;
+                if (!s.chunk_left)
+                    s.chunk_state = Stream::CHUNK_CRLF;
+                break;
+            }
+            case Stream::CHUNK_CRLF:
+                if (*p++ == '\n')
+                    s.chunk_state = Stream::CHUNK_SIZE;
+                break;
+            case Stream::CHUNK_TRAILER:
+            default:
+                // trailers are not passed, Proxy closes after them
+                p = end;
+                break;
+            }
+        }
+        data = decoded.data();
+        size = decoded.size();
+    }
+    if (!size)
+        return;
+    send_frame(DATA, 0, s.id, data, size);
+    s.send_window -= size;
+    send_window -= size;
+}
+
+void
+H2Connection::reset_stream(Stream &s, Error err)
+{
+    send_reset(s.id, err);
+    close_stream(s);
+}
+
+void
+H2Connection::close_stream(Stream &s)
+{
+    ev_io_stop(event_loop, &s.watcher);
+    close(s.watcher.fd);
+    streams.erase(s.id);
+    delete &s;
+    if (streams.empty() && OPT_VALUE_KEEPALIVE_TIMEOUT)
+        OnEventLoop::timers.arm(idle_timer, OPT_VALUE_KEEPALIVE_TIMEOUT);
+}
@@ -0,0 +1,185 @@
+#pragma once
+#ifndef __evx_h2_h
+#define __evx_h2_h
+
+#include <ev.h>
+#include <netinet/in.h>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hpack.h"
+#include "timer.h"
+#include "util.h"
+
+/* HTTP/2 client connection with prior knowledge (h2c, --h2c). Each stream
+   is passed to its own Proxy as HTTP/1.1 request over socketpair (like
+   stream of Link), so servers are connected, pooled and balanced as for
+   HTTP/1.1 clients; response of Proxy is converted back into HEADERS and
+   DATA frames.
+
+   Flow control follows buffers: request body window is returned when
+   data is written to Proxy, response is read from Proxy only while client
+   window allows it and connection output is not backed up. */
+class H2Connection :
+    public virtual non_copyable
+{
+public:
+    // fd is client end for new Proxy; true means error (stream is refused)
+    typedef bool (*open_f)(void *ctx, int fd, const in_addr &local, const in_addr &peer);
+
+    struct Stats
+    {
+        size_t connections = 0;
+        size_t streams = 0;
+        size_t refused = 0;
+        size_t resets = 0; // by client
+        size_t large_heads = 0; // 431 for header list over max_header_list
+    };
+    static thread_local Stats stats;
+
+    // Deletes itself when connection is closed
+    H2Connection(struct ev_loop *event_loop_, int fd, const in_addr &local_, const in_addr &peer_,
+        open_f open_, void *open_ctx_);
+    ~H2Connection();
+
+private:
+    enum FrameType : uint8_t
+    {
+        DATA = 0,
+        HEADERS,
+        PRIORITY,
+        RST_STREAM,
+        SETTINGS,
+        PUSH_PROMISE,
+        PING,
+        GOAWAY,
+        WINDOW_UPDATE,
+        CONTINUATION
+    };
+
+    enum Flag : uint8_t
+    {
+        END_STREAM = 0x1,
+        ACK = 0x1,
+        END_HEADERS = 0x4,
+        PADDED = 0x8,
+        PRIORITY_FLAG = 0x20
+    };
+
+    enum Error : uint32_t
+    {
+        NO_ERROR = 0,
+        PROTOCOL_ERROR,
+        INTERNAL_ERROR,
+        FLOW_CONTROL_ERROR,
+        SETTINGS_TIMEOUT,
+        STREAM_CLOSED,
+        FRAME_SIZE_ERROR,
+        REFUSED_STREAM,
+        CANCEL,
+        COMPRESSION_ERROR
+    };
+
+    static const size_t head_size = 9;
+    static const size_t max_frame = 16384; // SETTINGS_MAX_FRAME_SIZE of both sides
+    static const uint32_t max_streams = 100; // SETTINGS_MAX_CONCURRENT_STREAMS
+    static const int64_t stream_window = 262144; // SETTINGS_INITIAL_WINDOW_SIZE
+    static const int64_t connection_window = 1048576;
+    static const size_t out_limit = 262144; // backlog which pauses responses
+    static const size_t max_response_head = 16384;
+    // SETTINGS_MAX_HEADER_LIST_SIZE, request head must fit into buffer of Proxy
+    static const size_t max_header_list = 4096;
+
+    struct Stream
+    {
+        ev_io watcher; // Proxy end
+        H2Connection *conn;
+        uint32_t id;
+        bool tunnel = false; // CONNECT, END_STREAM is half-close
+
+        // request
+        std::string request; // not written to Proxy yet
+        bool request_chunked = false; // body without Content-Length
+        bool request_end = false;
+        int64_t payload = 0; // part of request which came in DATA
+        int64_t owed = 0; // window to return to client
+
+        // response
+        int64_t send_window;
+        std::string head; // until it is complete
+        bool head_sent = false;
+        bool chunked = false;
+        enum
+        {
+            CHUNK_SIZE,
+            CHUNK_EXT,
+            CHUNK_DATA,
+            CHUNK_CRLF,
+            CHUNK_TRAILER
+        } chunk_state = CHUNK_SIZE;
+        size_t chunk_left = 0;
+    };
+
+    struct ev_loop *event_loop;
+    ev_io watcher;
+    in_addr local;
+    in_addr peer;
+    open_f open;
+    void *open_ctx;
+    TimerNode idle_timer;
+
+    bool preface = false; // of client is received
+    std::vector<char> in;
+    size_t in_size = 0;
+    std::string out; // frames to send
+    size_t out_pos = 0; // sent part of out
+    bool out_blocked = false; // some response is paused by out_limit
+    bool goaway = false; // client is leaving
+
+    Hpack hpack;
+    std::string header_block; // HEADERS and CONTINUATION frames
+    uint32_t header_stream = 0; // CONTINUATION is expected
+    bool header_end_stream = false;
+
+    std::unordered_map<uint32_t, Stream *> streams;
+    uint32_t last_id = 0;
+    int64_t send_window = 65535;
+    int64_t initial_window = 65535; // of client
+    int64_t owed = 0; // connection window to return
+
+    void update();
+    // true means connection is closed
+    bool read_frames();
+    bool write_frames();
+    bool handle_frame(FrameType type, uint8_t flags, uint32_t id, const char *data, size_t size);
+    bool handle_headers(uint32_t id, bool end_stream);
+    bool close_connection(Error err);
+    void send_frame(FrameType type, uint8_t flags, uint32_t id, const char *data = nullptr, size_t size = 0);
+    void send_reset(uint32_t id, Error err);
+    void send_window_update(uint32_t id, int64_t &owed_, int64_t window);
+
+    Stream *new_stream(uint32_t id, int fd);
+    void update(Stream &s);
+    void resume_streams();
+    void stream_read(Stream &s);
+    void stream_write(Stream &s);
+    bool request_data(Stream &s, const char *data, size_t size);
+    void end_request(Stream &s);
+    bool send_response_head(Stream &s, size_t size);
+    void send_response_body(Stream &s, const char *data, size_t size);
+    void reset_stream(Stream &s, Error err);
+    void close_stream(Stream &s);
+
+    static void
+    callback(EV_P_ ev_io *w, int revents);
+
+    static void
+    stream_callback(EV_P_ ev_io *w, int revents);
+
+    static void
+    idle_callback(TimerNode *node);
+};
+
+#endif // __evx_h2_h
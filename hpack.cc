@@ -0,0 +1,370 @@
+#include <cstdio>
+
+#include "hpack.h"
+
+// RFC 7541 Appendix A
+const Hpack::Field Hpack::static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// RFC 7541 Appendix B: code and its length in bits, by symbol (256 is EOS)
+static const struct { uint32_t code; uint8_t bits; } huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+// Binary tree of Huffman codes, built on startup
+struct HuffmanTree
+{
+    struct Node
+    {
+        int16_t child[2] = {-1, -1};
+        int16_t symbol = -1;
+    };
+    std::vector<Node> nodes;
+
+    HuffmanTree() :
+        nodes(1)
+    {
+        for (int16_t symbol = 0; symbol <= 256; ++symbol) {
+            size_t n = 0;
+            for (int bit = huffman_codes[symbol].bits - 1; bit >= 0; --bit) {
+                int b = (huffman_codes[symbol].code >> bit) & 1;
+                if (nodes[n].child[b] < 0) {
+                    nodes[n].child[b] = nodes.size();
+                    nodes.emplace_back();
+                }
+                n = nodes[n].child[b];
+            }
+            nodes[n].symbol = symbol;
+        }
+    }
+};
+
+static const HuffmanTree huffman_tree;
+
+bool
+Hpack::decode(const char *data, size_t size, Headers &headers)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    const uint8_t *end = p + size;
+    bool fields = false; // table size update must go first
+    list_size = 0;
+    // indexed fields make small block huge (HPACK bomb), so it's counted before copy
+    auto keep = [this] (const Field &f) {
+        if (list_truncated())
+            return false;
+        list_size += f.name.size() + f.value.size() + 32;
+        return !list_truncated();
+    };
+    while (p < end) {
+        uint64_t index;
+        if (*p & 0x80) {
+            // indexed field
+            if (get_integer(p, end, 7, index))
+                return true;
+            const Field *f = field(index);
+            if (!f)
+                return true;
+            if (keep(*f))
+                headers.push_back(*f);
+        } else if ((*p & 0xe0) == 0x20) {
+            if (fields || get_integer(p, end, 5, index) || index > table_limit)
+                return true;
+            max_size = index;
+            evict(max_size);
+            continue;
+        } else {
+            // literal with incremental indexing (01), without indexing (0000)
+            // or never indexed (0001), name is indexed or literal
+            bool indexing = *p & 0x40;
+            Field f;
+            if (get_integer(p, end, indexing ? 6 : 4, index))
+                return true;
+            if (index) {
+                const Field *name = field(index);
+                if (!name)
+                    return true;
+                f.name = name->name;
+            } else if (get_string(p, end, f.name)) {
+                return true;
+            }
+            if (get_string(p, end, f.value))
+                return true;
+            if (indexing)
+                insert(f);
+            if (keep(f))
+                headers.push_back(std::move(f));
+        }
+        fields = true;
+    }
+    return false;
+}
+
+const Hpack::Field *
+Hpack::field(uint64_t index) const
+{
+    if (!index)
+        return nullptr;
+    if (index <= static_count)
+        return &static_table[index - 1];
+    index -= static_count + 1;
+    return index < table.size() ? &table[index] : nullptr;
+}
+
+void
+Hpack::insert(const Field &f)
+{
+    size_t size = f.name.size() + f.value.size() + 32;
+    if (size > max_size) {
+        // not an error, table is just emptied
+        evict(0);
+        return;
+    }
+    evict(max_size - size);
+    table.push_front(f);
+    table_size += size;
+}
+
+void
+Hpack::evict(size_t limit)
+{
+    while (table_size > limit) {
+        const Field &f = table.back();
+        table_size -= f.name.size() + f.value.size() + 32;
+        table.pop_back();
+    }
+}
+
+bool
+Hpack::get_integer(const uint8_t *&p, const uint8_t *end, unsigned prefix, uint64_t &value)
+{
+    uint8_t mask = (1 << prefix) - 1;
+    value = *p++ & mask;
+    if (value < mask)
+        return false;
+    for (unsigned shift = 0; p < end && shift < 56; shift += 7) {
+        uint8_t b = *p++;
+        value += uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return false;
+    }
+    return true;
+}
+
+bool
+Hpack::get_string(const uint8_t *&p, const uint8_t *end, std::string &s)
+{
+    if (p == end)
+        return true;
+    bool huffman = *p & 0x80;
+    uint64_t size;
+    if (get_integer(p, end, 7, size) || size > uint64_t(end - p))
+        return true;
+    if (huffman) {
+        if (huffman_decode(p, size, s))
+            return true;
+    } else {
+        s.assign((const char *) p, size);
+    }
+    p += size;
+    return false;
+}
+
+bool
+Hpack::huffman_decode(const uint8_t *p, size_t size, std::string &s)
+{
+    s.clear();
+    int16_t n = 0;
+    unsigned depth = 0; // bits since last symbol
+    bool ones = true; // they are all 1
+    for (const uint8_t *end = p + size; p < end; ++p) {
+        for (int bit = 7; bit >= 0; --bit) {
+            int b = (*p >> bit) & 1;
+            n = huffman_tree.nodes[n].child[b];
+            if (n < 0)
+                return true;
+            depth++;
+            ones = ones && b;
+            int16_t symbol = huffman_tree.nodes[n].symbol;
+            if (symbol >= 0) {
+                if (symbol == 256) // EOS
+                    return true;
+                s += char(symbol);
+                n = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+    // padding is shorter than byte, it is a prefix of EOS
+    return depth > 7 || !ones;
+}
+
+void
+Hpack::put_integer(std::string &out, uint8_t first, unsigned prefix, uint64_t value)
+{
+    uint8_t mask = (1 << prefix) - 1;
+    if (value < mask) {
+        out += char(first | value);
+        return;
+    }
+    out += char(first | mask);
+    value -= mask;
+    for (; value >= 0x80; value >>= 7)
+        out += char((value & 0x7f) | 0x80);
+    out += char(value);
+}
+
+void
+Hpack::encode(std::string &out, const std::string &name, const std::string &value)
+{
+    // literal without indexing, literal name
+    out += '\0';
+    put_integer(out, 0, 7, name.size());
+    out += name;
+    put_integer(out, 0, 7, value.size());
+    out += value;
+}
+
+void
+Hpack::encode_status(std::string &out, unsigned status)
+{
+    // static table entries 8..14
+    static const unsigned indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    for (unsigned i = 0; i < sizeof(indexed) / sizeof(indexed[0]); ++i) {
+        if (indexed[i] == status) {
+            out += char(0x80 | (8 + i));
+            return;
+        }
+    }
+    // literal without indexing, name of entry 8
+    char code[4];
+    snprintf(code, sizeof(code), "%03u", status % 1000);
+    put_integer(out, 0, 4, 8);
+    put_integer(out, 0, 7, 3);
+    out.append(code, 3);
+}
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef __evx_hpack_h
+#define __evx_hpack_h
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+
+/* HPACK header compression (RFC 7541) of one HTTP/2 connection. Decoder
+   keeps dynamic table of the peer, encoder emits literals without
+   indexing only, so peer keeps no table for our headers. */
+class Hpack
+{
+public:
+    struct Field
+    {
+        std::string name;
+        std::string value;
+    };
+    typedef std::vector<Field> Headers;
+
+    // SETTINGS_HEADER_TABLE_SIZE (default, it is not announced)
+    static const size_t table_limit = 4096;
+
+    /* Decoded size of header list (name, value and 32 per field) which is
+       kept; fields over it are decoded for dynamic table only */
+    size_t list_limit = SIZE_MAX;
+    size_t list_size = 0; // of last block, up to the first dropped field
+
+    // Appends fields of header block; true means error
+    bool decode(const char *data, size_t size, Headers &headers);
+    // Last block had more than list_limit
+    bool list_truncated() const
+    {
+        return list_size > list_limit;
+    }
+
+    // name must be lower case
+    static void encode(std::string &out, const std::string &name, const std::string &value);
+    static void encode_status(std::string &out, unsigned status);
+
+private:
+    static const Field static_table[];
+    static const size_t static_count = 61;
+
+    std::deque<Field> table; // dynamic, newest first
+    size_t table_size = 0; // name, value and 32 per entry
+    size_t max_size = table_limit; // set by peer within table_limit
+
+    const Field *field(uint64_t index) const;
+    void insert(const Field &f);
+    void evict(size_t limit);
+
+    static bool get_integer(const uint8_t *&p, const uint8_t *end, unsigned prefix, uint64_t &value);
+    static bool get_string(const uint8_t *&p, const uint8_t *end, std::string &s);
+    static bool huffman_decode(const uint8_t *p, size_t size, std::string &s);
+    static void put_integer(std::string &out, uint8_t first, unsigned prefix, uint64_t value);
+};
+
+#endif // __evx_hpack_h
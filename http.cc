@@ -11,17 +11,31 @@ const std::string LWSP("\t \r\n");
 const std::string CHUNKED("chunked");
 const std::string KEEP_ALIVE("keep-alive");
 const std::string CLOSE("close");
+const std::string UPGRADE("upgrade");
 const std::string NO_TRANSFORM("no-transform");
+const std::string GZIP("gzip");
+const std::string ANY_CODING("*");
+const std::string IDENTITY("identity");
 const std::string MARKER_TERMINATORS(";\r");
+const std::string HEAD("HEAD");
+const std::string CONNECT("CONNECT");
+const std::string GET("GET");
+const std::string OPTIONS("OPTIONS");
+const std::string TRACE("TRACE");
+const std::string PUT("PUT");
+const std::string DELETE("DELETE");
+const std::string CONNECTION_KEEP_ALIVE("Connection: keep-alive\r\n");
 
 struct RequestHeader
 {
     enum Id
     {
-        CACHE_CONTROL = 0,
+        ACCEPT_ENCODING = 0,
+        CACHE_CONTROL,
         CONNECTION,
         CONTENT_LENGTH,
         HOST,
+        PROXY_CONNECTION,
         TRANSFER_ENCODING,
         VIA,
         X_FORWARDED_FOR,
@@ -54,7 +68,9 @@ struct ResponseHeader
     enum Id
     {
         CONNECTION = 0,
+        CONTENT_ENCODING,
         CONTENT_LENGTH,
+        CONTENT_TYPE,
         TRANSFER_ENCODING,
         unknown /* must be the last element */
     };
@@ -82,10 +98,12 @@ private:
 
 const char * RequestHeader::_names[] = {
 /* must be in order of enum! */
+    "accept-encoding",
     "cache-control",
     "connection",
     "content-length",
     "host",
+    "proxy-connection",
     "transfer-encoding",
     "via",
     "x-forwarded-for"
@@ -94,7 +112,9 @@ const char * RequestHeader::_names[] = {
 const char * ResponseHeader::_names[] = {
 /* must be in order of enum! */
     "connection",
+    "content-encoding",
     "content-length",
+    "content-type",
     "transfer-encoding"
 };
 
@@ -140,33 +160,39 @@ void ResponseHeader::assert_count()
 }
 
 
-HTTPParser::HTTPParser(IOBuffer &input_buf_, IOBuffer &output_buf_, int conn_fd) :
+HTTPParser::HTTPParser(IOBuffer &input_buf_, IOBuffer &output_buf_) :
     parse_line { &HTTPParser::parse_request_line },
     input_buf { &input_buf_ },
     output_buf { &output_buf_ }
 {
     reset();
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-    if (getsockname(conn_fd, (sockaddr *) &addr, &addr_len))
-        throw Errno("getsockname");
-    strncpy(local_addr_buf + 1, inet_ntoa(addr.sin_addr), sizeof(local_addr_buf) - 2);
-    local_addr_buf[0] = ' ';
-    local_addr_buf[sizeof(local_addr_buf) - 2] = 0;
-    size_t len = strlen(local_addr_buf);
-    local_addr_buf[len++] = '\r';
-    local_addr_buf[len++] = '\n';
-    local_address.assign(local_addr_buf, len);
-
-    addr_len = sizeof(addr);
-    if (getpeername(conn_fd, (sockaddr *) &addr, &addr_len))
-        throw Errno("getpeername");
-    strncpy(peer_addr_buf, inet_ntoa(addr.sin_addr), sizeof(peer_addr_buf) - 1);
-    peer_addr_buf[sizeof(peer_addr_buf) - 1] = 0;
-    len = strlen(peer_addr_buf);
-    peer_addr_buf[len++] = '\r';
-    peer_addr_buf[len++] = '\n';
-    peer_address.assign(peer_addr_buf, len);
+}
+
+void HTTPParser::set_addresses(const buffer::string &via_name, const in_addr &local_, const in_addr &peer_)
+{
+    local_address = via_name;
+    peer_address.clear();
+    local = local_;
+    peer = peer_;
+}
+
+void HTTPParser::format_addresses()
+{
+    if (local_address.empty()) {
+        local_addr_buf[0] = ' ';
+        inet_ntop(AF_INET, &local, local_addr_buf + 1, sizeof(local_addr_buf) - 2);
+        size_t len = strlen(local_addr_buf);
+        local_addr_buf[len++] = '\r';
+        local_addr_buf[len++] = '\n';
+        local_address.assign(local_addr_buf, len);
+    }
+    if (peer_address.empty()) {
+        inet_ntop(AF_INET, &peer, peer_addr_buf, sizeof(peer_addr_buf) - 1);
+        size_t len = strlen(peer_addr_buf);
+        peer_addr_buf[len++] = '\r';
+        peer_addr_buf[len++] = '\n';
+        peer_address.assign(peer_addr_buf, len);
+    }
 }
 
 bool HTTPParser::copy_line(const buffer::string &line)
@@ -188,6 +214,9 @@ bool HTTPParser::copy_modified_headers()
     static const std::string xforw_h = RequestHeader::get(RequestHeader::X_FORWARDED_FOR) + ": ";
     static const std::string comma = ", ";
 
+    if (!no_transform)
+        format_addresses();
+
     if (via.empty()) {
         if (!no_transform) {
             if (copy_line(via_h) ||
@@ -196,7 +225,8 @@ bool HTTPParser::copy_modified_headers()
                 return true;
         }
     } else {
-        if (copy_line(via))
+        // appended entry goes before CRLF of found line
+        if (copy_line(no_transform ? via : via.substr(0, via.size() - CRLF.size())))
             return true;
         if (!no_transform) {
             if (copy_line(comma) ||
@@ -206,6 +236,13 @@ bool HTTPParser::copy_modified_headers()
         }
     }
 
+    // Persistence is negotiated for each side separately: HTTP/1.0 request
+    // stays HTTP/1.0 (server won't answer chunked), but asks for keep-alive.
+    if (request_version <= 1000) {
+        if (copy_line(CONNECTION_KEEP_ALIVE))
+            return true;
+    }
+
     if (x_forwarded_for.empty()) {
         if (!no_transform) {
             if (copy_line(xforw_h) ||
@@ -213,7 +250,8 @@ bool HTTPParser::copy_modified_headers()
                 return true;
         }
     } else {
-        if (copy_line(via))
+        if (copy_line(no_transform ? x_forwarded_for :
+                x_forwarded_for.substr(0, x_forwarded_for.size() - CRLF.size())))
             return true;
         if (!no_transform) {
             if (copy_line(comma) ||
@@ -287,6 +325,13 @@ HTTPParser::parse_request_line()
     }
 
     method.assign(found_line.begin(), sp1);
+    head_request = method == HEAD;
+    connect_request = method == CONNECT;
+    idempotent_request = method == GET || head_request || method == OPTIONS || method == TRACE ||
+        method == PUT || method == DELETE;
+    upgrade_request = false;
+    accept_gzip = false;
+    client_keep_alive = false;
     
     ++sp1;
     if (&found_line[sp1] >= found_line.end() - CRLF.size()) {
@@ -321,9 +366,7 @@ HTTPParser::parse_request_line()
 
     http_version.assign(&found_line[sep], found_line.end() - CRLF.size());
     parse_http_version(request_version);
-    if (request_version <= 1000) {
-        force_close = true;
-    }
+    force_close = request_version <= 1000;
 
     parse_line = &HTTPParser::parse_request_head;
 
@@ -357,9 +400,7 @@ HTTPParser::Status HTTPParser::parse_response_line()
     http_version.assign(&found_line[sep], &found_line[sp1]);
     parse_http_version(response_version);
 
-    if (response_version > 1000 && !force_close) {
-        keep_alive = true;
-    }
+    keep_alive = response_version > 1000;
 
     ++sp1;
     if (&found_line[sp1] >= found_line.end() - CRLF.size()) {
@@ -403,6 +444,122 @@ HTTPParser::get_header_value(STRING& value, size_t& cl)
     return false;
 }
 
+// Element of comma separated list at pos (may be empty), pos goes past it
+static buffer::istring
+next_token(const buffer::istring &list, size_t &pos)
+{
+    size_t end = list.find(',', pos);
+    if (end == buffer::string::npos)
+        end = list.size();
+    size_t first = pos, last = end;
+    while (first < last && WSP.find(list[first]) != std::string::npos)
+        ++first;
+    while (last > first && WSP.find(list[last - 1]) != std::string::npos)
+        --last;
+    pos = end + 1;
+    return last > first ? buffer::istring(&list[first], last - first) : buffer::istring();
+}
+
+// Comma separated list has token (case-insensitive)
+static bool
+has_token(const buffer::istring &list, const std::string &token)
+{
+    for (size_t pos = 0; pos < list.size();) {
+        if (next_token(list, pos) == token)
+            return true;
+    }
+    return false;
+}
+
+/* Connection header goes on without close and keep-alive, which are for
+   client connection only (Upgrade and the like are left to server). */
+bool
+HTTPParser::copy_connection_tokens(const buffer::istring &list)
+{
+    static const std::string connection_h = "Connection: ";
+    static const std::string comma = ", ";
+
+    bool copied = false;
+    for (size_t pos = 0; pos < list.size();) {
+        buffer::istring token = next_token(list, pos);
+        if (token.empty() || token == CLOSE || token == KEEP_ALIVE)
+            continue;
+        if (copy_line(copied ? comma : connection_h) ||
+            copy_line(buffer::string(token.data(), token.size())))
+            return true;
+        copied = true;
+    }
+    return copied && copy_line(CRLF);
+}
+
+/* Content coding is in Accept-Encoding list by name or by "*", and its
+   quality is not zero ("gzip;q=0" refuses it). Entry of the coding itself
+   wins over "*" wherever it is in the list; identity is acceptable unless
+   refused. */
+bool
+HTTPParser::accepts_coding(const buffer::istring &list, const std::string &coding)
+{
+    int named = -1, any = -1; // not listed, 0 refused, 1 accepted
+    for (size_t pos = 0; pos < list.size();) {
+        size_t end = list.find(',', pos);
+        if (end == buffer::string::npos)
+            end = list.size();
+        size_t first = pos, last = end;
+        size_t params = list.find(';', pos);
+        if (params < end)
+            last = params;
+        while (first < last && WSP.find(list[first]) != std::string::npos)
+            ++first;
+        while (last > first && WSP.find(list[last - 1]) != std::string::npos)
+            --last;
+        buffer::istring name(&list[first], last - first);
+        pos = end + 1;
+        bool is_named = name == coding;
+        if (last == first || (!is_named && name != ANY_CODING))
+            continue;
+        bool accepted = true;
+        // only q parameter is defined, "q=0", "q=0.0" and so on refuse
+        size_t q = params < end ? list.find('=', params) : end;
+        if (q < end) {
+            for (++q; q < end && WSP.find(list[q]) != std::string::npos; ++q)
+                ;
+            for (; q < end && (list[q] == '0' || list[q] == '.'); ++q)
+                ;
+            accepted = q < end && list[q] != ' ' && list[q] != '\t';
+        }
+        (is_named ? named : any) = accepted;
+    }
+    if (named >= 0)
+        return named;
+    if (any >= 0)
+        return any;
+    return coding == IDENTITY;
+}
+
+bool HTTPParser::split_host_port()
+{
+    size_t host_end = 0;
+    if (host[0] == '[') {
+        // IPv6 literal: [address]:port
+        host_end = host.find(']');
+        if (host_end == buffer::string::npos) {
+            debug("Wrong host: no closing bracket!");
+            return true;
+        }
+    }
+    size_t colon = host.find(':', host_end);
+    if (colon != buffer::string::npos) {
+        if (colon + 1 < host.size()) {
+            buffer::string port_(&host[colon + 1], host.end());
+            port = buffer::stol(port_);
+        }
+        host.assign(host.begin(), &host[colon]);
+    }
+    if (host_end)
+        host.assign(&host[1], &host[host_end]);
+    return false;
+}
+
 HTTPParser::Status
 HTTPParser::parse_request_head()
 {
@@ -414,6 +571,16 @@ HTTPParser::parse_request_head()
             trace("skip_chunk = ", skip_chunk, " (finished request head)");
         }
 
+        if (connect_request) {
+            // authority-form, port is required
+            host.assign(request_uri.begin(), request_uri.end());
+            port = 0;
+            if (split_host_port() || !port) {
+                debug("Wrong CONNECT Request-URI!");
+                return TERMINATE;
+            }
+        }
+
         if (copy_modified_headers())
             return TERMINATE;
 
@@ -441,17 +608,8 @@ HTTPParser::parse_request_head()
         if (copy_found_line())
             return TERMINATE;
 
-        if (get_header_value(host, colon))
+        if (get_header_value(host, colon) || split_host_port())
             return TERMINATE;
-
-        colon = host.find(':');
-        if (colon != buffer::string::npos) {
-            if (colon + 1 < host.size()) {
-                buffer::string port_(&host[colon + 1], host.end());
-                port = buffer::stol(port_);
-            }
-            host.assign(host.begin(), &host[colon]);
-        }
         break;
     }
     case RequestHeader::CONTENT_LENGTH:
@@ -480,6 +638,18 @@ HTTPParser::parse_request_head()
         }
         break;
     }
+    case RequestHeader::ACCEPT_ENCODING:
+    {
+        if (copy_found_line())
+            return TERMINATE;
+
+        buffer::istring accept_encoding;
+        if (get_header_value(accept_encoding, colon))
+            return TERMINATE;
+
+        accept_gzip = accepts_coding(accept_encoding, GZIP);
+        break;
+    }
     case RequestHeader::CACHE_CONTROL:
     {
         if (copy_found_line())
@@ -495,19 +665,22 @@ HTTPParser::parse_request_head()
         break;
     }
     case RequestHeader::CONNECTION:
+    case RequestHeader::PROXY_CONNECTION:
     {
-        if (copy_found_line())
-            return TERMINATE;
-
         buffer::istring connection;
         if (get_header_value(connection, colon))
             return TERMINATE;
 
-        if (connection == CLOSE) {
+        if (header == RequestHeader::CONNECTION && has_token(connection, UPGRADE))
+            upgrade_request = true;
+
+        if (has_token(connection, CLOSE)) {
             force_close = true;
-        } else if (connection == KEEP_ALIVE) {
+        } else if (has_token(connection, KEEP_ALIVE)) {
             force_close = false;
         }
+        if (header == RequestHeader::CONNECTION && copy_connection_tokens(connection))
+            return TERMINATE;
         break;
     }
     case RequestHeader::VIA:
@@ -526,6 +699,23 @@ HTTPParser::parse_request_head()
     return CONTINUE;
 }
 
+bool
+HTTPParser::bodiless_response() const
+{
+    if (head_request)
+        return true;
+    long status = buffer::stol(status_code);
+    return status < 200 || status == 204 || status == 304;
+}
+
+bool
+HTTPParser::can_rechunk() const
+{
+    if (request_version <= 1000 || force_close || bodiless_response())
+        return false;
+    return response_version > 1000 || http_version.size() == 3;
+}
+
 HTTPParser::Status HTTPParser::parse_response_head()
 {
     assert(found_line.size() >= CRLF.size());
@@ -534,6 +724,9 @@ HTTPParser::Status HTTPParser::parse_response_head()
         if (!chunked) {
             skip_chunk = content_length == cl_unset ? 0 : content_length;
             trace("skip_chunk = ", skip_chunk, " (finished response head)");
+            // body without length ends with connection whatever server says
+            if (content_length == cl_unset && !bodiless_response())
+                keep_alive = false;
         }
         return PROCEED;
     }
@@ -550,6 +743,7 @@ HTTPParser::Status HTTPParser::parse_response_head()
     switch (header) {
     case ResponseHeader::CONTENT_LENGTH:
     {
+        content_length_header = found_line;
         buffer::string clength;
         if (get_header_value(clength, colon))
             return TERMINATE;
@@ -568,13 +762,22 @@ HTTPParser::Status HTTPParser::parse_response_head()
         }
         break;
     }
+    case ResponseHeader::CONTENT_TYPE:
+        if (get_header_value(content_type, colon))
+            return TERMINATE;
+        break;
+    case ResponseHeader::CONTENT_ENCODING:
+        if (get_header_value(content_encoding, colon))
+            return TERMINATE;
+        break;
     case ResponseHeader::CONNECTION:
     {
+        connection_header = found_line;
         buffer::istring connection;
         if (get_header_value(connection, colon))
             return TERMINATE;
 
-        if (!force_close && connection == KEEP_ALIVE) {
+        if (connection == KEEP_ALIVE) {
             keep_alive = true;
         } else if (connection == CLOSE) {
             keep_alive = false;
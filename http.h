@@ -2,6 +2,7 @@
 #define __cd_http_h
 
 #include <string>
+#include <netinet/in.h>
 #include "buffer_string.h"
 
 class IOBuffer;
@@ -27,13 +28,19 @@ private:
     buffer::string scan_buf_store;
     buffer::string found_line;
 
-    /* via header, with space at beginning, CRLF terminated */
+    /* via header, with space at beginning, CRLF terminated; pseudonym
+       or formatted from local when first emitted */
     char local_addr_buf[18]; // space: 1, ip: 15, CRLF: 2
     buffer::string local_address;
+    in_addr local;
 
-    /* x-forwarded-for header, CRLF terminated */
+    /* x-forwarded-for header, CRLF terminated; formatted from peer when
+       first emitted */
     char peer_addr_buf[17]; // ip: 15, CRLF: 2
     buffer::string peer_address;
+    in_addr peer;
+
+    void format_addresses();
 
     template <class STRING>
     bool get_header_value(STRING& value, size_t& cl);
@@ -45,6 +52,9 @@ private:
         return copy_line(found_line);
     }
     bool copy_modified_headers();
+    bool copy_connection_tokens(const buffer::istring &list);
+    // host[:port] or [IPv6][:port] in host; true means error
+    bool split_host_port();
 
 public:
     /* Request properties */
@@ -56,12 +66,22 @@ public:
 
     bool no_transform;
     uint32_t port;
+    bool head_request = false; // is not reset
+    bool connect_request; // CONNECT: host and port are from Request-URI
+    bool upgrade_request = false; // Connection: upgrade, is not reset
+    bool accept_gzip = false; // Accept-Encoding allows gzip, is not reset
+    bool idempotent_request = false; // may be sent again (RFC 9110 9.2.2)
 
     /* Response properties */ // TODO: put into union with Request properties
     buffer::string status_code;
     buffer::string reason_phrase;
-    bool keep_alive = false; // is not reset
-    bool force_close = false; // is not reset
+    buffer::string connection_header; // whole line, for removal on re-chunking
+    buffer::string content_length_header; // whole line, for removal on compression
+    buffer::string content_type;
+    buffer::string content_encoding;
+    bool keep_alive = false; // server connection persistence, is not reset
+    bool client_keep_alive = false; // reset by request line
+    bool force_close = false; // client asked to close, is not reset
     unsigned request_version = 0; // is not reset
     unsigned response_version = 0; // is not reset
 
@@ -71,7 +91,9 @@ public:
     static const size_t cl_unset = -1;
     bool chunked;
 
-    HTTPParser(IOBuffer &input_buf_, IOBuffer &output_buf_, int conn_fd);
+    HTTPParser(IOBuffer &input_buf_, IOBuffer &output_buf_);
+    // Via fragment (" name\r\n") or empty one to name local address
+    void set_addresses(const buffer::string &via_name, const in_addr &local_, const in_addr &peer_);
     void parse_http_version(unsigned& version);
     Status parse_request_line();
     Status parse_response_line();
@@ -80,6 +102,13 @@ public:
     Status parse_head(buffer::string &recv_chunk);
     Status parse_body(buffer::string &recv_chunk);
     bool next_line();
+    // response to HEAD, 1xx, 204 and 304 ones have no body (RFC 7230 3.3.3)
+    bool bodiless_response() const;
+    // response body may go to client in chunks of our own
+    bool can_rechunk() const;
+
+    // Accept-Encoding list allows content coding
+    static bool accepts_coding(const buffer::istring &list, const std::string &coding);
 
 
     enum CRLFSearch
@@ -113,6 +142,11 @@ private:
         crlf_search = NO_SEARCH;
         body_end = false;
         no_transform = false;
+        connect_request = false;
+        connection_header.clear();
+        content_length_header.clear();
+        content_type.clear();
+        content_encoding.clear();
     }
 
  public:
@@ -0,0 +1,434 @@
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "link.h"
+
+thread_local Link::Stats Link::stats;
+const size_t Link::max_payload;
+
+static void
+set_nodelay(int fd)
+{
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+Link::Link(struct ev_loop *event_loop_, const UpstreamServer &server_) :
+    event_loop {event_loop_},
+    server (server_),
+    frontend {true},
+    in (head_size + max_payload)
+{
+    ev_io_init(&watcher, callback, -1, 0);
+    watcher.data = this;
+}
+
+Link::Link(struct ev_loop *event_loop_, int fd, open_f open_, void *open_ctx_) :
+    event_loop {event_loop_},
+    frontend {false},
+    open {open_},
+    open_ctx {open_ctx_},
+    in (head_size + max_payload)
+{
+    ev_io_init(&watcher, callback, -1, 0);
+    watcher.data = this;
+    set_nodelay(fd);
+    start(fd, EV_READ);
+    debug("Link: accepted");
+}
+
+Link::~Link()
+{
+    if (watcher.fd >= 0)
+        drop();
+}
+
+void
+Link::start(int fd, int events)
+{
+    ev_io_set(&watcher, fd, events);
+    ev_io_start(event_loop, &watcher);
+}
+
+// true means error
+bool
+Link::connect()
+{
+    int fd = socket(server.addr.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error("Link: socket: ", strerror(errno));
+        return true;
+    }
+    set_nodelay(fd);
+    sockaddr_storage sa;
+    socklen_t sa_len = server.addr.sockaddr(sa, server.port);
+    if (::connect(fd, (sockaddr *) &sa, sa_len) < 0 && errno != EINPROGRESS) {
+        error("Link: connect: ", strerror(errno));
+        close(fd);
+        return true;
+    }
+    connecting = true;
+    stats.connects++;
+    start(fd, EV_READ | EV_WRITE);
+    debug("Link: connecting");
+    return false;
+}
+
+/* Connection is lost: every stream is closed without notice (peer
+   closes its streams the same way). */
+void
+Link::drop()
+{
+    debug("Link: dropped with ", streams.size(), " streams");
+    stats.drops++;
+    for (auto &i: streams) {
+        Stream *s = i.second;
+        ev_io_stop(event_loop, &s->watcher);
+        close(s->watcher.fd);
+        delete s;
+    }
+    streams.clear();
+    ev_io_stop(event_loop, &watcher);
+    close(watcher.fd);
+    watcher.fd = -1;
+    connecting = false;
+    out.clear();
+    out_pos = 0;
+    in_size = 0;
+}
+
+void
+Link::update()
+{
+    int events = EV_READ | (connecting || out_pos < out.size() ? EV_WRITE : 0);
+    if (events == (watcher.events & (EV_READ | EV_WRITE)))
+        return;
+    ev_io_stop(event_loop, &watcher);
+    ev_io_set(&watcher, watcher.fd, events);
+    ev_io_start(event_loop, &watcher);
+}
+
+void
+Link::callback(EV_P_ ev_io *w, int revents)
+{
+    Link *self = (Link *) w->data;
+    if (self->connecting) {
+        int sockerr = 0;
+        socklen_t optlen = sizeof(sockerr);
+        if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &sockerr, &optlen) < 0 || sockerr) {
+            cerror("Link::callback", "Link: connect: ", strerror(sockerr));
+            self->drop();
+            return;
+        }
+        self->connecting = false;
+    }
+    if ((revents & EV_READ) && self->read_frames())
+        return;
+    if ((revents & EV_WRITE) && self->write_frames())
+        return;
+    self->update();
+}
+
+bool
+Link::read_frames()
+{
+    ssize_t n = recv(watcher.fd, &in[in_size], in.size() - in_size, 0);
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return false;
+        if (n < 0)
+            error("Link: recv: ", strerror(errno));
+        drop();
+        if (!frontend)
+            delete this;
+        return true;
+    }
+    in_size += n;
+
+    size_t pos = 0;
+    while (in_size - pos >= head_size) {
+        const unsigned char *head = (const unsigned char *) &in[pos];
+        uint32_t id;
+        uint16_t size;
+        memcpy(&id, head, 4);
+        memcpy(&size, head + 4, 2);
+        id = ntohl(id);
+        size = ntohs(size);
+        if (size > max_payload) {
+            error("Link: bad frame size ", size);
+            drop();
+            if (!frontend)
+                delete this;
+            return true;
+        }
+        if (in_size - pos < head_size + size)
+            break;
+        handle_frame(id, (FrameType) head[6], &in[pos + head_size], size);
+        pos += head_size + size;
+    }
+    memmove(&in[0], &in[pos], in_size - pos);
+    in_size -= pos;
+    return false;
+}
+
+bool
+Link::write_frames()
+{
+    if (out_pos == out.size())
+        return false;
+    ssize_t n = send(watcher.fd, out.data() + out_pos, out.size() - out_pos, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return false;
+        error("Link: send: ", strerror(errno));
+        drop();
+        if (!frontend)
+            delete this;
+        return true;
+    }
+    out_pos += n;
+    if (out_pos == out.size()) {
+        out.clear();
+        out_pos = 0;
+    }
+    return false;
+}
+
+void
+Link::send_frame(uint32_t id, FrameType type, const char *data, size_t size)
+{
+    char head[head_size] = {};
+    uint32_t net_id = htonl(id);
+    uint16_t net_size = htons(size);
+    memcpy(head, &net_id, 4);
+    memcpy(head + 4, &net_size, 2);
+    head[6] = type;
+    out.append(head, head_size);
+    if (size)
+        out.append(data, size);
+    if (!connecting && !(watcher.events & EV_WRITE))
+        update();
+}
+
+bool
+Link::open_stream(int fd, const in_addr &local, const in_addr &peer)
+{
+    assert(frontend);
+    if (watcher.fd < 0 && connect())
+        return true;
+    uint32_t id = next_id++;
+    new_stream(id, fd);
+    char addrs[1 + sizeof(in_addr) * 2];
+    addrs[0] = 4;
+    memcpy(addrs + 1, &local, sizeof(in_addr));
+    memcpy(addrs + 1 + sizeof(in_addr), &peer, sizeof(in_addr));
+    send_frame(id, OPEN, addrs, sizeof(addrs));
+    return false;
+}
+
+void
+Link::handle_frame(uint32_t id, FrameType type, const char *data, size_t size)
+{
+    if (type == OPEN) {
+        if (frontend || streams.count(id)) {
+            error("Link: unexpected OPEN of stream ", id);
+            return;
+        }
+        // Proxy takes IPv4 clients only
+        if (size != 1 + sizeof(in_addr) * 2 || data[0] != 4) {
+            error("Link: unsupported address in OPEN of stream ", id);
+            send_frame(id, RESET);
+            stats.resets++;
+            return;
+        }
+        in_addr local, peer;
+        memcpy(&local, data + 1, sizeof(in_addr));
+        memcpy(&peer, data + 1 + sizeof(in_addr), sizeof(in_addr));
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+            error("Link: socketpair: ", strerror(errno));
+            send_frame(id, RESET);
+            stats.resets++;
+            return;
+        }
+        Stream *s = new_stream(id, fds[1]);
+        if (open(open_ctx, fds[0], local, peer)) {
+            close(fds[0]);
+            reset_stream(*s);
+        }
+        return;
+    }
+
+    auto i = streams.find(id);
+    if (i == streams.end())
+        return; // reset by this side
+    Stream &s = *i->second;
+
+    switch (type) {
+    case DATA:
+        stream_data(s, data, size);
+        break;
+    case FIN:
+        s.fin_received = true;
+        if (s.pending.empty())
+            shutdown(s.watcher.fd, SHUT_WR);
+        check_finished(s);
+        break;
+    case RESET:
+        close_stream(s);
+        break;
+    case WINDOW:
+        if (size == 4) {
+            uint32_t credit;
+            memcpy(&credit, data, 4);
+            s.window += ntohl(credit);
+            update(s);
+        }
+        break;
+    default:
+        error("Link: unknown frame type ", type);
+        break;
+    }
+}
+
+Link::Stream *
+Link::new_stream(uint32_t id, int fd)
+{
+    Stream *s = new Stream;
+    s->link = this;
+    s->id = id;
+    ev_io_init(&s->watcher, stream_callback, fd, EV_READ);
+    s->watcher.data = s;
+    ev_io_start(event_loop, &s->watcher);
+    streams[id] = s;
+    stats.streams++;
+    return s;
+}
+
+void
+Link::update(Stream &s)
+{
+    int events = (!s.fin_sent && s.window ? EV_READ : 0) | (s.pending.empty() ? 0 : EV_WRITE);
+    if (events == (s.watcher.events & (EV_READ | EV_WRITE)))
+        return;
+    ev_io_stop(event_loop, &s.watcher);
+    ev_io_set(&s.watcher, s.watcher.fd, events);
+    if (events)
+        ev_io_start(event_loop, &s.watcher);
+}
+
+void
+Link::stream_callback(EV_P_ ev_io *w, int revents)
+{
+    Stream *s = (Stream *) w->data;
+    Link *self = s->link;
+    uint32_t id = s->id;
+    if (revents & EV_READ)
+        self->stream_read(*s);
+    // stream may be closed
+    if ((revents & EV_WRITE) && self->streams.count(id))
+        self->stream_write(*s);
+}
+
+void
+Link::stream_read(Stream &s)
+{
+    char buf[max_payload];
+    ssize_t n = recv(s.watcher.fd, buf, std::min(s.window, max_payload), 0);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        reset_stream(s);
+        return;
+    }
+    if (n == 0) {
+        send_frame(s.id, FIN);
+        s.fin_sent = true;
+        update(s);
+        check_finished(s);
+        return;
+    }
+    send_frame(s.id, DATA, buf, n);
+    s.window -= n;
+    if (!s.window)
+        update(s);
+}
+
+void
+Link::stream_data(Stream &s, const char *data, size_t size)
+{
+    if (s.pending.empty()) {
+        ssize_t n = send(s.watcher.fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            reset_stream(s);
+            return;
+        }
+        if (n > 0) {
+            s.consumed += n;
+            data += n;
+            size -= n;
+        }
+    }
+    s.pending.append(data, size);
+    return_window(s);
+    update(s);
+}
+
+void
+Link::stream_write(Stream &s)
+{
+    ssize_t n = send(s.watcher.fd, s.pending.data(), s.pending.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        reset_stream(s);
+        return;
+    }
+    s.pending.erase(0, n);
+    s.consumed += n;
+    return_window(s);
+    if (s.pending.empty() && s.fin_received)
+        shutdown(s.watcher.fd, SHUT_WR);
+    update(s);
+    check_finished(s);
+}
+
+// Window is returned by quarters, not to send WINDOW on every DATA
+void
+Link::return_window(Stream &s)
+{
+    if (s.consumed < stream_window / 4)
+        return;
+    uint32_t credit = htonl(s.consumed);
+    send_frame(s.id, WINDOW, (const char *) &credit, 4);
+    s.consumed = 0;
+}
+
+void
+Link::check_finished(Stream &s)
+{
+    if (s.fin_sent && s.fin_received && s.pending.empty())
+        close_stream(s);
+}
+
+void
+Link::reset_stream(Stream &s)
+{
+    send_frame(s.id, RESET);
+    stats.resets++;
+    close_stream(s);
+}
+
+void
+Link::close_stream(Stream &s)
+{
+    ev_io_stop(event_loop, &s.watcher);
+    close(s.watcher.fd);
+    streams.erase(s.id);
+    delete &s;
+}
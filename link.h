@@ -0,0 +1,122 @@
+#pragma once
+#ifndef __evx_link_h
+#define __evx_link_h
+
+#include <ev.h>
+#include <netinet/in.h>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cluster.h"
+#include "util.h"
+
+/* Persistent connection between evoxy tiers (--mode). Frontend tier
+   passes each accepted client as a stream of the link; backend tier
+   passes each stream to Proxy (over socketpair), so HTTP is processed
+   by backend only and clients cost no connection setup between tiers.
+
+   Frame is 8 bytes head (stream id: 4, payload size: 2, type: 1, 1 unused;
+   network byte order) and payload. Stream side may send only as much DATA
+   as its window allows, window is returned by WINDOW frame when data is
+   written to local fd. FIN is half-close, stream is finished when both
+   sides sent FIN (or on RESET). */
+class Link :
+    public virtual non_copyable
+{
+public:
+    enum FrameType : uint8_t
+    {
+        OPEN = 0, // payload: IP version (1 byte: 4), local and peer address of client
+        DATA,
+        FIN,
+        RESET,
+        WINDOW // payload: 4 bytes of returned window
+    };
+
+    static const size_t head_size = 8;
+    static const size_t max_payload = 16384;
+    static const size_t stream_window = 262144;
+
+    // Backend: fd is stream end for new Proxy; true means error
+    typedef bool (*open_f)(void *ctx, int fd, const in_addr &local, const in_addr &peer);
+
+    struct Stats
+    {
+        size_t connects = 0;
+        size_t drops = 0;
+        size_t streams = 0; // opened
+        size_t resets = 0; // sent
+    };
+    static thread_local Stats stats;
+
+    // Frontend: server is connected on first stream (and after drop)
+    Link(struct ev_loop *event_loop_, const UpstreamServer &server_);
+    // Backend: accepted link, deletes itself when it is closed by frontend
+    Link(struct ev_loop *event_loop_, int fd, open_f open_, void *open_ctx_);
+    ~Link();
+
+    // Frontend: takes client fd; true means error (fd is not taken)
+    bool open_stream(int fd, const in_addr &local, const in_addr &peer);
+
+    size_t stream_count() const
+    {
+        return streams.size();
+    }
+
+private:
+    struct Stream
+    {
+        ev_io watcher; // local fd
+        Link *link;
+        uint32_t id;
+        size_t window = stream_window; // we may send
+        size_t consumed = 0; // written to fd, not returned to peer yet
+        std::string pending; // received, not written to fd yet
+        bool fin_sent = false;
+        bool fin_received = false;
+    };
+
+    struct ev_loop *event_loop;
+    ev_io watcher;
+    UpstreamServer server;
+    bool frontend;
+    bool connecting = false;
+    open_f open = nullptr;
+    void *open_ctx = nullptr;
+    std::string out; // frames to send
+    size_t out_pos = 0; // sent part of out
+    std::vector<char> in;
+    size_t in_size = 0;
+    std::unordered_map<uint32_t, Stream *> streams;
+    uint32_t next_id = 1;
+
+    bool connect();
+    void start(int fd, int events);
+    void drop();
+    void update();
+    // true means link is dropped
+    bool read_frames();
+    bool write_frames();
+    void send_frame(uint32_t id, FrameType type, const char *data = nullptr, size_t size = 0);
+    void handle_frame(uint32_t id, FrameType type, const char *data, size_t size);
+
+    Stream *new_stream(uint32_t id, int fd);
+    void update(Stream &s);
+    void stream_read(Stream &s);
+    void stream_write(Stream &s);
+    void stream_data(Stream &s, const char *data, size_t size);
+    void return_window(Stream &s);
+    void check_finished(Stream &s);
+    void reset_stream(Stream &s);
+    void close_stream(Stream &s);
+
+    static void
+    callback(EV_P_ ev_io *w, int revents);
+
+    static void
+    stream_callback(EV_P_ ev_io *w, int revents);
+};
+
+#endif // __evx_link_h
@@ -1,9 +1,16 @@
 #include <iostream>
+#include <sstream>
 #include <cstdio>
+#include <atomic>
+#include <vector>
+#include <csignal>
+#include <cstring>
+#include <algorithm>
 #include "evoxy.h"
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <ev.h>
 
 #include "threads.h"
@@ -11,12 +18,90 @@
 #include "util.h"
 #include "connection.h"
 #include "cache.h"
+#include "cluster.h"
+#include "h2.h"
+#include "link.h"
+#include "route.h"
+#include "tls.h"
 
 ThreadPool thread_pool;
 
+enum Mode
+{
+    STANDALONE = 0,
+    FRONTEND, // clients are passed to backend tier over links
+    BACKEND // accepts links from frontend tier
+};
+static Mode mode = STANDALONE;
+static UpstreamServer link_server;
+static SSL_CTX *tls_context = nullptr; // --tls-port
+static std::vector<HostAddress> source_addresses; // --source-address
+static std::string via_pseudonym; // --via-pseudonym as Via fragment, " name\r\n"
+static in_addr listen_address {htonl(INADDR_ANY)}; // --listen-address
+
 
 using std::unique_ptr;
 
+struct EventBackend
+{
+    const char *name;
+    unsigned int flags;
+};
+
+static const EventBackend event_backends[] = {
+    {"epoll", EVBACKEND_EPOLL},
+#if EV_VERSION_MAJOR > 4 || EV_VERSION_MINOR >= 27
+    {"linuxaio", EVBACKEND_LINUXAIO},
+#endif
+    {"poll", EVBACKEND_POLL},
+    {"select", EVBACKEND_SELECT}
+};
+
+static const char *
+event_backend_name(unsigned int flags)
+{
+    for (const EventBackend &b: event_backends)
+        if (b.flags == flags)
+            return b.name;
+    return "unknown";
+}
+
+// --event-backend io_uring is our completion engine on epoll loop (see uring.h)
+static bool
+uring_requested()
+{
+    return HAVE_OPT(EVENT_BACKEND) && !strcmp(OPT_ARG(EVENT_BACKEND), "io_uring");
+}
+
+/* Requested backend is tried first, then EPOLL, POLL, SELECT.
+   linuxaio is never selected by libev automatically (and may be
+   unavailable in running kernel), so it must be requested. */
+static struct ev_loop *
+new_event_loop(const char *requested)
+{
+    struct ev_loop *event_loop = nullptr;
+    if (requested && strcmp(requested, "io_uring")) {
+        const EventBackend *b = std::find_if(
+            std::begin(event_backends), std::end(event_backends),
+            [requested] (const EventBackend &b) { return !strcmp(b.name, requested); });
+        if (b == std::end(event_backends))
+            throw std::runtime_error(std::string("libev: unknown event backend ") + requested);
+        event_loop = ev_loop_new(b->flags);
+        if (!event_loop)
+            cerror("new_event_loop", "libev: backend ", requested, " is not supported, falling back");
+    }
+    for (unsigned int flags: {EVBACKEND_EPOLL, EVBACKEND_POLL, EVBACKEND_SELECT}) {
+        if (event_loop)
+            break;
+        event_loop = ev_loop_new(flags);
+    }
+    if (!event_loop)
+        throw std::runtime_error("libev: failed to start event loop!");
+
+    cdebug("libev: selected backend ", event_backend_name(ev_backend(event_loop)));
+    return event_loop;
+}
+
 class AcceptTask : public Task
 {
     /* Because AcceptTask is done inside event loop thread, processing must be fast enough
@@ -27,132 +112,748 @@ class AcceptTask : public Task
        Otherwise, if longer processing is required, additional task should created and routed to worker thread. */
 
     static const int MAX_LISTEN_QUEUE = SOMAXCONN;
+    int index; // accept thread number
     int listen_fd;
+    int tls_listen_fd = -1;
     // OPTIMIZE: addr can be shared
     struct sockaddr_in addr;
 
     // libev entities
     struct ev_loop *event_loop;
     ev_io accept_watcher;
+    ev_io tls_accept_watcher;
+    unique_ptr<Uring> uring; // --event-backend io_uring, accepts by multishot
+    Uring::Acceptor *acceptor = nullptr;
+    Uring::Acceptor *tls_acceptor = nullptr;
+    ev_timer stats_watcher;
+    ev_timer snapshot_watcher;
+    ev_async shutdown_watcher;
     typedef Pool<Proxy> ConnectionPool;
     unique_ptr<ConnectionPool> pool;
-    unique_ptr<NameCacheOnPool> name_cache;
+    unique_ptr<Resolver> resolver;
+
+    /* Admission control: when free connection slots fall under low watermark,
+       accepting is paused (connections wait in listen backlog, so kernel
+       sees the overload) or, with --overload-reply, they are answered
+       with 503 right here. Normal accepting is resumed when free slots reach
+       high watermark. */
+    ev_prepare admission_watcher;
+    size_t low_watermark;
+    size_t high_watermark;
+    bool overloaded = false;
+    size_t accept_pauses = 0;
+    size_t accept_resumes = 0;
+    size_t shed_connections = 0;
+    // accepting paused by exhausted descriptors is resumed by it in a second
+    ev_timer accept_retry_watcher;
+
+    // --mode frontend: links to backend tier, clients are their streams
+    std::vector<unique_ptr<Link>> links;
+    size_t next_link = 0;
+
+    size_t
+    used_slots() const
+    {
+        // TLS handshake holds slot of connection it becomes
+        size_t handshakes = TlsConnection::stats.in_progress;
+        if (mode != FRONTEND)
+            return pool->used() + handshakes;
+        size_t streams = 0;
+        for (const unique_ptr<Link> &link: links)
+            streams += link->stream_count();
+        return streams + handshakes;
+    }
+
+    size_t
+    free_slots() const
+    {
+        size_t used = used_slots();
+        return used < pool->capacity() ? pool->capacity() - used : 0;
+    }
 
     void
-    accept_conn()
+    check_overload()
+    {
+        if (overloaded || free_slots() >= low_watermark)
+            return;
+        overloaded = true;
+        accept_pauses++;
+        if (!ENABLED_OPT(OVERLOAD_REPLY))
+            stop_accepting();
+        ev_prepare_start(event_loop, &admission_watcher);
+        debug("Overloaded: ", free_slots(), " free connection slots");
+    }
+
+    static void
+    admission_callback (EV_P_ ev_prepare *w, int revents)
+    {
+        AcceptTask *self = (AcceptTask *)w->data;
+        if (self->free_slots() < self->high_watermark)
+            return;
+        self->overloaded = false;
+        self->accept_resumes++;
+        ev_prepare_stop(EV_A_ w);
+        self->start_accepting();
+        cdebug("Overload is over: ", self->free_slots(), " free connection slots");
+    }
+
+    void
+    start_accepting()
+    {
+        if (uring) {
+            acceptor->start();
+            if (tls_acceptor)
+                tls_acceptor->start();
+            return;
+        }
+        ev_io_start(event_loop, &accept_watcher);
+        if (tls_listen_fd >= 0)
+            ev_io_start(event_loop, &tls_accept_watcher);
+    }
+
+    void
+    stop_accepting()
+    {
+        if (uring) {
+            acceptor->stop();
+            if (tls_acceptor)
+                tls_acceptor->stop();
+            return;
+        }
+        ev_io_stop(event_loop, &accept_watcher);
+        ev_io_stop(event_loop, &tls_accept_watcher);
+    }
+
+    void
+    shed_conn(int conn_fd)
+    {
+        static const char reply[] =
+            "HTTP/1.1 503 Service Unavailable\r\n"
+            "Connection: close\r\n"
+            "Content-Length: 0\r\n"
+            "Retry-After: 1\r\n"
+            "\r\n";
+        shed_connections++;
+        // socket buffer is empty, so it doesn't block
+        send(conn_fd, reply, sizeof(reply) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        shutdown(conn_fd, SHUT_RDWR);
+        close(conn_fd);
+    }
+
+    void
+    accept_conn(bool tls = false)
     {
         debug("AcceptTask incoming connection!");
         struct sockaddr_in peer_addr;
         socklen_t addr_len = sizeof (peer_addr);
-        int conn_fd = accept(listen_fd, (sockaddr *)&peer_addr, &addr_len);
+        int conn_fd = accept4(tls ? tls_listen_fd : listen_fd, (sockaddr *)&peer_addr, &addr_len,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (conn_fd == -1) {
             if (errno != EAGAIN) {
-                throw Errno("accept");
+                accept_failed(errno);
+                return;
             }
             // something ugly happened: we should get valid conn_fd here (because of read event)
             error("Warning: unexpected EAGAIN!");
             return;
         }
-        debug("Got connection from ", inet_ntoa(peer_addr.sin_addr));
+        open_conn(conn_fd, peer_addr.sin_addr, tls);
+    }
+
+    // Multishot accept of io_uring doesn't give peer address
+    static void
+    accepted_callback(void *ctx, int listen_fd, int conn_fd)
+    {
+        AcceptTask *self = (AcceptTask *)ctx;
+        if (conn_fd == -1) {
+            self->accept_failed(errno);
+            return;
+        }
+        struct sockaddr_in peer_addr;
+        socklen_t addr_len = sizeof (peer_addr);
+        if (getpeername(conn_fd, (sockaddr *)&peer_addr, &addr_len)) {
+            // client is gone already
+            close(conn_fd);
+            return;
+        }
+        self->open_conn(conn_fd, peer_addr.sin_addr, listen_fd == self->tls_listen_fd);
+    }
+
+    /* Client gone before accept (and network errors accept(2) passes on)
+       costs only its connection. Out of descriptors or memory, accepting
+       is paused for a while: clients wait in listen backlog meanwhile. */
+    void
+    accept_failed(int err)
+    {
+        switch (err) {
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            error("accept: ", strerror(err), ", pausing accepting");
+            stop_accepting();
+            ev_timer_start(event_loop, &accept_retry_watcher);
+            return;
+        case ECONNABORTED:
+        case EINTR:
+        case EPERM:
+        case EPROTO:
+        case ENOPROTOOPT:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case ENONET:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case EOPNOTSUPP:
+            debug("accept: ", strerror(err));
+            return;
+        default:
+            throw Errno("accept");
+        }
+    }
+
+    static void
+    accept_retry_callback (EV_P_ ev_timer *w, int revents)
+    {
+        AcceptTask *self = (AcceptTask *)w->data;
+        // admission control resumes it otherwise
+        if (!self->overloaded || ENABLED_OPT(OVERLOAD_REPLY))
+            self->start_accepting();
+    }
+
+    void
+    open_conn(int conn_fd, const in_addr &peer, bool tls)
+    {
+        debug("Got connection from ", inet_ntoa(peer));
+        if (overloaded || (tls && !free_slots())) {
+            // 503 can't be sent before handshake
+            if (tls) {
+                shed_connections++;
+                close(conn_fd);
+            } else {
+                shed_conn(conn_fd);
+            }
+            return;
+        }
+        if (tls) {
+            open_tls(conn_fd, peer);
+            return;
+        }
+        switch (mode) {
+        case FRONTEND:
+            open_stream(conn_fd, peer);
+            return;
+        case BACKEND:
+            new Link(event_loop, conn_fd, open_client, this);
+            return;
+        default:
+            break;
+        }
+        in_addr local {};
+        if (ENABLED_OPT(H2C)) {
+            local_address(conn_fd, local);
+            new H2Connection(event_loop, conn_fd, local, peer, open_proxy, this);
+            return;
+        }
+        if (via_pseudonym.empty())
+            local_address(conn_fd, local);
+        Proxy *proxy = nullptr;
+        try {
+            proxy = new (*pool) Proxy(event_loop, conn_fd, resolver.get());
+        } catch (std::bad_alloc) {
+            error("Memory pool is empty! Discarding connection from ", inet_ntoa(peer));
+            shed_conn(conn_fd);
+        }
+        check_overload();
+        if (proxy) {
+            proxy->set_client(via_pseudonym, local, peer);
+            proxy->first_read();
+        }
+    }
+
+    // Address client has connected to: the one of listener unless it is any
+    void
+    local_address(int conn_fd, in_addr &local)
+    {
+        if (listen_address.s_addr != htonl(INADDR_ANY)) {
+            local = listen_address;
+            return;
+        }
+        struct sockaddr_in local_addr;
+        socklen_t addr_len = sizeof(local_addr);
+        if (getsockname(conn_fd, (sockaddr *)&local_addr, &addr_len))
+            throw Errno("getsockname");
+        local = local_addr.sin_addr;
+    }
+
+    void
+    open_stream(int conn_fd, const in_addr &peer)
+    {
+        in_addr local;
+        local_address(conn_fd, local);
+        if (open_link_stream(this, conn_fd, local, peer))
+            shed_conn(conn_fd);
+    }
+
+    // Client of frontend tier becomes link stream; true means error
+    static bool
+    open_link_stream(void *ctx, int fd, const in_addr &local, const in_addr &peer)
+    {
+        AcceptTask *self = (AcceptTask *)ctx;
+        // link which can't connect is skipped
+        for (size_t i = 0; i < self->links.size(); ++i) {
+            Link &link = *self->links[self->next_link++ % self->links.size()];
+            if (!link.open_stream(fd, local, peer)) {
+                self->check_overload();
+                return false;
+            }
+        }
+        cerror("open_link_stream", "No link to backend tier! Discarding connection from ", inet_ntoa(peer));
+        return true;
+    }
+
+    // Handshake is done on this loop, then client goes on as accepted one
+    void
+    open_tls(int conn_fd, const in_addr &peer)
+    {
+        in_addr local;
+        local_address(conn_fd, local);
         try {
-            new (*pool) Proxy(event_loop, conn_fd, name_cache.get());
+            new TlsConnection(event_loop, tls_context, conn_fd, local, peer, open_handshaken, this);
         } catch (std::bad_alloc) {
-            error("Memory pool is empty! Discarding connection from ", inet_ntoa(peer_addr.sin_addr));
-            shutdown(conn_fd, SHUT_RDWR);
+            error("TLS: out of memory! Discarding connection from ", inet_ntoa(peer));
             close(conn_fd);
+            return;
+        }
+        check_overload();
+    }
+
+    /* Client after TLS handshake goes the way of plain one. It isn't refused
+       on overload: its slot was taken when handshake started. */
+    static bool
+    open_handshaken(void *ctx, int fd, const in_addr &local, const in_addr &peer)
+    {
+        AcceptTask *self = (AcceptTask *)ctx;
+        if (mode == FRONTEND)
+            return open_link_stream(ctx, fd, local, peer);
+        if (ENABLED_OPT(H2C)) {
+            new H2Connection(self->event_loop, fd, local, peer, open_proxy, self);
+            return false;
+        }
+        return self->new_proxy(fd, local, peer);
+    }
+
+    // Stream of frontend tier is processed as accepted connection
+    static bool
+    open_proxy(void *ctx, int fd, const in_addr &local, const in_addr &peer)
+    {
+        AcceptTask *self = (AcceptTask *)ctx;
+        if (self->overloaded)
+            return true;
+        return self->new_proxy(fd, local, peer);
+    }
+
+    // true means error
+    bool
+    new_proxy(int fd, const in_addr &local, const in_addr &peer)
+    {
+        try {
+            Proxy *proxy = new (*pool) Proxy(event_loop, fd, resolver.get());
+            proxy->set_client(via_pseudonym, local, peer);
+        } catch (std::bad_alloc) {
+            error("Memory pool is empty! Discarding stream from ", inet_ntoa(peer));
+            return true;
         }
+        check_overload();
+        return false;
+    }
+
+    // Stream of frontend tier may carry HTTP/2 connection
+    static bool
+    open_client(void *ctx, int fd, const in_addr &local, const in_addr &peer)
+    {
+        AcceptTask *self = (AcceptTask *)ctx;
+        if (!ENABLED_OPT(H2C))
+            return open_proxy(ctx, fd, local, peer);
+        if (self->overloaded)
+            return true;
+        new H2Connection(self->event_loop, fd, local, peer, open_proxy, self);
+        return false;
     }
 
     static void
     accept_callback (EV_P_ ev_io *w, int revents)
     {
-        ((AcceptTask *)w->data)->accept_conn();
+        AcceptTask *self = (AcceptTask *)w->data;
+        self->accept_conn(w == &self->tls_accept_watcher);
     }
 
-public:
-    static size_t
-    pool_size(size_t capacity)
+    void
+    print_stats()
     {
-        decltype(pool)::element_type::memsize(capacity);
+        std::ostringstream s;
+        s << "[" << std::this_thread::get_id() << "] "
+          << (uring ? "io_uring" : event_backend_name(ev_backend(event_loop))) << ": "
+          << ev_iteration(event_loop) << " loop iterations; ";
+        if (uring)
+            s << Uring::stats.enters << " enters, "
+              << Uring::stats.completions << " completions ("
+              << Uring::stats.accepts << " accepts, "
+              << Uring::stats.recvs << " receives, "
+              << Uring::stats.sends << " sends), "
+              << Uring::stats.buffer_waits << " buffer waits, "
+              << Uring::stats.cancelled_sends << " stuck sends cancelled; ";
+        s << "watcher updates: " << OnEventLoop::event_stats.updates << " ("
+          << OnEventLoop::event_stats.transitions - OnEventLoop::event_stats.updates
+          << " coalesced); "
+          << "timers: " << OnEventLoop::timers.size() << " armed, "
+          << OnEventLoop::event_stats.timeouts << " expired; "
+          << "connections: " << used_slots() << " active, "
+          << accept_pauses << " overloads, "
+          << accept_resumes << " recoveries, "
+          << shed_connections << " shed; "
+          << "server connections: " << Proxy::upstreams.size() << " idle, "
+          << Proxy::upstreams.stats.parked << " parked, "
+          << Proxy::upstreams.stats.reused << " reused ("
+          << Proxy::upstreams.stats.stale << " stale), "
+          << Proxy::upstreams.stats.expired << " expired; ";
+        if (Proxy::sources.size()) {
+            s << "sources:";
+            for (size_t i = 0; i < Proxy::sources.size(); ++i) {
+                const HostAddress &a = Proxy::sources.address(i);
+                char buf[INET6_ADDRSTRLEN];
+                inet_ntop(a.family, &a.v4, buf, sizeof(buf));
+                s << " " << buf << " " << Proxy::sources.connects(i) << " connects,";
+            }
+            s << " ";
+        }
+        if (Proxy::sources.size() || Proxy::sources.stats.unavailable)
+            s << Proxy::sources.stats.unavailable << " source ports or addresses unavailable; ";
+        s << "first reads: " << Proxy::accept_stats.heads << " request heads of "
+          << Proxy::accept_stats.reads << " connections; ";
+        if (ENABLED_OPT(UPSTREAM_FASTOPEN))
+            s << "fastopen: " << Proxy::sources.stats.fastopens << " server connections, "
+              << Proxy::sources.stats.fastopen_failures << " failed; ";
+        if (mode != STANDALONE)
+            s << "links: " << Link::stats.connects << " connects, "
+              << Link::stats.drops << " drops, "
+              << Link::stats.streams << " streams, "
+              << Link::stats.resets << " resets; ";
+        if (ENABLED_OPT(H2C))
+            s << "h2c: " << H2Connection::stats.connections << " connections, "
+              << H2Connection::stats.streams << " streams, "
+              << H2Connection::stats.refused << " refused, "
+              << H2Connection::stats.large_heads << " too large, "
+              << H2Connection::stats.resets << " resets; ";
+        if (tls_context)
+            s << "tls: " << TlsConnection::stats.handshakes << " handshakes ("
+              << TlsConnection::stats.ktls << " kTLS, "
+              << TlsConnection::stats.userspace << " userspace), "
+              << TlsConnection::stats.failures << " failures, "
+              << TlsConnection::stats.in_progress << " in progress; ";
+        if (Proxy::tunnel_stats.connects || Proxy::tunnel_stats.upgrades)
+            s << "tunnels: " << Proxy::tunnel_stats.connects << " connects, "
+              << Proxy::tunnel_stats.upgrades << " upgrades, "
+              << Relay::stats.spliced_bytes / 1024 << " kb spliced, "
+              << Relay::stats.copied_bytes / 1024 << " kb copied; ";
+        if (clusters.size())
+            s << "balancer: " << Proxy::balancer.stats.picks << " picks, "
+              << Proxy::balancer.stats.failures << " failures, "
+              << Proxy::balancer.stats.ejections << " ejections; ";
+        if (GzipStream::enabled())
+            s << "gzip: " << GzipStream::stats.responses << " responses, "
+              << GzipStream::stats.bytes_in / 1024 << " kb in, "
+              << GzipStream::stats.bytes_out / 1024 << " kb out; ";
+        if (ENABLED_OPT(REQUEST_BUFFERING))
+            s << "request buffering: " << Proxy::buffering_stats.request_bytes / 1024 << " kb, "
+              << Proxy::buffering_stats.request_spilled << " spilled to file; ";
+        if (ENABLED_OPT(RESPONSE_BUFFERING))
+            s << "response buffering: " << Proxy::buffering_stats.response_bytes / 1024 << " kb, "
+              << Proxy::buffering_stats.response_spilled << " spilled to file; ";
+        if (NameCacheOnPool *name_cache = resolver->cache()) {
+            auto &stats = name_cache->stats;
+            s << "name cache: " << name_cache->size() << " items, "
+              << stats.hits << " hits, "
+              << stats.misses << " misses, "
+              << stats.negative_hits << " negative hits, "
+              << stats.stale_hits << " stale hits, "
+              << resolver->refreshes << " refreshes ("
+              << resolver->refresh_failures << " failed)";
+        }
+        s << std::endl;
+        std::cout << s.str() << std::flush;
     }
 
-    AcceptTask(size_t conn_capacity) :
-        pool(new ConnectionPool(conn_capacity))
+    static void
+    stats_callback (EV_P_ ev_timer *w, int revents)
     {
-        debug("AcceptTask created");
+        ((AcceptTask *)w->data)->print_stats();
+    }
 
-        if (OPT_VALUE_NAME_CACHE) {
-            name_cache.reset(new NameCacheOnPool(OPT_VALUE_NAME_CACHE, OPT_VALUE_CACHE_LIFETIME));
+    void
+    save_snapshot()
+    {
+        NameCacheOnPool *name_cache = resolver->cache();
+        if (!HAVE_OPT(CACHE_SNAPSHOT) || !name_cache)
+            return;
+
+        if (NameCacheSnapshot::save(*name_cache, OPT_ARG(CACHE_SNAPSHOT), index)) {
+            error("Saving name cache snapshot failed: ", strerror(errno));
+            return;
+        }
+        debug("Saved name cache snapshot of ", name_cache->size(), " items");
+    }
+
+    static void
+    snapshot_callback (EV_P_ ev_timer *w, int revents)
+    {
+        ((AcceptTask *)w->data)->save_snapshot();
+    }
+
+    /* Graceful shutdown (on SIGTERM, SIGINT) is needed for saving name cache
+       snapshots: signals are handled by main thread, which asks other accept
+       threads to save their caches and waits (without blocking its loop)
+       until the last one reports back or a second is over. */
+    static ev_signal sigterm_watcher;
+    static ev_signal sigint_watcher;
+    static std::vector<AcceptTask *> peers;
+    static std::atomic<int> pending_shutdowns;
+    static ev_async shutdown_done_watcher; // of main thread
+    static ev_timer shutdown_timer;
+    static struct ev_loop *main_loop;
+
+    // --routes file is reloaded on SIGHUP, old routes stay on error
+    static ev_signal sighup_watcher;
+
+    static void
+    reload_callback (EV_P_ ev_signal *w, int revents)
+    {
+        std::string err;
+        RouteTable *table = RouteTable::load(clusters, OPT_ARG(ROUTES), err);
+        if (!table) {
+            cerror("reload_callback", "routes are not reloaded: ", err);
+            return;
+        }
+        routes.publish(table);
+        cdebug("Routes are reloaded from ", OPT_ARG(ROUTES));
+    }
+
+    static void
+    shutdown_callback (EV_P_ ev_async *w, int revents)
+    {
+        AcceptTask *self = (AcceptTask *)w->data;
+        self->save_snapshot();
+        if (--pending_shutdowns == 0)
+            ev_async_send(main_loop, &shutdown_done_watcher);
+        ev_break(self->event_loop, EVBREAK_ALL);
+    }
+
+    static void
+    shutdown_done_callback (EV_P_ ev_async *w, int revents)
+    {
+        if (pending_shutdowns > 0)
+            return;
+        ev_break(EV_A_ EVBREAK_ALL);
+    }
+
+    static void
+    shutdown_timeout_callback (EV_P_ ev_timer *w, int revents)
+    {
+        cerror("shutdown_timeout_callback", "Accept threads didn't save name cache snapshots in time");
+        ev_break(EV_A_ EVBREAK_ALL);
+    }
+
+    static void
+    signal_callback (EV_P_ ev_signal *w, int revents)
+    {
+        AcceptTask *self = (AcceptTask *)w->data;
+        cdebug("Got signal ", w->signum, ", shutting down...");
+        pending_shutdowns = peers.size();
+        for (AcceptTask *peer: peers)
+            ev_async_send(peer->event_loop, &peer->shutdown_watcher);
+
+        self->save_snapshot();
+
+        if (pending_shutdowns > 0) {
+            ev_timer_start(self->event_loop, &shutdown_timer);
+            return;
         }
+        ev_break(self->event_loop, EVBREAK_ALL);
+    }
 
-        // listen socket setup
-        listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (listen_fd < 0) {
+    // Listen socket setup
+    static int
+    listen_port(struct sockaddr_in &addr, int port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
             throw Errno("socket");;
         }
         int sock_opt = 1;
         // SO_REUSEPORT allows multiple sockets with same ADDRESS:PORT. Linux does load-balancing of incoming connections.
         // See long explanation in SO-14388706.
         #ifdef SO_REUSEPORT
-        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (char *) &sock_opt, sizeof(sock_opt)) == -1) {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &sock_opt, sizeof(sock_opt)) == -1) {
             throw Errno("setsockopt");
         }
         #endif
         addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = INADDR_ANY;
-        addr.sin_port = htons(OPT_VALUE_PORT);
-        debug("Listening on ", inet_ntoa(addr.sin_addr), ":", OPT_VALUE_PORT);
-        if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        addr.sin_addr = listen_address;
+        addr.sin_port = htons(port);
+        cdebug("listen_port", "Listening on ", inet_ntoa(addr.sin_addr), ":", port);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
             throw Errno("bind");;
         }
-        if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        #ifdef TCP_FASTOPEN
+        int qlen = OPT_VALUE_FASTOPEN;
+        if (qlen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
+            cerror("listen_port", "TCP_FASTOPEN: ", strerror(errno));
+        #endif
+        #ifdef TCP_DEFER_ACCEPT
+        int defer = OPT_VALUE_DEFER_ACCEPT;
+        if (defer && mode != BACKEND && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) == -1)
+            cerror("listen_port", "TCP_DEFER_ACCEPT: ", strerror(errno));
+        #endif
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
             throw Errno("fcntl");
         }
-        if (listen(listen_fd, MAX_LISTEN_QUEUE) != 0) {
+        if (listen(fd, MAX_LISTEN_QUEUE) != 0) {
             throw Errno("listen");
         }
+        return fd;
+    }
+
+public:
+    static size_t
+    pool_size(size_t capacity)
+    {
+        decltype(pool)::element_type::memsize(capacity);
+    }
+
+    AcceptTask(size_t conn_capacity, int _index, const NameCacheSnapshot *snapshot) :
+        index(_index),
+        pool(new ConnectionPool(conn_capacity)),
+        low_watermark(conn_capacity * OPT_VALUE_ADMISSION_LOW_WATERMARK / 100),
+        high_watermark(std::max(conn_capacity * OPT_VALUE_ADMISSION_HIGH_WATERMARK / 100, low_watermark))
+    {
+        debug("AcceptTask created");
+
+        listen_fd = listen_port(addr, OPT_VALUE_PORT);
+        if (tls_context) {
+            struct sockaddr_in tls_addr;
+            tls_listen_fd = listen_port(tls_addr, OPT_VALUE_TLS_PORT);
+        }
         // libev setup
-        event_loop = ev_loop_new(EVBACKEND_EPOLL);
-        if (!event_loop) {
-            event_loop = ev_loop_new(EVBACKEND_POLL);
-            if (!event_loop) {
-                event_loop = ev_loop_new(EVBACKEND_SELECT);
-                if (!event_loop) {
-                    throw std::runtime_error("libev: failed to start event loop!");
-                }
-                debug("libev: selected backend SELECT");
-            } else {
-                debug("libev: selected backend POLL");
-            }
-        } else {
-            debug("libev: selected backend EPOLL");
+        event_loop = new_event_loop(uring_requested() ? nullptr : OPT_ARG(EVENT_BACKEND));
+
+        NameCacheOnPool *name_cache = nullptr;
+        if (OPT_VALUE_NAME_CACHE) {
+            name_cache = new NameCacheOnPool(
+                OPT_VALUE_NAME_CACHE,
+                OPT_VALUE_CACHE_LIFETIME,
+                OPT_VALUE_CACHE_MIN_TTL,
+                OPT_VALUE_CACHE_MAX_TTL,
+                OPT_VALUE_NEGATIVE_CACHE_LIFETIME,
+                // stale items are refreshed on worker threads
+                OPT_VALUE_WORKER_THREADS ? OPT_VALUE_CACHE_STALE_LIFETIME : 0);
+        }
+        resolver.reset(new Resolver(
+            event_loop, OPT_VALUE_WORKER_THREADS ? &thread_pool : nullptr, name_cache));
+        if (name_cache && snapshot) {
+            size_t loaded = snapshot->load(*name_cache);
+            debug("Loaded ", loaded, " items from name cache snapshot");
         }
         ev_io_init (&accept_watcher, accept_callback, listen_fd, EV_READ);
         accept_watcher.data = this;
+        ev_io_init (&tls_accept_watcher, accept_callback, tls_listen_fd, EV_READ);
+        tls_accept_watcher.data = this;
+        ev_timer_init (&stats_watcher, stats_callback, OPT_VALUE_STATS_INTERVAL, OPT_VALUE_STATS_INTERVAL);
+        stats_watcher.data = this;
+        ev_timer_init (&snapshot_watcher, snapshot_callback,
+            OPT_VALUE_CACHE_SNAPSHOT_INTERVAL, OPT_VALUE_CACHE_SNAPSHOT_INTERVAL);
+        snapshot_watcher.data = this;
+        ev_async_init (&shutdown_watcher, shutdown_callback);
+        shutdown_watcher.data = this;
+        ev_prepare_init (&admission_watcher, admission_callback);
+        admission_watcher.data = this;
+        ev_timer_init (&accept_retry_watcher, accept_retry_callback, 1., 0.);
+        accept_retry_watcher.data = this;
     }
     virtual ~AcceptTask()
     {
+        links.clear();
+        uring.reset();
         if (event_loop)
             ev_loop_destroy(event_loop);
     }
     AcceptTask(AcceptTask &&src) :
+        index{src.index},
         listen_fd{src.listen_fd},
+        tls_listen_fd{src.tls_listen_fd},
         addr{src.addr},
         event_loop{src.event_loop},
         accept_watcher{src.accept_watcher},
+        tls_accept_watcher{src.tls_accept_watcher},
+        uring(std::move(src.uring)),
+        acceptor{src.acceptor},
+        tls_acceptor{src.tls_acceptor},
+        stats_watcher{src.stats_watcher},
+        snapshot_watcher{src.snapshot_watcher},
+        shutdown_watcher{src.shutdown_watcher},
         pool(std::move(src.pool)),
-        name_cache(std::move(src.name_cache))
+        resolver(std::move(src.resolver)),
+        admission_watcher{src.admission_watcher},
+        low_watermark{src.low_watermark},
+        high_watermark{src.high_watermark},
+        accept_retry_watcher{src.accept_retry_watcher}
     {
         debug("AcceptTask moved from ", &src);
         accept_watcher.data = this;
+        tls_accept_watcher.data = this;
+        stats_watcher.data = this;
+        snapshot_watcher.data = this;
+        shutdown_watcher.data = this;
+        admission_watcher.data = this;
+        accept_retry_watcher.data = this;
         src.listen_fd = 0;
+        src.tls_listen_fd = -1;
         src.event_loop = nullptr;
     }
     virtual void execute()
     {
-        if (name_cache)
-            name_cache->init_thread();
-        ev_io_start(event_loop, &accept_watcher);
+        resolver->start();
+        // ring is created by thread which submits to it
+        if (uring_requested()) {
+            std::string err;
+            uring.reset(Uring::create(event_loop, err));
+            if (uring) {
+                acceptor = uring->listen(listen_fd, accepted_callback, this);
+                if (tls_listen_fd >= 0)
+                    tls_acceptor = uring->listen(tls_listen_fd, accepted_callback, this);
+            } else {
+                cerror("execute", "io_uring: ", err, ", falling back to epoll");
+            }
+        }
+        OnEventLoop::init_thread(event_loop, uring.get());
+        Proxy::upstreams.init(event_loop, OnEventLoop::timers,
+            OPT_VALUE_UPSTREAM_KEEPALIVE, OPT_VALUE_UPSTREAM_KEEPALIVE_TIMEOUT);
+        Proxy::balancer.init(clusters, OPT_VALUE_UPSTREAM_MAX_FAILS,
+            OPT_VALUE_UPSTREAM_EJECT_TIME, index + 1);
+        Proxy::sources.init(source_addresses, ENABLED_OPT(UPSTREAM_FASTOPEN));
+        if (!GzipStream::types.empty())
+            GzipStream::init_thread(event_loop, &thread_pool);
+        if (mode == FRONTEND) {
+            for (int i = 0; i < OPT_VALUE_LINK_CONNECTIONS; ++i)
+                links.emplace_back(new Link(event_loop, link_server));
+        }
+        start_accepting();
+        if (OPT_VALUE_STATS_INTERVAL)
+            ev_timer_start(event_loop, &stats_watcher);
+        if (HAVE_OPT(CACHE_SNAPSHOT) && resolver->cache()) {
+            if (OPT_VALUE_CACHE_SNAPSHOT_INTERVAL)
+                ev_timer_start(event_loop, &snapshot_watcher);
+            ev_async_start(event_loop, &shutdown_watcher);
+        }
         socklen_t addr_len = sizeof(addr);
         int conn_fd = accept(listen_fd, (struct sockaddr *) &addr, &addr_len);
         if (conn_fd == -1) {
@@ -165,8 +866,42 @@ public:
         debug("running event loop...");
         ev_run(event_loop, 0);
     }
+
+    // Called in main thread only
+    void handle_signals(std::vector<AcceptTask *> &&_peers)
+    {
+        peers = std::move(_peers);
+        main_loop = event_loop;
+        // started in advance: reports may come before the signal is handled
+        ev_async_init (&shutdown_done_watcher, shutdown_done_callback);
+        ev_async_start(event_loop, &shutdown_done_watcher);
+        ev_unref(event_loop);
+        ev_timer_init (&shutdown_timer, shutdown_timeout_callback, 1., 0.);
+        ev_signal_init (&sigterm_watcher, signal_callback, SIGTERM);
+        sigterm_watcher.data = this;
+        ev_signal_start(event_loop, &sigterm_watcher);
+        ev_signal_init (&sigint_watcher, signal_callback, SIGINT);
+        sigint_watcher.data = this;
+        ev_signal_start(event_loop, &sigint_watcher);
+    }
+
+    // Called in main thread only
+    void handle_reload()
+    {
+        ev_signal_init (&sighup_watcher, reload_callback, SIGHUP);
+        ev_signal_start(event_loop, &sighup_watcher);
+    }
 };
 
+ev_signal AcceptTask::sigterm_watcher;
+ev_signal AcceptTask::sigint_watcher;
+ev_signal AcceptTask::sighup_watcher;
+std::vector<AcceptTask *> AcceptTask::peers;
+std::atomic<int> AcceptTask::pending_shutdowns;
+ev_async AcceptTask::shutdown_done_watcher;
+ev_timer AcceptTask::shutdown_timer;
+struct ev_loop *AcceptTask::main_loop;
+
 void
 daemonize()
 {
@@ -181,6 +916,75 @@ daemonize()
         throw Errno("daemon");
 }
 
+// true means error
+static bool
+set_connect_ports(const char *list)
+{
+    for (const char *p = list; *p;) {
+        char *end;
+        long port = strtol(p, &end, 10);
+        if (end == p || (*end && *end != ',') || port < 1 || port > 65535) {
+            cerror("set_connect_ports", "bad --connect-ports ", list);
+            return true;
+        }
+        Proxy::connect_ports.push_back(port);
+        p = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+// true means error
+static bool
+set_gzip_types(const char *list)
+{
+    for (const char *p = list; *p;) {
+        const char *end = strchr(p, ',');
+        if (!end)
+            end = p + strlen(p);
+        while (p < end && *p == ' ')
+            ++p;
+        if (end - p < 3 || !memchr(p, '/', end - p)) {
+            cerror("set_gzip_types", "bad --gzip-types ", list);
+            return true;
+        }
+        GzipStream::types.emplace_back(p, end - p);
+        p = *end ? end + 1 : end;
+    }
+    return false;
+}
+
+// true means error
+static bool
+add_sources(int count, const char **addrs)
+{
+    for (int i = 0; i < count; ++i) {
+        HostAddress a;
+        if (inet_pton(AF_INET, addrs[i], &a.v4) == 1) {
+            a.family = AF_INET;
+        } else if (inet_pton(AF_INET6, addrs[i], &a.v6) == 1) {
+            a.family = AF_INET6;
+        } else {
+            cerror("add_sources", "bad --source-address ", addrs[i]);
+            return true;
+        }
+        source_addresses.push_back(a);
+    }
+    return false;
+}
+
+// true means error
+static bool
+add_clusters(int count, const char **specs, bool hashed)
+{
+    for (int i = 0; i < count; ++i) {
+        if (clusters.add(specs[i], hashed)) {
+            cerror("add_clusters", "bad ", hashed ? "--upstream-hash " : "--upstream ", specs[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
 int
 main(int argc, char ** argv)
 {
@@ -203,6 +1007,83 @@ main(int argc, char ** argv)
     if (!HAVE_OPT(WORKER_THREADS))
         OPT_VALUE_WORKER_THREADS = OPT_VALUE_ACCEPT_THREADS;
 
+    if (HAVE_OPT(MODE)) {
+        if (!strcmp(OPT_ARG(MODE), "frontend")) {
+            mode = FRONTEND;
+        } else if (!strcmp(OPT_ARG(MODE), "backend")) {
+            mode = BACKEND;
+        } else {
+            cerror("main", "unknown --mode ", OPT_ARG(MODE));
+            return 1;
+        }
+    }
+    if (mode == FRONTEND && (!HAVE_OPT(LINK_SERVER) || link_server.parse(OPT_ARG(LINK_SERVER)))) {
+        cerror("main", "--mode frontend requires --link-server ADDR:PORT");
+        return 1;
+    }
+
+    if (HAVE_OPT(UPSTREAM) &&
+        add_clusters(STACKCT_OPT(UPSTREAM), STACKLST_OPT(UPSTREAM), false))
+    {
+        return 1;
+    }
+    if (HAVE_OPT(UPSTREAM_HASH) &&
+        add_clusters(STACKCT_OPT(UPSTREAM_HASH), STACKLST_OPT(UPSTREAM_HASH), true))
+    {
+        return 1;
+    }
+    if (set_connect_ports(OPT_ARG(CONNECT_PORTS)))
+        return 1;
+    if (HAVE_OPT(SOURCE_ADDRESS) &&
+        add_sources(STACKCT_OPT(SOURCE_ADDRESS), STACKLST_OPT(SOURCE_ADDRESS)))
+    {
+        return 1;
+    }
+    if (HAVE_OPT(LISTEN_ADDRESS) && inet_pton(AF_INET, OPT_ARG(LISTEN_ADDRESS), &listen_address) != 1) {
+        cerror("main", "Wrong --listen-address: ", OPT_ARG(LISTEN_ADDRESS));
+        return 1;
+    }
+    if (HAVE_OPT(VIA_PSEUDONYM)) {
+        std::string name = OPT_ARG(VIA_PSEUDONYM);
+        // token[:port], it goes into header line as is
+        if (name.empty() || name.find_first_of(" \t\r\n,;()\"") != std::string::npos) {
+            cerror("main", "Wrong --via-pseudonym: ", name);
+            return 1;
+        }
+        via_pseudonym = " " + name + "\r\n";
+    }
+    if (HAVE_OPT(GZIP_TYPES)) {
+        if (!OPT_VALUE_WORKER_THREADS) {
+            cerror("main", "--gzip-types requires --worker-threads > 0");
+            return 1;
+        }
+        if (set_gzip_types(OPT_ARG(GZIP_TYPES)))
+            return 1;
+        GzipStream::level = OPT_VALUE_GZIP_LEVEL;
+    }
+    if (HAVE_OPT(TLS_PORT)) {
+        if (mode == BACKEND || !HAVE_OPT(TLS_CERT)) {
+            cerror("main", "--tls-port requires --tls-cert and is not supported with --mode backend");
+            return 1;
+        }
+        std::string tls_err;
+        tls_context = TlsConnection::load_context(OPT_ARG(TLS_CERT),
+            HAVE_OPT(TLS_KEY) ? OPT_ARG(TLS_KEY) : nullptr, tls_err);
+        if (!tls_context) {
+            cerror("main", tls_err);
+            return 1;
+        }
+    }
+
+    std::string routes_err;
+    RouteTable *route_table = RouteTable::load(clusters,
+        HAVE_OPT(ROUTES) ? OPT_ARG(ROUTES) : nullptr, routes_err);
+    if (!route_table) {
+        cerror("main", routes_err);
+        return 1;
+    }
+    routes.publish(route_table);
+
     // main thread is also accept thread, thus decreasing spawning
     int accept_pool_sz = OPT_VALUE_ACCEPT_THREADS - 1;
 
@@ -216,16 +1097,29 @@ main(int argc, char ** argv)
            "total pool size: ", AcceptTask::pool_size(OPT_VALUE_ACCEPT_CAPACITY) * OPT_VALUE_ACCEPT_THREADS / 1024, " kb.");
 
     if (OPT_VALUE_NAME_CACHE)
-        cdebug("Using name cache of ", OPT_VALUE_NAME_CACHE, " capacity, lifetime ", OPT_VALUE_CACHE_LIFETIME, " secs");
+        cdebug("Using name cache of ", OPT_VALUE_NAME_CACHE, " capacity, lifetime ", OPT_VALUE_CACHE_LIFETIME, " secs; "
+               "TTL clamped to ", OPT_VALUE_CACHE_MIN_TTL, "..", OPT_VALUE_CACHE_MAX_TTL, " secs; "
+               "negative lifetime ", OPT_VALUE_NEGATIVE_CACHE_LIFETIME, " secs; "
+               "stale lifetime ", OPT_VALUE_WORKER_THREADS ? OPT_VALUE_CACHE_STALE_LIFETIME : 0, " secs");
 
     try
     {
+        unique_ptr<NameCacheSnapshot> snapshot;
+        if (HAVE_OPT(CACHE_SNAPSHOT) && OPT_VALUE_NAME_CACHE)
+            snapshot.reset(new NameCacheSnapshot(OPT_ARG(CACHE_SNAPSHOT)));
+
+        std::vector<AcceptTask *> accept_tasks;
         for (int i = 0; i < accept_pool_sz; ++i) {
-            AcceptTask accept_task(OPT_VALUE_ACCEPT_CAPACITY);
-            thread_pool.add_task(accept_task);
+            AcceptTask accept_task(OPT_VALUE_ACCEPT_CAPACITY, i + 1, snapshot.get());
+            accept_tasks.push_back(thread_pool.add_task(accept_task));
         }
 
-        AcceptTask accept_task(OPT_VALUE_ACCEPT_CAPACITY);
+        AcceptTask accept_task(OPT_VALUE_ACCEPT_CAPACITY, 0, snapshot.get());
+        snapshot.reset(); // unmap snapshot files
+        if (HAVE_OPT(CACHE_SNAPSHOT) && OPT_VALUE_NAME_CACHE)
+            accept_task.handle_signals(std::move(accept_tasks));
+        if (HAVE_OPT(ROUTES))
+            accept_task.handle_reload();
         accept_task.execute();
     } catch(std::bad_alloc &) {
         std::cerr << "Not enough memory!\n";
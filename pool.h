@@ -43,10 +43,13 @@ class Pool : public GrowPolicy
     std::vector<PoolItem> pools;
     Node *free = nullptr;
     Node *last_ = nullptr;
+    size_t capacity_ = 0;
+    size_t used_ = 0;
 
     void add_pool(size_t size) override
     {
         free = new Node[size];
+        capacity_ += size;
 
         // form a linked list of blocks of this pool
         pools.push_back(PoolItem(free, size));
@@ -91,12 +94,25 @@ public:
         return chunks;
     }
 
+    size_t
+    capacity() const
+    {
+        return capacity_;
+    }
+
+    size_t
+    used() const
+    {
+        return used_;
+    }
+
     void*
     get() throw (std::bad_alloc)
     {
         GrowPolicy::on_get(free);
         last_ = free;
         free = free->next;
+        ++used_;
         return static_cast<void*>(last_);
     }
 
@@ -112,6 +128,7 @@ public:
         Node* node = static_cast<Node*>(block);
         node->next = free;
         free = node;
+        --used_;
     }
 
     ~Pool()
@@ -126,6 +143,12 @@ public:
 template<> \
 thread_local Pool<Object>* OnPool<Object>::pool = nullptr;
 
+/* Must be visible in every unit that does new/delete on Object,
+   otherwise compiler assumes TLS wrapper is defined there. */
+#define DECLARE_POOL(Object) \
+template<> \
+thread_local Pool<Object>* OnPool<Object>::pool;
+
 template <class Object>
 class OnPool
 {
@@ -0,0 +1,96 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "relay.h"
+
+thread_local Relay::Stats Relay::stats;
+
+Relay::~Relay()
+{
+    if (pipe[0] >= 0) {
+        close(pipe[0]);
+        close(pipe[1]);
+    }
+}
+
+void
+Relay::open()
+{
+    if (pipe2(pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        debug("pipe2: ", strerror(errno));
+        pipe[0] = pipe[1] = -1;
+        return;
+    }
+    capacity = fcntl(pipe[0], F_GETPIPE_SZ);
+}
+
+ssize_t
+Relay::read(int fd, IOBuffer &buf, bool &full, Uring::Channel *channel)
+{
+    ssize_t n;
+    if (pipe[1] >= 0 && buf.empty() && !channel) {
+        n = splice(fd, nullptr, pipe[1], nullptr, capacity - piped,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            piped += n;
+            stats.spliced_bytes += n;
+        }
+        full = piped == capacity;
+    } else {
+        if (buf.empty())
+            buf.reset();
+        char *dst = const_cast<char *>(buf.end());
+        if (!buf.free_size())
+            n = 0;
+        else if (channel)
+            n = channel->recv(dst, buf.free_size());
+        else
+            n = ::recv(fd, dst, buf.free_size(), 0);
+        if (n > 0) {
+            buf.grow(n);
+            stats.copied_bytes += n;
+        }
+        full = !buf.free_size();
+    }
+    if (n == 0 && !full) {
+        debug("tunnel: got FIN");
+        eof = true;
+    }
+    return n;
+}
+
+ssize_t
+Relay::write(int fd, IOBuffer &buf, Uring::Channel *channel)
+{
+    ssize_t n = 0;
+    if (!buf.empty()) {
+        n = channel ? channel->send(buf.data(), buf.size()) :
+            ::send(fd, buf.data(), buf.size(), MSG_NOSIGNAL);
+        if (n > 0)
+            buf.shrink_front(n);
+    } else if (piped) {
+        n = splice(pipe[0], nullptr, fd, nullptr, piped,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            piped -= n;
+    }
+    if (n >= 0 && eof && !shut && drained(buf)) {
+        // half-close: the other direction goes on
+        if (channel)
+            channel->shutdown_write();
+        else
+            shutdown(fd, SHUT_WR);
+        shut = true;
+    }
+    return n;
+}
+
+bool
+Relay::drained(const IOBuffer &buf) const
+{
+    return buf.empty() && !piped;
+}
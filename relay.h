@@ -0,0 +1,52 @@
+#pragma once
+#ifndef __evx_relay_h
+#define __evx_relay_h
+
+#include <sys/types.h>
+#include <cstddef>
+
+#include "util.h"
+#include "uring.h"
+
+class IOBuffer;
+
+/* One direction of raw tunnel (CONNECT or upgraded connection). Data goes
+   from source socket to destination socket through pipe by splice(),
+   without copying into user space; buffer of source side is used when
+   pipe can't be created (and for data which came before tunnel was
+   established). Caller waits for readiness of sockets. Sockets on
+   io_uring (channel is given) always copy through buffer. */
+class Relay :
+    public virtual non_copyable
+{
+    int pipe[2] = {-1, -1};
+    size_t capacity = 0; // of pipe
+    size_t piped = 0; // bytes in pipe
+
+public:
+    struct Stats
+    {
+        size_t spliced_bytes = 0;
+        size_t copied_bytes = 0; // without pipe
+    };
+    static thread_local Stats stats;
+
+    bool eof = false; // source sent FIN
+    bool shut = false; // FIN is passed to destination
+
+    ~Relay();
+
+    // Creates pipe; without it data is copied through buffer
+    void open();
+
+    // Source data goes to pipe or buf; -1 means error (in errno, EAGAIN too)
+    ssize_t read(int fd, IOBuffer &buf, bool &full, Uring::Channel *channel = nullptr);
+    /* Buffered, then piped data goes to destination, which is shut down
+       (SHUT_WR) when everything up to FIN is written; -1 means error */
+    ssize_t write(int fd, IOBuffer &buf, Uring::Channel *channel = nullptr);
+
+    // Nothing to write to destination
+    bool drained(const IOBuffer &buf) const;
+};
+
+#endif // __evx_relay_h
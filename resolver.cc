@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "resolver.h"
+
+/* Addresses and TTL of answer: TTL is minimal TTL of its records
+   (including CNAMEs). Returns 0 on success, otherwise h_errno code. */
+static int
+parse_answer(const unsigned char *answer, int len, HostAddresses &addrs, time_t &ttl)
+{
+    ns_msg msg;
+    if (ns_initparse(answer, len, &msg) < 0)
+        return NO_RECOVERY;
+
+    switch (ns_msg_getflag(msg, ns_f_rcode)) {
+    case ns_r_noerror:
+        break;
+    case ns_r_nxdomain:
+        return HOST_NOT_FOUND;
+    case ns_r_servfail:
+        return TRY_AGAIN;
+    default:
+        return NO_RECOVERY;
+    }
+
+    bool found = false;
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); ++i) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+            return NO_RECOVERY;
+
+        if (ttl == NameCacheOnPool::unknown_ttl || ns_rr_ttl(rr) < ttl)
+            ttl = ns_rr_ttl(rr);
+
+        if (ns_rr_type(rr) == ns_t_a && ns_rr_rdlen(rr) == sizeof(in_addr)) {
+            in_addr a;
+            memcpy(&a, ns_rr_rdata(rr), sizeof(a));
+            found = true;
+            addrs.add(a);
+        } else if (ns_rr_type(rr) == ns_t_aaaa && ns_rr_rdlen(rr) == sizeof(in6_addr)) {
+            in6_addr a;
+            memcpy(&a, ns_rr_rdata(rr), sizeof(a));
+            found = true;
+            addrs.add(a);
+        }
+    }
+    return found ? 0 : NO_DATA;
+}
+
+/* Query DNS directly, because getaddrinfo() doesn't give record TTL.
+   Returns 0 on success, otherwise h_errno code. */
+static int
+query_dns(const char *name, int type, HostAddresses &addrs, time_t &ttl)
+{
+    unsigned char answer[4096];
+    // _res is thread-local in glibc, so res_search() is thread-safe
+    int len = res_search(name, ns_c_in, type, answer, sizeof(answer));
+    if (len < 0)
+        return h_errno;
+    return parse_answer(answer, len, addrs, ttl);
+}
+
+/* Datagram answers the query: same ID and question, QR bit set.
+   Name may come back in other case (RFC 4343). */
+static bool
+answers_query(const unsigned char *answer, ssize_t len, const unsigned char *query, int query_len)
+{
+    if (len < query_len || memcmp(answer, query, 2) || !(answer[2] & 0x80) ||
+        memcmp(answer + 4, query + 4, 2)) // QDCOUNT
+    {
+        return false;
+    }
+    for (int i = NS_HFIXEDSZ; i < query_len; ++i)
+        if (tolower(answer[i]) != tolower(query[i]))
+            return false;
+    return true;
+}
+
+/* A and AAAA questions for the name as is go out together to first
+   nameserver (as getaddrinfo() does), so a miss costs one round trip
+   instead of two. false means both answers are here, and they are final
+   even if negative: truncated answer, timeout, IPv6 nameserver and names
+   for search list are left to query_dns(). */
+static bool
+query_dns_parallel(const char *name, HostAddresses &addrs, time_t &ttl, int &h_err, int &h_err6)
+{
+    if (!(_res.options & RES_INIT) && res_init() < 0)
+        return true;
+    if (_res.nscount < 1 || _res.nsaddr_list[0].sin_family != AF_INET)
+        return true;
+    // res_search() tries search list first for such name
+    if ((_res.options & RES_DNSRCH) && _res.dnsrch[0] &&
+        std::count(name, name + strlen(name), '.') < (int) _res.ndots)
+    {
+        return true;
+    }
+
+    static const int types[2] = { ns_t_a, ns_t_aaaa };
+    unsigned char query[2][NS_PACKETSZ];
+    int query_len[2];
+    for (int i = 0; i < 2; ++i) {
+        query_len[i] = res_mkquery(ns_o_query, name, ns_c_in, types[i], nullptr, 0, nullptr,
+            query[i], sizeof(query[i]));
+        if (query_len[i] < 0)
+            return true;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return true;
+    if (connect(fd, (const sockaddr *) &_res.nsaddr_list[0], sizeof(_res.nsaddr_list[0])) < 0) {
+        close(fd);
+        return true;
+    }
+
+    unsigned char answer[2][4096];
+    int answer_len[2] = { -1, -1 };
+    for (int attempt = 0; attempt < std::max(_res.retry, 1); ++attempt) {
+        for (int i = 0; i < 2; ++i)
+            if (answer_len[i] < 0)
+                send(fd, query[i], query_len[i], 0);
+
+        int timeout_ms = std::max(_res.retrans, 1) * 1000;
+        while (answer_len[0] < 0 || answer_len[1] < 0) {
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, timeout_ms) <= 0)
+                break;
+            unsigned char buf[4096];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < NS_HFIXEDSZ)
+                continue;
+            for (int i = 0; i < 2; ++i) {
+                if (answer_len[i] >= 0 || !answers_query(buf, n, query[i], query_len[i]))
+                    continue;
+                if (buf[2] & 0x02) { // TC: answer needs TCP
+                    close(fd);
+                    return true;
+                }
+                memcpy(answer[i], buf, n);
+                answer_len[i] = n;
+                break;
+            }
+        }
+        if (answer_len[0] >= 0 && answer_len[1] >= 0)
+            break;
+    }
+    close(fd);
+    if (answer_len[0] < 0 || answer_len[1] < 0)
+        return true;
+
+    h_err = parse_answer(answer[0], answer_len[0], addrs, ttl);
+    h_err6 = parse_answer(answer[1], answer_len[1], addrs, ttl);
+    return false;
+}
+
+Resolver::Status
+Resolver::query(const char *name, HostAddresses &addrs, time_t &ttl)
+{
+    addrs.count = 0;
+    ttl = NameCacheOnPool::unknown_ttl;
+    int h_err, h_err6;
+    if (!query_dns_parallel(name, addrs, ttl, h_err, h_err6)) {
+        if (h_err == 0 || h_err6 == 0)
+            return RESOLVED;
+        // nameserver has answered, NXDOMAIN and no records are final
+        cdebug("DNS query for ", name, " failed: ", hstrerror(h_err));
+        if (h_err == TRY_AGAIN || h_err6 == TRY_AGAIN)
+            return TEMPORARY;
+        if ((h_err == HOST_NOT_FOUND || h_err == NO_DATA) && (h_err6 == HOST_NOT_FOUND || h_err6 == NO_DATA))
+            return NOT_FOUND;
+        return FAILED;
+    }
+
+    // search list, TCP, other nameservers
+    addrs.count = 0;
+    ttl = NameCacheOnPool::unknown_ttl;
+    h_err = query_dns(name, ns_t_a, addrs, ttl);
+    h_err6 = query_dns(name, ns_t_aaaa, addrs, ttl);
+    if (h_err == 0 || h_err6 == 0)
+        return RESOLVED;
+
+    cdebug("DNS query for ", name, " failed: ", hstrerror(h_err));
+
+    // Name may be known to system resolver (hosts file, etc.), but its TTL is unknown
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family = AF_UNSPEC;
+
+    int err = getaddrinfo(name, NULL, &hints, &res);
+    if (err != 0) {
+        cdebug("getaddrinfo for ", name, ": ", gai_strerror(err));
+        switch (err) {
+        case EAI_NONAME:
+        case EAI_NODATA:
+            return NOT_FOUND;
+        case EAI_AGAIN:
+        case EAI_FAIL:
+            return TEMPORARY;
+        default:
+            return FAILED;
+        }
+    }
+
+    for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET)
+            addrs.add(((sockaddr_in *) ai->ai_addr)->sin_addr);
+        else if (ai->ai_family == AF_INET6)
+            addrs.add(((sockaddr_in6 *) ai->ai_addr)->sin6_addr);
+    }
+    ttl = NameCacheOnPool::unknown_ttl;
+    freeaddrinfo(res);
+    return addrs.empty() ? NOT_FOUND : RESOLVED;
+}
+
+Resolver::Resolver(struct ev_loop *event_loop_, ThreadPool *workers_, NameCacheOnPool *name_cache_) :
+    event_loop {event_loop_},
+    workers {workers_},
+    name_cache {name_cache_}
+{
+    ev_async_init(&refresh_watcher, refresh_callback);
+    refresh_watcher.data = this;
+}
+
+Resolver::~Resolver()
+{
+    for (Refresh *r: refreshed)
+        delete r;
+}
+
+void
+Resolver::start()
+{
+    if (!name_cache)
+        return;
+
+    name_cache->init_thread();
+    if (workers)
+        ev_async_start(event_loop, &refresh_watcher);
+}
+
+bool
+Resolver::resolve(const char *name_cstr, buffer::istring &name, HostAddresses &addrs)
+{
+    in_addr a4;
+    in6_addr a6;
+    addrs.count = 0;
+    if (inet_pton(AF_INET, name_cstr, &a4) == 1) {
+        addrs.add(a4);
+        return false;
+    }
+    if (inet_pton(AF_INET6, name_cstr, &a6) == 1) {
+        addrs.add(a6);
+        return false;
+    }
+
+    if (name_cache) {
+        switch (name_cache->get(addrs, name)) {
+        case NameCacheOnPool::HIT:
+            return false;
+        case NameCacheOnPool::STALE_HIT:
+            refresh(name);
+            return false;
+        case NameCacheOnPool::NEGATIVE_HIT:
+            debug(name, " is negatively cached");
+            return true;
+        case NameCacheOnPool::MISS:
+        default:
+            break;
+        }
+    }
+
+    time_t ttl;
+    HostAddresses resolved;
+    switch (query(name_cstr, resolved, ttl)) {
+    case RESOLVED:
+        if (name_cache)
+            name_cache->insert(resolved, name, ttl);
+        resolved.rotated(addrs);
+        return false;
+    case NOT_FOUND:
+    case TEMPORARY:
+        if (name_cache)
+            name_cache->insert_negative(name);
+    case FAILED:
+    default:
+        error("failed to resolve ", name);
+        return true;
+    }
+}
+
+void
+Resolver::refresh(buffer::istring &name)
+{
+    assert(workers);
+    Refresh *r = new Refresh;
+    name.copy(r->name, DomainName::max_name);
+    r->name[name.size()] = 0;
+    r->name_size = name.size();
+    RefreshTask task(this, r);
+    workers->add_task(task);
+    refreshes++;
+    debug("refreshing ", name);
+}
+
+void
+Resolver::refresh_done(Refresh *r)
+{
+    {
+        std::lock_guard<std::mutex> lock(refresh_mx);
+        refreshed.push_back(r);
+    }
+    ev_async_send(event_loop, &refresh_watcher);
+}
+
+void
+Resolver::apply_refreshed()
+{
+    std::vector<Refresh *> done;
+    {
+        std::lock_guard<std::mutex> lock(refresh_mx);
+        done.swap(refreshed);
+    }
+
+    for (Refresh *r: done) {
+        buffer::istring name(r->name, r->name_size);
+        switch (r->status) {
+        case RESOLVED:
+            name_cache->insert(r->addrs, name, r->ttl);
+            break;
+        case NOT_FOUND:
+            // definite answer: name is gone
+            name_cache->insert_negative(name);
+            break;
+        case TEMPORARY:
+        case FAILED:
+        default:
+            // keep serving stale
+            refresh_failures++;
+            name_cache->refresh_failed(name);
+            break;
+        }
+        delete r;
+    }
+}
@@ -0,0 +1,102 @@
+#pragma once
+#ifndef __evx_resolver_h
+#define __evx_resolver_h
+
+#include <ev.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <netinet/in.h>
+
+#include "buffer_string.h"
+#include "threads.h"
+#include "cache.h"
+#include "util.h"
+
+/* Name resolution for one accept thread: name cache lookup and synchronous
+   resolution on cache miss. Expired items may be served stale (see
+   --cache-stale-lifetime), then they are refreshed on worker thread and
+   the result is applied to the cache back in event loop thread
+   (cache is not thread-safe). */
+class Resolver :
+    public virtual non_copyable
+{
+public:
+    enum Status
+    {
+        RESOLVED = 0,
+        NOT_FOUND, // NXDOMAIN, no address
+        TEMPORARY, // SERVFAIL, timeout
+        FAILED
+    };
+
+    // Blocking resolution, may be called from any thread
+    static Status query(const char *name, HostAddresses &addrs, time_t &ttl);
+
+private:
+    struct Refresh
+    {
+        char name[DomainName::max_name + 1];
+        size_t name_size;
+        HostAddresses addrs;
+        time_t ttl;
+        Status status;
+    };
+
+    class RefreshTask : public Task
+    {
+        Resolver *resolver;
+        Refresh *refresh;
+
+    public:
+        RefreshTask(Resolver *_resolver, Refresh *_refresh) :
+            resolver {_resolver},
+            refresh {_refresh}
+        {}
+
+        void execute() override
+        {
+            refresh->status = query(refresh->name, refresh->addrs, refresh->ttl);
+            resolver->refresh_done(refresh);
+        }
+    };
+
+    struct ev_loop *event_loop;
+    ThreadPool *workers;
+    std::unique_ptr<NameCacheOnPool> name_cache;
+
+    ev_async refresh_watcher;
+    std::mutex refresh_mx;
+    std::vector<Refresh *> refreshed; // guarded by refresh_mx
+
+    void refresh(buffer::istring &name);
+    void refresh_done(Refresh *r); // called from worker thread
+    void apply_refreshed();
+
+    static void
+    refresh_callback(EV_P_ ev_async *w, int revents)
+    {
+        ((Resolver *)w->data)->apply_refreshed();
+    }
+
+public:
+    size_t refreshes = 0;
+    size_t refresh_failures = 0;
+
+    // workers == nullptr turns off background refresh
+    Resolver(struct ev_loop *event_loop_, ThreadPool *workers_, NameCacheOnPool *name_cache_);
+    ~Resolver();
+
+    void start();
+
+    NameCacheOnPool *
+    cache() const
+    {
+        return name_cache.get();
+    }
+
+    // Addresses are rotated and ordered for connecting; true means error (as everywhere)
+    bool resolve(const char *name_cstr, buffer::istring &name, HostAddresses &addrs);
+};
+
+#endif // __evx_resolver_h
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+
+#include "route.h"
+
+Routes routes;
+
+static inline char
+lower(char c)
+{
+    return tolower((unsigned char) c);
+}
+
+// a is lower case
+static int
+compare_lower(const std::string &a, const char *s, size_t n)
+{
+    size_t common = std::min(a.size(), n);
+    for (size_t i = 0; i < common; ++i) {
+        char b = lower(s[i]);
+        if (a[i] != b)
+            return (unsigned char) a[i] < (unsigned char) b ? -1 : 1;
+    }
+    return a.size() < n ? -1 : a.size() > n ? 1 : 0;
+}
+
+void
+RouteTable::Prefix::insert(const char *s, size_t n, const Cluster *c)
+{
+    if (!n) {
+        cluster = c; // later route wins
+        return;
+    }
+    auto it = std::lower_bound(children.begin(), children.end(), *s,
+        [] (const Prefix &p, char ch) { return p.edge[0] < ch; });
+    if (it == children.end() || it->edge[0] != *s) {
+        Prefix p;
+        p.edge.assign(s, n);
+        p.cluster = c;
+        children.insert(it, std::move(p));
+        return;
+    }
+    Prefix &child = *it;
+    size_t common = 1;
+    while (common < n && common < child.edge.size() && child.edge[common] == s[common])
+        ++common;
+    if (common < child.edge.size()) {
+        // split edge
+        Prefix tail;
+        tail.edge = child.edge.substr(common);
+        tail.cluster = child.cluster;
+        tail.children = std::move(child.children);
+        child.edge.resize(common);
+        child.cluster = nullptr;
+        child.children.clear();
+        child.children.push_back(std::move(tail));
+    }
+    child.insert(s + common, n - common, c);
+}
+
+const Cluster *
+RouteTable::Prefix::find(const char *s, size_t n) const
+{
+    const Cluster *longest = cluster;
+    const Prefix *node = this;
+    while (n) {
+        auto it = std::lower_bound(node->children.begin(), node->children.end(), *s,
+            [] (const Prefix &p, char ch) { return p.edge[0] < ch; });
+        if (it == node->children.end() || it->edge.size() > n
+            || memcmp(it->edge.data(), s, it->edge.size()))
+        {
+            break;
+        }
+        s += it->edge.size();
+        n -= it->edge.size();
+        node = &*it;
+        if (node->cluster)
+            longest = node->cluster;
+    }
+    return longest;
+}
+
+// FNV-1a of lower case, seed selects hash function
+uint64_t
+RouteTable::hash(const char *s, size_t n, uint64_t seed)
+{
+    uint64_t h = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char) lower(s[i]);
+        h *= 1099511628211ULL;
+    }
+    // low bits are used by modulo
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+bool
+RouteTable::add(const std::string &host, const std::string &prefix, const Cluster *cluster)
+{
+    assert(!compiled);
+    if (host.empty() || prefix.empty() || prefix[0] != '/')
+        return true;
+
+    bool wildcard = host.compare(0, 2, "*.") == 0;
+    std::string name(host, wildcard ? 2 : 0);
+    if (name.empty() || name.find('*') != std::string::npos)
+        return true;
+    std::transform(name.begin(), name.end(), name.begin(), lower);
+
+    std::vector<Host> &list = wildcard ? wildcards : hosts;
+    auto i = added.emplace(wildcard ? "*." + name : name, list.size());
+    if (i.second) {
+        list.emplace_back();
+        list.back().name = name;
+    }
+    list[i.first->second].prefixes.insert(prefix.data(), prefix.size(), cluster);
+    return false;
+}
+
+void
+RouteTable::compile()
+{
+    compiled = true;
+    added.clear();
+
+    /* Hash and displace: keys are put into buckets by first hash, then
+       (starting with largest bucket) displacement is searched which puts
+       all keys of bucket into free slots. */
+    size_t n = hosts.size();
+    if (n) {
+        size_t bucket_count = (n + 3) / 4;
+        std::vector<std::vector<uint32_t>> buckets(bucket_count);
+        for (uint32_t i = 0; i < n; ++i)
+            buckets[hash(hosts[i].name.data(), hosts[i].name.size(), 0) % bucket_count].push_back(i);
+        std::vector<uint32_t> order(bucket_count);
+        for (uint32_t b = 0; b < bucket_count; ++b)
+            order[b] = b;
+        std::sort(order.begin(), order.end(), [&buckets] (uint32_t a, uint32_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        slots.assign(n + n / 4 + 1, -1);
+        displacements.assign(bucket_count, 0);
+        std::vector<size_t> taken;
+        for (uint32_t b: order) {
+            if (buckets[b].empty())
+                break;
+            for (uint32_t d = 1;; ++d) {
+                taken.clear();
+                for (uint32_t i: buckets[b]) {
+                    size_t slot = hash(hosts[i].name.data(), hosts[i].name.size(), d) % slots.size();
+                    if (slots[slot] >= 0 || std::find(taken.begin(), taken.end(), slot) != taken.end())
+                        break;
+                    taken.push_back(slot);
+                }
+                if (taken.size() < buckets[b].size())
+                    continue;
+                for (size_t k = 0; k < taken.size(); ++k)
+                    slots[taken[k]] = buckets[b][k];
+                displacements[b] = d;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < wildcards.size(); ++i) {
+        const std::string &name = wildcards[i].name;
+        Label *node = &root;
+        size_t end = name.size();
+        while (true) {
+            size_t dot = name.rfind('.', end - 1);
+            size_t begin = dot == std::string::npos ? 0 : dot + 1;
+            std::string label(name, begin, end - begin);
+            auto it = std::lower_bound(node->children.begin(), node->children.end(), label,
+                [] (const Label &l, const std::string &s) { return l.label < s; });
+            if (it == node->children.end() || it->label != label) {
+                it = node->children.insert(it, Label());
+                it->label = label;
+            }
+            node = &*it;
+            if (!begin)
+                break;
+            end = dot;
+        }
+        node->host = i;
+    }
+}
+
+const RouteTable::Host *
+RouteTable::find_exact(const char *s, size_t n) const
+{
+    if (hosts.empty())
+        return nullptr;
+    uint32_t d = displacements[hash(s, n, 0) % displacements.size()];
+    int32_t i = slots[hash(s, n, d) % slots.size()];
+    if (i < 0 || compare_lower(hosts[i].name, s, n))
+        return nullptr;
+    return &hosts[i];
+}
+
+const RouteTable::Host *
+RouteTable::find_wildcard(const char *s, size_t n) const
+{
+    const Label *node = &root;
+    const Host *deepest = nullptr;
+    size_t end = n;
+    while (end) {
+        const char *dot = (const char *) memrchr(s, '.', end);
+        size_t begin = dot ? dot - s + 1 : 0;
+        auto it = std::lower_bound(node->children.begin(), node->children.end(), 0,
+            [s, begin, end] (const Label &l, int) { return compare_lower(l.label, s + begin, end - begin) < 0; });
+        if (it == node->children.end() || compare_lower(it->label, s + begin, end - begin))
+            break;
+        node = &*it;
+        // *.domain doesn't match domain itself
+        if (!begin)
+            break;
+        if (node->host >= 0)
+            deepest = &wildcards[node->host];
+        end = begin - 1;
+    }
+    return deepest;
+}
+
+const Cluster *
+RouteTable::find(const buffer::istring &host, const buffer::string &uri) const
+{
+    const char *path = uri.data();
+    size_t path_size = uri.size();
+    if (path_size && *path != '/') {
+        // absolute form: scheme://authority/path
+        const char *end = path + path_size;
+        const char *p = std::search(path, end, "://", "://" + 3);
+        p = p == end ? path : p + 3;
+        p = std::find(p, end, '/');
+        path_size = end - p;
+        path = p;
+    }
+    if (!path_size) {
+        path = "/";
+        path_size = 1;
+    }
+
+    if (const Host *h = find_exact(host.data(), host.size()))
+        if (const Cluster *c = h->prefixes.find(path, path_size))
+            return c;
+    if (const Host *h = find_wildcard(host.data(), host.size()))
+        return h->prefixes.find(path, path_size);
+    return nullptr;
+}
+
+RouteTable *
+RouteTable::load(const Clusters &clusters, const char *path, std::string &err)
+{
+    std::unique_ptr<RouteTable> table(new RouteTable);
+    for (size_t i = 0; i < clusters.size(); ++i)
+        table->add(clusters[i].host, "/", &clusters[i]);
+
+    if (path) {
+        std::ifstream file(path);
+        if (!file) {
+            err = std::string("can't open ") + path + ": " + strerror(errno);
+            return nullptr;
+        }
+        std::string line;
+        for (unsigned n = 1; std::getline(file, line); ++n) {
+            line.resize(std::min(line.find('#'), line.size()));
+            std::istringstream words(line);
+            std::string route, target, rest;
+            if (!(words >> route))
+                continue;
+            std::ostringstream where;
+            where << path << ":" << n << ": ";
+            if (!(words >> target) || words >> rest) {
+                err = where.str() + "expected HOST[/PREFIX] CLUSTER_HOST";
+                return nullptr;
+            }
+            const Cluster *c = clusters.find(buffer::istring(target.data(), target.size()));
+            if (!c) {
+                err = where.str() + "no --upstream for " + target;
+                return nullptr;
+            }
+            size_t slash = std::min(route.find('/'), route.size());
+            std::string prefix = slash < route.size() ? route.substr(slash) : "/";
+            if (table->add(route.substr(0, slash), prefix, c)) {
+                err = where.str() + "bad route " + route;
+                return nullptr;
+            }
+        }
+    }
+    table->compile();
+    return table.release();
+}
+
+void
+Routes::publish(const RouteTable *t)
+{
+    std::shared_ptr<const RouteTable> old(t);
+    std::lock_guard<std::mutex> lock(mutex);
+    table.swap(old);
+    generation.fetch_add(1, std::memory_order_release);
+}
+
+const RouteTable *
+Routes::current()
+{
+    static thread_local unsigned seen = 0;
+    static thread_local std::shared_ptr<const RouteTable> local;
+    if (generation.load(std::memory_order_acquire) != seen) {
+        std::lock_guard<std::mutex> lock(mutex);
+        local = table;
+        seen = generation.load(std::memory_order_relaxed);
+    }
+    return local.get();
+}
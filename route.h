@@ -0,0 +1,98 @@
+#pragma once
+#ifndef __evx_route_h
+#define __evx_route_h
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer_string.h"
+#include "cluster.h"
+#include "util.h"
+
+/* Immutable index of routes from Host and URI prefix to --upstream
+   cluster. Exact hosts are found by perfect hash (hash and displace),
+   wildcard hosts (*.domain, matches subdomains only) by trie of reversed
+   labels, the longest URI prefix of found host by radix tree. Exact host
+   wins over wildcard, route without prefix is prefix "/". */
+class RouteTable :
+    public virtual non_copyable
+{
+    // Radix tree node, edge is the part of prefix from parent
+    struct Prefix
+    {
+        std::string edge;
+        const Cluster *cluster = nullptr;
+        std::vector<Prefix> children; // sorted by first char of edge
+
+        void insert(const char *s, size_t n, const Cluster *c);
+        const Cluster *find(const char *s, size_t n) const;
+    };
+
+    struct Host
+    {
+        std::string name; // lower case
+        Prefix prefixes;
+    };
+
+    // exact hosts
+    std::vector<Host> hosts;
+    std::vector<uint32_t> displacements; // by bucket
+    std::vector<int32_t> slots; // hosts index, -1 is empty
+
+    // wildcard hosts, root is empty label
+    struct Label
+    {
+        std::string label;
+        int host = -1; // wildcards index
+        std::vector<Label> children; // sorted by label
+    };
+    std::vector<Host> wildcards;
+    Label root;
+
+    // host (wildcard with "*.") to hosts/wildcards index until compile()
+    std::unordered_map<std::string, size_t> added;
+    bool compiled = false;
+
+    static uint64_t hash(const char *s, size_t n, uint64_t seed);
+    const Host *find_exact(const char *s, size_t n) const;
+    const Host *find_wildcard(const char *s, size_t n) const;
+
+public:
+    // host is exact or *.domain, prefix starts with '/'; true means error
+    bool add(const std::string &host, const std::string &prefix, const Cluster *cluster);
+    // Builds lookup structures, no routes can be added after it
+    void compile();
+
+    // uri may be in absolute form; nullptr means no route
+    const Cluster *find(const buffer::istring &host, const buffer::string &uri) const;
+
+    /* Routes of every cluster host (HOST of --upstream) and of file lines
+       "HOST[/PREFIX] CLUSTER_HOST" (# starts comment); nullptr means error
+       (message is in err) */
+    static RouteTable *load(const Clusters &clusters, const char *path, std::string &err);
+};
+
+/* Current RouteTable, replaced on reload. Request path takes no lock:
+   each thread keeps reference to the table it uses and refreshes it
+   only when generation has changed. */
+class Routes
+{
+    std::mutex mutex;
+    std::shared_ptr<const RouteTable> table;
+    std::atomic<unsigned> generation {0};
+
+public:
+    void publish(const RouteTable *t);
+    // Valid until next current() call of the same thread
+    const RouteTable *current();
+};
+
+extern Routes routes;
+
+#endif // __evx_route_h
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <unistd.h>
+#include <string>
+
+#include "spool.h"
+
+bool
+Spool::open_file()
+{
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0)
+        return false;
+#endif
+    // filesystem doesn't support O_TMPFILE
+    std::string path(dir);
+    path += "/evoxy-spool-XXXXXX";
+    fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd < 0)
+        return true;
+    unlink(path.c_str());
+    return false;
+}
+
+bool
+Spool::write(const buffer::string &data)
+{
+    const char *src = data.data();
+    size_t src_size = data.size();
+    size_t start = write_pos; // nothing is written on error
+
+    if (write_pos < memory_limit) {
+        if (!memory) {
+            memory.reset(new (std::nothrow) char[memory_limit]);
+            if (!memory) {
+                errno = ENOMEM;
+                return true;
+            }
+        }
+        size_t n = std::min(src_size, memory_limit - write_pos);
+        memcpy(&memory[write_pos], src, n);
+        write_pos += n;
+        src += n;
+        src_size -= n;
+    }
+
+    if (src_size && fd < 0 && open_file()) {
+        write_pos = start;
+        return true;
+    }
+
+    while (src_size) {
+        ssize_t n = pwrite(fd, src, src_size, write_pos - memory_limit);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            write_pos = start;
+            return true;
+        }
+        write_pos += n;
+        src += n;
+        src_size -= n;
+    }
+    return false;
+}
+
+ssize_t
+Spool::read(char *dst, size_t dst_size)
+{
+    size_t n = std::min(dst_size, size());
+    if (!n)
+        return 0;
+    if (read_pos < memory_limit) {
+        n = std::min(n, memory_limit - read_pos);
+        memcpy(dst, &memory[read_pos], n);
+    } else {
+        ssize_t r;
+        do
+            r = pread(fd, dst, n, read_pos - memory_limit);
+        while (r < 0 && errno == EINTR);
+        if (r <= 0)
+            return -1;
+        n = r;
+    }
+    read_pos += n;
+    if (read_pos == write_pos)
+        read_pos = write_pos = 0;
+    return n;
+}
+
+void
+Spool::clear()
+{
+    memory.reset();
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    read_pos = write_pos = 0;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#ifndef __evx_spool_h
+#define __evx_spool_h
+
+#include <memory>
+#include <sys/types.h>
+
+#include "buffer_string.h"
+#include "util.h"
+
+/* FIFO of data which peer can't take right now. First memory_limit bytes
+   are kept in memory (allocated on first write), the rest spills into
+   unlinked temporary file. When everything written is read back, spool
+   starts from memory again. */
+class Spool :
+    public virtual non_copyable
+{
+    std::unique_ptr<char[]> memory;
+    size_t memory_limit;
+    size_t max_size; // 0 means unlimited
+    const char *dir; // temporary file location
+    int fd = -1;
+    size_t read_pos = 0;
+    size_t write_pos = 0;
+
+    bool open_file();
+
+public:
+    Spool(size_t _memory_limit, size_t _max_size, const char *_dir) :
+        memory_limit {_memory_limit},
+        max_size {_max_size},
+        dir {_dir}
+    {}
+
+    // Must be empty; releases memory and temporary file
+    void limit(size_t _memory_limit, size_t _max_size)
+    {
+        clear();
+        memory_limit = _memory_limit;
+        max_size = _max_size;
+    }
+
+    ~Spool()
+    {
+        clear();
+    }
+
+    size_t size() const
+    {
+        return write_pos - read_pos;
+    }
+
+    bool empty() const
+    {
+        return read_pos == write_pos;
+    }
+
+    bool full() const
+    {
+        return max_size && size() >= max_size;
+    }
+
+    // Data went beyond memory_limit since last clear()
+    bool spilled() const
+    {
+        return fd >= 0;
+    }
+
+    // true means error (as everywhere)
+    bool write(const buffer::string &data);
+    // Returns bytes read (0 if empty), -1 on error
+    ssize_t read(char *dst, size_t dst_size);
+    // Releases memory and temporary file
+    void clear();
+};
+
+#endif // __evx_spool_h
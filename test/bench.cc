@@ -0,0 +1,235 @@
+/* Load for comparing event backends of evoxy (--event-backend):
+     bench origin PORT SIZE
+       keep-alive server which answers SIZE bytes to every request;
+     bench load PROXY_PORT ORIGIN_PORT CONNECTIONS SECONDS [close]
+       clients which request origin through proxy on localhost, each waits
+       for response before next request (close: new connection for each).
+   Prints requests per second and latency percentiles. */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+typedef chrono::steady_clock Clock;
+
+static int
+connect_to(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) && errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+struct Peer
+{
+    int fd = -1;
+    string in;
+    string out;
+    size_t out_pos = 0;
+    Clock::time_point started;
+};
+
+static void
+watch(int epfd, int op, Peer &p, bool out)
+{
+    struct epoll_event e {};
+    e.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    e.data.ptr = &p;
+    epoll_ctl(epfd, op, p.fd, &e);
+}
+
+// false: peer is gone
+static bool
+flush(int epfd, Peer &p)
+{
+    while (p.out_pos < p.out.size()) {
+        ssize_t n = send(p.fd, p.out.data() + p.out_pos, p.out.size() - p.out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN)
+                return false;
+            watch(epfd, EPOLL_CTL_MOD, p, true);
+            return true;
+        }
+        p.out_pos += n;
+    }
+    p.out.clear();
+    p.out_pos = 0;
+    watch(epfd, EPOLL_CTL_MOD, p, false);
+    return true;
+}
+
+static void
+run_origin(uint16_t port, size_t size)
+{
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(lfd, (sockaddr *)&addr, sizeof(addr)) || listen(lfd, SOMAXCONN)) {
+        perror("listen");
+        exit(1);
+    }
+    string response = "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(size) + "\r\n\r\n" + string(size, 'x');
+    int epfd = epoll_create1(0);
+    Peer listener;
+    listener.fd = lfd;
+    watch(epfd, EPOLL_CTL_ADD, listener, false);
+    struct epoll_event events[64];
+    char buf[16384];
+    for (;;) {
+        int n = epoll_wait(epfd, events, 64, -1);
+        for (int i = 0; i < n; ++i) {
+            Peer &p = *(Peer *)events[i].data.ptr;
+            if (&p == &listener) {
+                int fd;
+                while ((fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+                    Peer *c = new Peer;
+                    c->fd = fd;
+                    watch(epfd, EPOLL_CTL_ADD, *c, false);
+                }
+                continue;
+            }
+            bool alive = true;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                ssize_t r = recv(p.fd, buf, sizeof(buf), 0);
+                if (r > 0)
+                    p.in.append(buf, r);
+                else if (r == 0 || errno != EAGAIN)
+                    alive = false;
+                size_t end;
+                while ((end = p.in.find("\r\n\r\n")) != string::npos) {
+                    p.in.erase(0, end + 4);
+                    p.out += response;
+                }
+            }
+            if (alive && !p.out.empty())
+                alive = flush(epfd, p);
+            if (!alive) {
+                close(p.fd);
+                delete &p;
+            }
+        }
+    }
+}
+
+static void
+run_load(uint16_t proxy_port, uint16_t origin_port, int connections, int seconds, bool reconnect)
+{
+    string request = "GET http://127.0.0.1:" + to_string(origin_port) + "/ HTTP/1.1\r\n"
+        "Host: 127.0.0.1:" + to_string(origin_port) + "\r\n" +
+        (reconnect ? "Connection: close\r\n" : "") + "\r\n";
+    int epfd = epoll_create1(0);
+    vector<Peer> peers(connections);
+    vector<double> latencies;
+    size_t errors = 0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + chrono::seconds(seconds);
+    auto send_request = [&] (Peer &p) {
+        if (p.fd < 0) {
+            p.fd = connect_to(proxy_port);
+            watch(epfd, EPOLL_CTL_ADD, p, true);
+        }
+        p.in.clear();
+        p.out = request;
+        p.started = Clock::now();
+        if (!flush(epfd, p))
+            errors++;
+    };
+    auto restart = [&] (Peer &p) {
+        close(p.fd);
+        p.fd = -1;
+        send_request(p);
+    };
+    for (Peer &p: peers)
+        send_request(p);
+    struct epoll_event events[256];
+    char buf[65536];
+    while (Clock::now() < deadline) {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; ++i) {
+            Peer &p = *(Peer *)events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && !flush(epfd, p)) {
+                errors++;
+                restart(p);
+                continue;
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                continue;
+            ssize_t r = recv(p.fd, buf, sizeof(buf), 0);
+            if (r < 0 && errno == EAGAIN)
+                continue;
+            if (r <= 0) {
+                errors++;
+                restart(p);
+                continue;
+            }
+            p.in.append(buf, r);
+            size_t head = p.in.find("\r\n\r\n");
+            if (head == string::npos)
+                continue;
+            size_t length_pos = p.in.find("Content-Length: ");
+            if (length_pos == string::npos || length_pos > head) {
+                errors++;
+                restart(p);
+                continue;
+            }
+            size_t length = strtoul(p.in.c_str() + length_pos + 16, nullptr, 10);
+            if (p.in.size() < head + 4 + length)
+                continue;
+            if (p.in.compare(0, 12, "HTTP/1.1 200"))
+                errors++;
+            latencies.push_back(chrono::duration<double, micro>(Clock::now() - p.started).count());
+            if (reconnect)
+                restart(p);
+            else
+                send_request(p);
+        }
+    }
+    double elapsed = chrono::duration<double>(Clock::now() - start).count();
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&] (double q) {
+        return latencies.empty() ? 0. : latencies[min(latencies.size() - 1, size_t(q * latencies.size()))];
+    };
+    printf("%zu requests, %.0f req/s, latency us: p50 %.0f, p99 %.0f, max %.0f; %zu errors\n",
+        latencies.size(), latencies.size() / elapsed,
+        percentile(0.5), percentile(0.99), percentile(1.), errors);
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc == 4 && !strcmp(argv[1], "origin")) {
+        run_origin(atoi(argv[2]), atol(argv[3]));
+        return 0;
+    }
+    if ((argc == 6 || argc == 7) && !strcmp(argv[1], "load")) {
+        run_load(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]), argc == 7);
+        return 0;
+    }
+    fprintf(stderr, "usage: %s origin PORT SIZE | load PROXY_PORT ORIGIN_PORT CONNECTIONS SECONDS [close]\n", argv[0]);
+    return 2;
+}
@@ -1,9 +1,24 @@
 #include <pool.h>
 #include <cache.h>
+#include <timer.h>
+#include <spool.h>
+#include <cluster.h>
+#include <route.h>
+#include <hpack.h>
+#include <upstream.h>
+#include <http.h>
+#include <gzip.h>
+#include <connection.h>
+#include <link.h>
+#include <relay.h>
 
 #include <iostream>
 #include <buffer_string.h>
 #include <sys/unistd.h>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <string>
 
 using namespace std;
 
@@ -14,6 +29,7 @@ class Test : public OnPool<Test>
 INIT_POOL(Test);
 
 int check_invocation = 0;
+const in_addr loopback {htonl(INADDR_LOOPBACK)};
 
 template <class Obj>
 void check(int pool_size)
@@ -86,6 +102,13 @@ void check(int pool_size)
             << "; expected: " << pool_size << "\n";
         exit(check);        
     }
+    if (++check, pool->used() != pool_size || pool->capacity() != pool_size) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": used() " << pool->used()
+            << ", capacity() " << pool->capacity()
+            << "; expected: " << pool_size << "\n";
+        exit(check);
+    }
 }
 
 struct Test2
@@ -135,16 +158,17 @@ void check2(int pool_size, int timeout)
         exit(check + 10);
     }
 
-    in_addr host_ip;
+    HostAddresses addrs;
+    addrs.add(loopback);
 
     int i = -2;
     char name[33];
     try {
-        cache.insert(host_ip, "ya.ru");
-        cache.insert(host_ip, "mail.ru");
+        cache.insert(addrs, "ya.ru");
+        cache.insert(addrs, "mail.ru");
         for (i = 0; i <= pool_size; ++i) {
             snprintf(name, 33, "traktor%d.es", i);
-            cache.insert(host_ip, name);
+            cache.insert(addrs, name);
         }
     } catch (std::bad_alloc) {
         if (++check) {
@@ -172,7 +196,7 @@ void check2(int pool_size, int timeout)
         exit(check + 10);
     }
 
-    bool res = cache.get(host_ip, "ya.ru");
+    bool res = cache.get(addrs, "ya.ru");
     if (++check, res != false) {
         std::cerr << "Failed check " << check_invocation <<
             "." << check << ": res = " << res
@@ -180,7 +204,7 @@ void check2(int pool_size, int timeout)
         exit(check);
     }
 
-    res = cache.get(host_ip, "traktor4.es");
+    res = cache.get(addrs, "traktor4.es");
     if (++check, res != true) {
         std::cerr << "Failed check " << check_invocation <<
             "." << check << ": res = " << res
@@ -189,7 +213,7 @@ void check2(int pool_size, int timeout)
     }
 
     sleep(timeout + 1);
-    res = cache.get(host_ip, "traktor4.es");
+    res = cache.get(addrs, "traktor4.es");
     if (++check, res != false) {
         std::cerr << "Failed check " << check_invocation <<
             "." << check << ": res = " << res
@@ -211,9 +235,1347 @@ void check2(int pool_size, int timeout)
     }
 }
 
+void check3(int pool_size, int min_ttl, int max_ttl, int negative_lifetime)
+{
+    ++check_invocation;
+    int check = 0;
+    typedef NameCache<PoolAllocator<> > Cache;
+    Pool<MapNode> map_pool(pool_size);
+    Pool<ListNode> list_pool(pool_size);
+    PoolAllocator<MapNode>::init_thread(map_pool);
+    PoolAllocator<ListNode>::init_thread(list_pool);
+    Cache::init_static(pool_size, 1000, min_ttl, max_ttl, negative_lifetime);
+    Cache cache;
+
+    HostAddresses addrs;
+    addrs.add(loopback);
+
+    cache.insert(addrs, "short.ttl", 0); // clamped up to min_ttl
+    cache.insert(addrs, "long.ttl", 100000); // clamped down to max_ttl
+    cache.insert(addrs, "unknown.ttl"); // cache lifetime
+    cache.insert_negative("nxdomain.ttl");
+
+    Cache::Result res = cache.get(addrs, "short.ttl");
+    if (++check, res != Cache::HIT) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::HIT << "\n";
+        exit(check);
+    }
+
+    res = cache.get(addrs, "nxdomain.ttl");
+    if (++check, res != Cache::NEGATIVE_HIT) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::NEGATIVE_HIT << "\n";
+        exit(check);
+    }
+
+    // min_ttl must be greater than negative_lifetime + 1
+    sleep(negative_lifetime + 1);
+    res = cache.get(addrs, "short.ttl");
+    if (++check, res != Cache::HIT) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::HIT << "\n";
+        exit(check);
+    }
+
+    res = cache.get(addrs, "nxdomain.ttl");
+    if (++check, res != Cache::MISS) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::MISS << "\n";
+        exit(check);
+    }
+
+    sleep(max_ttl - negative_lifetime);
+    res = cache.get(addrs, "short.ttl");
+    if (++check, res != Cache::MISS) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::MISS << "\n";
+        exit(check);
+    }
+
+    res = cache.get(addrs, "long.ttl");
+    if (++check, res != Cache::MISS) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::MISS << "\n";
+        exit(check);
+    }
+
+    res = cache.get(addrs, "unknown.ttl");
+    if (++check, res != Cache::HIT) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::HIT << "\n";
+        exit(check);
+    }
+
+    if (++check, cache.stats.hits != 3 || cache.stats.negative_hits != 1 || cache.stats.misses != 3) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": stats " << cache.stats.hits << "/"
+            << cache.stats.negative_hits << "/" << cache.stats.misses
+            << "; expected: 3/1/3\n";
+        exit(check);
+    }
+}
+
+void check4(int pool_size, int lifetime, int stale_lifetime)
+{
+    ++check_invocation;
+    int check = 0;
+    typedef NameCache<PoolAllocator<> > Cache;
+    Pool<MapNode> map_pool(pool_size);
+    Pool<ListNode> list_pool(pool_size);
+    PoolAllocator<MapNode>::init_thread(map_pool);
+    PoolAllocator<ListNode>::init_thread(list_pool);
+    Cache::init_static(pool_size, lifetime, 0, 86400, 0, stale_lifetime);
+    Cache cache;
+
+    HostAddresses addrs;
+    addrs.add(loopback);
+    buffer::istring name("stale.ttl");
+    cache.insert(addrs, name);
+
+    Cache::Result expected[] = {
+        Cache::STALE_HIT, // caller must refresh
+        Cache::HIT, // refresh is in progress
+        Cache::STALE_HIT // after refresh_failed()
+    };
+
+    sleep(lifetime + 1);
+    for (int i = 0; i < 3; ++i) {
+        addrs.count = 0;
+        Cache::Result res = cache.get(addrs, name);
+        if (++check, res != expected[i] || !addrs.contains(loopback)) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": res = " << res
+                << "; expected: " << expected[i] << "\n";
+            exit(check);
+        }
+        if (i == 1)
+            cache.refresh_failed(name);
+    }
+
+    // refreshed item is updated in place
+    cache.insert(addrs, name);
+    if (++check, cache.size() != 1 || map_pool.free_chunks() != pool_size - 1) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": cache.size() " << cache.size()
+            << "; expected: " << 1 << "\n";
+        exit(check);
+    }
+
+    Cache::Result res = cache.get(addrs, name);
+    if (++check, res != Cache::HIT) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::HIT << "\n";
+        exit(check);
+    }
+
+    sleep(lifetime + stale_lifetime + 1);
+    res = cache.get(addrs, name);
+    if (++check, res != Cache::MISS) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::MISS << "\n";
+        exit(check);
+    }
+}
+
+void check5(int pool_size)
+{
+    ++check_invocation;
+    int check = 0;
+    typedef NameCache<PoolAllocator<> > Cache;
+    Pool<MapNode> map_pool(pool_size * 2);
+    Pool<ListNode> list_pool(pool_size * 2);
+    PoolAllocator<MapNode>::init_thread(map_pool);
+    PoolAllocator<ListNode>::init_thread(list_pool);
+    Cache::init_static(pool_size, 1000, 0, 86400, 100);
+    Cache cache;
+
+    char path[] = "/tmp/evoxy-memory-XXXXXX";
+    if (!mkdtemp(path)) {
+        perror("mkdtemp");
+        exit(100);
+    }
+    std::string snapshot_path(path);
+    snapshot_path += "/cache";
+
+    HostAddresses addrs;
+    addrs.add(loopback);
+    char name[33];
+    for (int i = 0; i < pool_size; ++i) {
+        snprintf(name, 33, "snapshot%d.es", i);
+        cache.insert(addrs, name, 500 + i);
+    }
+    cache.insert_negative("snapshot0.es");
+
+    if (++check, NameCacheSnapshot::save(cache, snapshot_path.c_str(), 0)) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": save() failed: " << strerror(errno) << "\n";
+        exit(check);
+    }
+
+    Cache loaded_cache;
+    size_t loaded;
+    {
+        NameCacheSnapshot snapshot(snapshot_path.c_str());
+        loaded = snapshot.load(loaded_cache);
+    }
+    unlink((snapshot_path + ".0").c_str());
+    rmdir(path);
+
+    if (++check, loaded != pool_size || loaded_cache.size() != pool_size) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": loaded " << loaded << ", size " << loaded_cache.size()
+            << "; expected: " << pool_size << "\n";
+        exit(check);
+    }
+
+    addrs.count = 0;
+    Cache::Result res = loaded_cache.get(addrs, "snapshot1.es");
+    if (++check, res != Cache::HIT || !addrs.contains(loopback)) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::HIT << "\n";
+        exit(check);
+    }
+
+    res = loaded_cache.get(addrs, "snapshot0.es");
+    if (++check, res != Cache::NEGATIVE_HIT) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": res = " << res
+            << "; expected: " << Cache::NEGATIVE_HIT << "\n";
+        exit(check);
+    }
+
+    // remaining TTL is preserved
+    bool ttl_ok = true;
+    loaded_cache.for_each_mru([&](const DomainName &n, const DomainValue &v) {
+        if (n.str() == buffer::istring("snapshot3.es"))
+            ttl_ok = v.ttl > 500 && v.ttl <= 503;
+    });
+    if (++check, !ttl_ok) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong TTL of loaded item\n";
+        exit(check);
+    }
+}
+
+void check6()
+{
+    ++check_invocation;
+    int check = 0;
+    HostAddresses addrs;
+    in_addr a4[2] = {{htonl(0x0a000001)}, {htonl(0x0a000002)}};
+    in6_addr a6 = in6addr_loopback;
+    addrs.add(a4[0]);
+    addrs.add(a4[1]);
+    addrs.add(a4[0]);
+    addrs.add(a6);
+    if (++check, addrs.count != 3) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": count " << (int) addrs.count << "; expected: 3\n";
+        exit(check);
+    }
+
+    // IPv6 first, families interleaved, IPv4 rotated between copies
+    HostAddresses first, second;
+    addrs.rotated(first);
+    addrs.rotated(second);
+    if (++check, first.count != 3 || !(first.addr[0] == a6) ||
+        !(first.addr[1] == a4[0]) || !(first.addr[2] == a4[1]))
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong order of addresses\n";
+        exit(check);
+    }
+    if (++check, !(second.addr[0] == a6) || !(second.addr[1] == a4[1]) ||
+        !(second.addr[2] == a4[0]))
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": addresses are not rotated\n";
+        exit(check);
+    }
+}
+
+struct TimerOwner
+{
+    TimerNode node;
+    int fired = 0;
+    TimerWheel *wheel;
+    double rearm = 0; // re-arm from callback
+
+    static void callback(TimerNode *node)
+    {
+        TimerOwner *self = (TimerOwner *) node->data;
+        self->fired++;
+        if (self->rearm)
+            self->wheel->arm(self->node, self->rearm);
+    }
+};
+
+void check7()
+{
+    ++check_invocation;
+    int check = 0;
+    TimerWheel wheel;
+    wheel.start(1000.);
+    TimerOwner owners[4];
+    double timeouts[4] = {1, 5, TimerWheel::slot_count + 5, 3};
+    for (int i = 0; i < 4; ++i) {
+        owners[i].node.callback = TimerOwner::callback;
+        owners[i].node.data = &owners[i];
+        owners[i].wheel = &wheel;
+        wheel.arm(owners[i].node, timeouts[i]);
+    }
+    owners[0].rearm = 2;
+    wheel.cancel(owners[3].node);
+
+    if (++check, wheel.size() != 3) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": size() " << wheel.size() << "; expected: 3\n";
+        exit(check);
+    }
+
+    wheel.advance(1001.5);
+    if (++check, owners[0].fired != 1 || owners[1].fired || owners[3].fired) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong timers fired at 1 sec\n";
+        exit(check);
+    }
+
+    // long timeout shares slot with short one, but fires one revolution later
+    wheel.advance(1005.);
+    if (++check, owners[0].fired != 2 || owners[1].fired != 1 || owners[2].fired) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong timers fired at 5 sec\n";
+        exit(check);
+    }
+
+    owners[0].rearm = 0;
+    wheel.advance(1000. + TimerWheel::slot_count * 3);
+    if (++check, owners[2].fired != 1 || owners[0].fired != 3 || wheel.size() != 0) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": timers not fired after long pause\n";
+        exit(check);
+    }
+}
+
+void check8()
+{
+    ++check_invocation;
+    int check = 0;
+    Spool spool(10, 40, "/tmp");
+    char data[16];
+    for (int i = 0; i < 16; ++i)
+        data[i] = 'a' + i;
+    buffer::string chunk(data, 16);
+
+    // first 10 bytes go to memory, the rest to temporary file
+    if (++check, spool.write(chunk) || spool.size() != 16 || !spool.spilled()) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": size() " << spool.size() << "; expected: 16\n";
+        exit(check);
+    }
+    spool.write(chunk);
+    spool.write(chunk);
+    if (++check, !spool.full()) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": size() " << spool.size() << "; expected full\n";
+        exit(check);
+    }
+
+    char out[48];
+    size_t got = 0;
+    while (ssize_t n = spool.read(out + got, 7))
+        got += n;
+    if (++check, got != 48 || !spool.empty()
+        || memcmp(out, data, 16) || memcmp(out + 16, data, 16) || memcmp(out + 32, data, 16))
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": read " << got << " bytes; expected: 48\n";
+        exit(check);
+    }
+
+    // drained spool starts from memory
+    spool.write(buffer::string(data, 4));
+    if (++check, spool.read(out, sizeof(out)) != 4 || memcmp(out, data, 4)) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong data after drain\n";
+        exit(check);
+    }
+}
+
+void check9()
+{
+    ++check_invocation;
+    int check = 0;
+    Clusters cl;
+    if (++check, cl.add("app.test=127.0.0.1:8080,[::1],10.0.0.1") || cl.add("b.test=127.0.0.2")
+        || !cl.add("app.test=127.0.0.3") || !cl.add("c.test=") || !cl.add("c.test=[::1]x"))
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong --upstream parsing\n";
+        exit(check);
+    }
+    const Cluster *app = cl.find(buffer::istring("APP.test", 8));
+    if (++check, !app || app->servers.size() != 3 || app->servers[0].port != 8080
+        || app->servers[1].addr.family != AF_INET6 || app->servers[1].port != 80
+        || !(app->servers[2].addr == HostAddress(in_addr {htonl(0x0a000001)})))
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong servers of app.test\n";
+        exit(check);
+    }
+
+    Balancer b;
+    b.init(cl, 2, 10, 1);
+    const Cluster &c = *app;
+    // request of pick() fails on server 1
+    auto fail1 = [&b, &c] (double now) {
+        unsigned s;
+        while ((s = b.pick(c, now)) != 1)
+            b.finish(c, s);
+        b.fail(c, 1, now);
+    };
+    // server 0 is slow and loaded, server 1 is ejected
+    b.response(c, 0, 1.);
+    for (int i = 0; i < 5; ++i)
+        b.pick(c, 0.);
+    fail1(0.);
+    fail1(0.);
+    int picked[3] = {};
+    for (int i = 0; i < 100; ++i) {
+        unsigned s = b.pick(c, 1.);
+        picked[s]++;
+        b.finish(c, s);
+    }
+    if (++check, !b.ejected(c, 1, 1.) || picked[1] || picked[2] < 50) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": picked " << picked[0] << ", " << picked[1] << ", " << picked[2] << "\n";
+        exit(check);
+    }
+
+    // one more failure after ejection ejects again
+    if (++check, b.ejected(c, 1, 11.) || (fail1(11.), !b.ejected(c, 1, 11.))) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong ejection after eject_time\n";
+        exit(check);
+    }
+
+    // every other pick() is paired, only the 5 loading requests are in flight
+    if (++check, b.in_flight(c, 0) + b.in_flight(c, 1) + b.in_flight(c, 2) != 5) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": in flight " << b.in_flight(c, 0) << ", " << b.in_flight(c, 1) << ", "
+            << b.in_flight(c, 2) << "\n";
+        exit(check);
+    }
+}
+
+void check10()
+{
+    ++check_invocation;
+    int check = 0;
+    Clusters cl;
+    cl.add("five.test=10.0.0.1,10.0.0.2,10.0.0.3,10.0.0.4,10.0.0.5", true);
+    cl.add("four.test=10.0.0.1,10.0.0.2,10.0.0.4,10.0.0.5", true);
+    const Cluster &five = cl[0];
+    const Cluster &four = cl[1];
+
+    size_t share[5] = {};
+    for (uint16_t s: five.table)
+        share[s]++;
+    for (int i = 0; i < 5; ++i) {
+        if (++check, share[i] < Cluster::table_size / 5 * 0.9 || share[i] > Cluster::table_size / 5 * 1.1) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": server " << i << " has " << share[i] << " slots\n";
+            exit(check);
+        }
+    }
+
+    // removing 10.0.0.3 moves its keys and only a few others
+    size_t moved = 0;
+    for (size_t i = 0; i < Cluster::table_size; ++i) {
+        const UpstreamServer &a = five.servers[five.table[i]];
+        const UpstreamServer &b = four.servers[four.table[i]];
+        if (five.table[i] != 2 && !(a.addr == b.addr))
+            moved++;
+    }
+    if (++check, moved > Cluster::table_size / 20) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": " << moved << " foreign slots moved\n";
+        exit(check);
+    }
+
+    // same key goes to same server until it is ejected
+    Balancer b;
+    b.init(cl, 1, 10, 1);
+    uint64_t key = hash_key("five.test/a", 11);
+    unsigned s = b.pick(five, 0., key);
+    b.fail(five, s, 0.);
+    unsigned s2 = b.pick(five, 1., key);
+    if (++check, s != five.lookup(key) || s2 == s || b.pick(five, 11., key) != s) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong server for key\n";
+        exit(check);
+    }
+}
+
+void check11()
+{
+    ++check_invocation;
+    int check = 0;
+    Clusters cl;
+    cl.add("app.test=10.0.0.1", false);
+    cl.add("static.test=10.0.0.2", false);
+    cl.add("api.test=10.0.0.3", false);
+    const Cluster *app = &cl[0], *stat = &cl[1], *api = &cl[2];
+
+    RouteTable t;
+    for (int i = 0; i < 1000; ++i)
+        t.add("host" + std::to_string(i) + ".example.com", "/", i % 2 ? app : stat);
+    t.add("app.test", "/", app);
+    t.add("www.example.com", "/", app);
+    t.add("www.example.com", "/static/", stat);
+    t.add("www.example.com", "/static/api/", api);
+    t.add("www.example.com", "/stat", api);
+    t.add("*.example.com", "/", api);
+    t.add("*.img.example.com", "/", stat);
+    if (++check, !t.add("*.", "/", app) || !t.add("a.*.test", "/", app) || !t.add("b.test", "x", app)) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": bad route is added\n";
+        exit(check);
+    }
+    t.compile();
+
+    struct
+    {
+        const char *host;
+        const char *uri;
+        const Cluster *cluster;
+    } cases[] = {
+        {"host0.example.com", "/", stat},
+        {"HOST999.Example.COM", "/x", app},
+        {"www.example.com", "/index.html", app},
+        {"www.example.com", "/static/a.css", stat},
+        {"www.example.com", "/static/api/v1", api},
+        {"www.example.com", "/stat", api},
+        {"www.example.com", "/sta", app},
+        {"www.example.com", "http://www.example.com/static/a", stat},
+        {"www.example.com", "http://www.example.com", app},
+        {"other.example.com", "/", api},
+        {"a.b.example.com", "/", api},
+        {"a.img.example.com", "/", stat},
+        {"img.example.com", "/", api},
+        {"example.com", "/", nullptr},
+        {"app.test", "/", app},
+        {"unknown.test", "/", nullptr},
+    };
+    for (auto &c: cases) {
+        buffer::istring host(c.host, strlen(c.host));
+        buffer::string uri(c.uri, strlen(c.uri));
+        if (++check, t.find(host, uri) != c.cluster) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": wrong route of " << c.host << c.uri << "\n";
+            exit(check);
+        }
+    }
+
+    Routes r;
+    std::string err;
+    r.publish(RouteTable::load(cl, nullptr, err));
+    const RouteTable *first = r.current();
+    if (++check, r.current() != first || first->find(buffer::istring("API.test", 8), buffer::string("/", 1)) != api) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong published routes\n";
+        exit(check);
+    }
+}
+
+void check12()
+{
+    ++check_invocation;
+    int check = 0;
+
+    // RFC 7541 C.4: requests with Huffman coding, sharing dynamic table
+    static const char *blocks[] = {
+        "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff",
+        "\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf",
+        "\x82\x87\x85\xbf\x40\x88\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f\x89\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf",
+    };
+    static const char *expected[] = {
+        ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+        ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+        ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n",
+    };
+    Hpack decoder;
+    for (int i = 0; i < 3; ++i) {
+        Hpack::Headers headers;
+        std::string text;
+        bool err = decoder.decode(blocks[i], strlen(blocks[i]), headers);
+        for (auto &f: headers)
+            text += f.name + ": " + f.value + "\n";
+        if (++check, err || text != expected[i]) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": wrong decoded block " << i << "\n";
+            exit(check);
+        }
+    }
+
+    std::string block;
+    Hpack::encode_status(block, 200);
+    Hpack::encode_status(block, 502);
+    Hpack::encode(block, "content-type", "text/html");
+    Hpack::Headers headers;
+    if (++check, Hpack().decode(block.data(), block.size(), headers) || headers.size() != 3 ||
+        headers[0].value != "200" || headers[1].name != ":status" || headers[1].value != "502" ||
+        headers[2].name != "content-type" || headers[2].value != "text/html")
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong encoded block\n";
+        exit(check);
+    }
+
+    // truncated string and index out of table
+    if (++check, !Hpack().decode(blocks[0], 10, headers) || !Hpack().decode("\xbe", 1, headers)) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": bad block is decoded\n";
+        exit(check);
+    }
+
+    // indexed copies of a large entry stop at list limit, table is kept in sync
+    Hpack limited;
+    limited.list_limit = 4096;
+    std::string bomb = "\x40\x06x-bomb\x7f\xe9\x06" + std::string(1000, 'b'); // literal of 1000 bytes, indexed
+    bomb += std::string(1000, '\xbe');
+    headers.clear();
+    if (++check, limited.decode(bomb.data(), bomb.size(), headers) || !limited.list_truncated() ||
+        headers.size() != 3 || limited.list_size > 4096 + 1038)
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": " << headers.size() << " fields of HPACK bomb are kept\n";
+        exit(check);
+    }
+    headers.clear();
+    if (++check, limited.decode("\xbe", 1, headers) || limited.list_truncated() ||
+        headers.size() != 1 || headers[0].value.size() != 1000)
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong block after truncated one\n";
+        exit(check);
+    }
+}
+
+void check13()
+{
+    ++check_invocation;
+    int check = 0;
+    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sa {};
+    socklen_t sa_len = sizeof(sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr = loopback;
+    if (bind(srv, (sockaddr *) &sa, sa_len) || listen(srv, 8) || getsockname(srv, (sockaddr *) &sa, &sa_len)) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << ++check << ": no listening socket\n";
+        exit(check);
+    }
+    uint16_t port = ntohs(sa.sin_port);
+
+    // TEST-NET address is not configured on the host: bind() fails
+    const in_addr gone {htonl(0xc0000201)}; // 192.0.2.1
+    SourcePool sources;
+    sources.init({HostAddress(gone), HostAddress(loopback)}, false);
+    for (size_t i = 1; i <= 2; ++i) {
+        int fd = sources.connect(HostAddress(loopback), port);
+        if (++check, fd < 0 || !(fcntl(fd, F_GETFD) & FD_CLOEXEC)) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": connect " << i << " is not rotated to next source\n";
+            exit(check);
+        }
+        close(fd);
+        if (++check, sources.stats.unavailable != i || sources.connects(0) != 0 || sources.connects(1) != i) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": " << sources.stats.unavailable << " unavailable, "
+                << sources.connects(1) << " connects after connect " << i << "\n";
+            exit(check);
+        }
+    }
+
+    // every source is tried once
+    SourcePool none;
+    none.init({HostAddress(gone), HostAddress(gone)}, false);
+    if (++check, none.connect(HostAddress(loopback), port) >= 0 || errno != EADDRNOTAVAIL ||
+        none.stats.unavailable != 2)
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": connect without available source\n";
+        exit(check);
+    }
+
+#ifdef TCP_FASTOPEN_CONNECT
+    // Fast Open connection is deferred, unless it is not allowed (tunnel)
+    SourcePool fast;
+    fast.init({}, true);
+    for (bool allow: {true, false}) {
+        bool deferred = !allow;
+        int fd = fast.connect(HostAddress(loopback), port, allow, &deferred);
+        if (++check, fd < 0 || deferred != allow || fast.stats.fastopens != 1) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": Fast Open " << (allow ? "allowed" : "not allowed") << ", deferred: "
+                << deferred << "\n";
+            exit(check);
+        }
+        close(fd);
+    }
+#endif
+    close(srv);
+}
+
+void check14()
+{
+    ++check_invocation;
+    int check = 0;
+
+    struct
+    {
+        const char *list;
+        const char *coding;
+        bool accepted;
+    } cases[] = {
+        {"gzip", "gzip", true},
+        {"deflate, GZIP;q=0.5", "gzip", true},
+        {"gzip;q=0", "gzip", false},
+        {"gzip; q=0.000", "gzip", false},
+        {"gzip;q=0.001", "gzip", true},
+        {"gzip;q=1.0", "gzip", true},
+        {"*", "gzip", true},
+        {"*;q=0", "gzip", false},
+        {"*;q=0, gzip", "gzip", true},
+        {"gzip, *;q=0", "gzip", true},
+        {"gzip;q=0, *", "gzip", false},
+        {"x-gzip, deflate", "gzip", false},
+        {"identity", "gzip", false},
+        {"", "gzip", false},
+        {"", "identity", true},
+        {"gzip", "identity", true},
+        {"*;q=0", "identity", false},
+        {"*;q=0, identity;q=0.1", "identity", true},
+        {"identity;q=0", "identity", false},
+    };
+    for (auto &c: cases) {
+        if (++check, HTTPParser::accepts_coding(buffer::istring(c.list, strlen(c.list)), c.coding) != c.accepted) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": " << c.coding << " in \"" << c.list << "\" is "
+                << (c.accepted ? "refused" : "accepted") << "\n";
+            exit(check);
+        }
+    }
+
+    // gzip chunks of two blocks are inflated back
+    struct ev_loop *loop = ev_loop_new(0);
+    static ThreadPool workers; // outlives its threads
+    workers.spawn_threads(1);
+    GzipStream::init_thread(loop, &workers);
+    std::string text;
+    while (text.size() < GzipStream::block_size * 3 / 2)
+        text += "line " + std::to_string(text.size()) + " of response body\n";
+    GzipStream *gz = new GzipStream([] (void *loop) { ev_break((struct ev_loop *) loop, EVBREAK_ONE); }, loop);
+    gz->write(text.data(), text.size());
+    gz->finish();
+    std::string chunks;
+    while (!gz->finished()) {
+        gz->submit();
+        ev_run(loop, 0);
+        chunks += gz->output;
+        gz->output.clear();
+    }
+    gz->release();
+
+    std::string body;
+    for (size_t pos = 0;;) {
+        size_t size = std::stoul(chunks.substr(pos), nullptr, 16);
+        pos = chunks.find("\r\n", pos) + 2;
+        if (!size)
+            break;
+        body.append(chunks, pos, size);
+        pos += size + 2;
+    }
+    z_stream z {};
+    inflateInit2(&z, 15 + 16);
+    std::string inflated(text.size() + 1, '\0');
+    z.next_in = (Bytef *) body.data();
+    z.avail_in = body.size();
+    z.next_out = (Bytef *) &inflated[0];
+    z.avail_out = inflated.size();
+    int err = inflate(&z, Z_FINISH);
+    inflated.resize(z.total_out);
+    inflateEnd(&z);
+    if (++check, err != Z_STREAM_END || inflated != text || chunks.compare(chunks.size() - 5, 5, "0\r\n\r\n") != 0) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": inflate " << err << ", " << inflated.size() << " of "
+            << text.size() << " bytes\n";
+        exit(check);
+    }
+}
+
+void check15()
+{
+    ++check_invocation;
+    int check = 0;
+    char in_data[1024], out_data[1024];
+    IOBuffer in(buffer::string(in_data, sizeof(in_data))), out(buffer::string(out_data, sizeof(out_data)));
+    HTTPParser parser(in, out);
+    static const std::string via = " proxy.test:3128\r\n";
+    parser.set_addresses(buffer::string(via.data(), via.size()), loopback, loopback);
+
+    // our entries are appended to the lines of previous proxy
+    in.append("GET / HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Via: 1.0 first\r\n"
+        "X-Forwarded-For: 10.0.0.1\r\n"
+        "\r\n");
+    buffer::string chunk(in.begin(), in.size());
+    HTTPParser::Status s = parser.parse_head(chunk);
+    std::string head(out.begin(), out.size());
+    if (++check, s != HTTPParser::PROCEED ||
+        head.find("\r\nVia: 1.0 first, 1.1 proxy.test:3128\r\n") == std::string::npos ||
+        head.find("\r\nX-Forwarded-For: 10.0.0.1, 127.0.0.1\r\n") == std::string::npos ||
+        head.compare(head.size() - 4, 4, "\r\n\r\n") != 0)
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong request head:\n" << head;
+        exit(check);
+    }
+
+    // no-transform keeps them as they are
+    in.clear();
+    out.clear();
+    parser.restart_request(in);
+    in.append("GET / HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Cache-Control: no-transform\r\n"
+        "Via: 1.0 first\r\n"
+        "X-Forwarded-For: 10.0.0.1\r\n"
+        "\r\n");
+    chunk.assign(in.begin(), in.size());
+    s = parser.parse_head(chunk);
+    head.assign(out.begin(), out.size());
+    if (++check, s != HTTPParser::PROCEED ||
+        head.find("\r\nVia: 1.0 first\r\n") == std::string::npos ||
+        head.find("\r\nX-Forwarded-For: 10.0.0.1\r\n") == std::string::npos)
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong no-transform request head:\n" << head;
+        exit(check);
+    }
+    if (++check, !parser.idempotent_request) {
+        std::cerr << "Failed check " << check_invocation << "." << check << ": GET is not idempotent\n";
+        exit(check);
+    }
+
+    // keep-alive of previous response doesn't stay for next request
+    in.clear();
+    out.clear();
+    parser.restart_request(in);
+    parser.client_keep_alive = true;
+    in.append("POST / HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "\r\n");
+    chunk.assign(in.begin(), in.size());
+    s = parser.parse_head(chunk);
+    if (++check, s != HTTPParser::PROCEED || parser.idempotent_request || parser.client_keep_alive) {
+        std::cerr << "Failed check " << check_invocation << "." << check << ": wrong POST request flags\n";
+        exit(check);
+    }
+
+    // close and keep-alive are taken out of Connection list, other tokens go on
+    static const struct {
+        const char *connection;
+        bool force_close;
+        const char *forwarded;
+    } connections[] = {
+        {"close", true, nullptr},
+        {"Keep-Alive", false, nullptr},
+        {"keep-alive, Upgrade", false, "\r\nConnection: Upgrade\r\n"},
+        {"TE ,close, X-Foo", true, "\r\nConnection: TE, X-Foo\r\n"},
+    };
+    for (auto &c: connections) {
+        in.clear();
+        out.clear();
+        parser.restart_request(in);
+        parser.force_close = !c.force_close;
+        in.append("GET / HTTP/1.1\r\n"
+            "Host: www.example.com\r\n"
+            "Connection: ");
+        in.append(c.connection);
+        in.append("\r\n\r\n");
+        chunk.assign(in.begin(), in.size());
+        s = parser.parse_head(chunk);
+        head.assign(out.begin(), out.size());
+        size_t found = head.find("\r\nConnection:");
+        if (++check, s != HTTPParser::PROCEED || parser.force_close != c.force_close ||
+            (c.forwarded ? head.find(c.forwarded) != found : found != std::string::npos))
+        {
+            std::cerr << "Failed check " << check_invocation << "." << check <<
+                ": wrong Connection of request head:\n" << head;
+            exit(check);
+        }
+    }
+}
+
+// Loopback listener of check16(), its address is in server
+static int listen_loopback(UpstreamServer &server)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in sa {};
+    socklen_t sa_len = sizeof(sa);
+    sa.sin_family = AF_INET;
+    sa.sin_addr = loopback;
+    if (bind(fd, (sockaddr *) &sa, sa_len) || listen(fd, 8) || getsockname(fd, (sockaddr *) &sa, &sa_len))
+        return -1;
+    server.addr = HostAddress(loopback);
+    server.port = ntohs(sa.sin_port);
+    return fd;
+}
+
+static void pump(struct ev_loop *loop)
+{
+    for (int i = 0; i < 20; ++i)
+        ev_run(loop, EVRUN_NOWAIT);
+}
+
+// Everything there is in fd now
+static std::string recv_all(int fd)
+{
+    std::string got;
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        got.append(buf, n);
+    return got;
+}
+
+// Peer has shut down (or reset) its side
+static bool at_eof(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN);
+}
+
+struct LinkFrame
+{
+    uint32_t id;
+    uint8_t type;
+    std::string payload;
+};
+
+// Complete frames received by raw link end
+static std::vector<LinkFrame> recv_frames(int fd, std::string &in)
+{
+    in += recv_all(fd);
+    std::vector<LinkFrame> frames;
+    size_t pos = 0;
+    while (in.size() - pos >= Link::head_size) {
+        uint32_t id;
+        uint16_t size;
+        memcpy(&id, &in[pos], 4);
+        memcpy(&size, &in[pos + 4], 2);
+        size = ntohs(size);
+        if (in.size() - pos < Link::head_size + size)
+            break;
+        frames.push_back({ntohl(id), (uint8_t) in[pos + 6], in.substr(pos + Link::head_size, size)});
+        pos += Link::head_size + size;
+    }
+    in.erase(0, pos);
+    return frames;
+}
+
+static void send_frame(int fd, uint32_t id, Link::FrameType type, const std::string &payload = "")
+{
+    char head[Link::head_size] = {};
+    uint32_t net_id = htonl(id);
+    uint16_t net_size = htons(payload.size());
+    memcpy(head, &net_id, 4);
+    memcpy(head + 4, &net_size, 2);
+    head[6] = type;
+    std::string frame(head, sizeof(head));
+    frame += payload;
+    send(fd, frame.data(), frame.size(), 0);
+}
+
+void check16()
+{
+    ++check_invocation;
+    int check = 0;
+    struct ev_loop *loop = ev_loop_new(0);
+    UpstreamServer server;
+    int lfd = listen_loopback(server);
+    const in_addr client_local {htonl(0x0a000001)}, client_peer {htonl(0xc0a80102)};
+
+    struct Opened
+    {
+        int fd = -1;
+        in_addr local, peer;
+        bool refuse = false;
+    } opened;
+    Link::open_f open = [] (void *ctx, int fd, const in_addr &local, const in_addr &peer) {
+        Opened *o = (Opened *) ctx;
+        if (o->refuse)
+            return true;
+        o->fd = fd;
+        o->local = local;
+        o->peer = peer;
+        return false;
+    };
+
+    {
+        // frontend and backend ends of link
+        Link front(loop, server);
+        int c[2];
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, c);
+        if (++check, lfd < 0 || front.open_stream(c[1], client_local, client_peer)) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": link is not connected\n";
+            exit(check);
+        }
+        Link *back = new Link(loop, accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK), open, &opened);
+        pump(loop);
+        if (++check, opened.fd < 0 || opened.local.s_addr != client_local.s_addr ||
+            opened.peer.s_addr != client_peer.s_addr)
+        {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": stream is not opened with client addresses\n";
+            exit(check);
+        }
+
+        send(c[0], "ping", 4, 0);
+        pump(loop);
+        std::string request = recv_all(opened.fd);
+        send(opened.fd, "pong", 4, 0);
+        pump(loop);
+        if (++check, request != "ping" || recv_all(c[0]) != "pong") {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": no round trip of frames\n";
+            exit(check);
+        }
+
+        // client is done with request, response still goes back
+        shutdown(c[0], SHUT_WR);
+        pump(loop);
+        bool request_end = at_eof(opened.fd);
+        send(opened.fd, "late", 4, 0);
+        pump(loop);
+        if (++check, !request_end || recv_all(c[0]) != "late" || front.stream_count() != 1) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": FIN is not half-close\n";
+            exit(check);
+        }
+        shutdown(opened.fd, SHUT_WR);
+        pump(loop);
+        if (++check, !at_eof(c[0]) || front.stream_count() || back->stream_count()) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": stream is not finished by FIN of both sides\n";
+            exit(check);
+        }
+        close(opened.fd);
+        close(c[0]);
+
+        // backend can't take stream
+        size_t resets = Link::stats.resets;
+        opened.refuse = true;
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, c);
+        front.open_stream(c[1], client_local, client_peer);
+        pump(loop);
+        if (++check, !at_eof(c[0]) || front.stream_count() || Link::stats.resets != resets + 1) {
+            std::cerr << "Failed check " << check_invocation <<
+                "." << check << ": stream is not reset\n";
+            exit(check);
+        }
+        close(c[0]);
+    }
+    pump(loop); // backend end is deleted
+
+    // frontend end against raw frames
+    Link front(loop, server);
+    int c[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, c);
+    front.open_stream(c[1], client_local, client_peer);
+    int raw = accept(lfd, nullptr, nullptr);
+    pump(loop);
+    std::string in;
+    std::vector<LinkFrame> frames = recv_frames(raw, in);
+    if (++check, frames.size() != 1 || frames[0].type != Link::OPEN || frames[0].payload.size() != 9 ||
+        frames[0].payload[0] != 4 || memcmp(&frames[0].payload[1], &client_local, 4) != 0)
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong OPEN frame\n";
+        exit(check);
+    }
+    uint32_t id = frames[0].id;
+
+    // client sends more than window: DATA stops at window until WINDOW
+    std::string body(Link::stream_window + 100000, 'x');
+    size_t written = 0, data = 0;
+    auto exchange = [&] () {
+        for (int i = 0; i < 50; ++i) {
+            ssize_t n = send(c[0], body.data() + written, body.size() - written, MSG_DONTWAIT);
+            if (n > 0)
+                written += n;
+            pump(loop);
+            for (LinkFrame &f: recv_frames(raw, in))
+                data += f.type == Link::DATA && f.id == id ? f.payload.size() : 0;
+        }
+    };
+    exchange();
+    if (++check, data != Link::stream_window) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": " << data << " bytes of DATA within window " << Link::stream_window << "\n";
+        exit(check);
+    }
+    uint32_t credit = htonl(50000);
+    send_frame(raw, id, Link::WINDOW, std::string((const char *) &credit, 4));
+    exchange();
+    if (++check, data != Link::stream_window + 50000) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": " << data << " bytes of DATA after WINDOW\n";
+        exit(check);
+    }
+
+    // window is returned when server data is written to client
+    std::string chunk(16000, 'y');
+    for (int i = 0; i < 5; ++i)
+        send_frame(raw, id, Link::DATA, chunk);
+    std::string response;
+    size_t returned = 0;
+    for (int i = 0; i < 10; ++i) {
+        usleep(10000); // for TCP window update of link
+        pump(loop);
+        response += recv_all(c[0]);
+        for (LinkFrame &f: recv_frames(raw, in)) {
+            if (f.type == Link::WINDOW && f.payload.size() == 4) {
+                memcpy(&credit, f.payload.data(), 4);
+                returned += ntohl(credit);
+            }
+        }
+    }
+    if (++check, response.size() != chunk.size() * 5 || returned < Link::stream_window / 4) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": " << returned << " bytes of window returned, " << response.size() << " bytes to client\n";
+        exit(check);
+    }
+
+    send_frame(raw, id, Link::RESET);
+    pump(loop);
+    if (++check, !at_eof(c[0]) || front.stream_count()) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": stream is not closed by RESET\n";
+        exit(check);
+    }
+    close(c[0]);
+    close(raw);
+    close(lfd);
+}
+
+void check17()
+{
+    ++check_invocation;
+    int check = 0;
+    char buf_data[4096];
+    IOBuffer buf(buffer::string(buf_data, sizeof(buf_data)));
+    int src[2], dst[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, src);
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, dst);
+    // destination takes less than pipe holds
+    int sndbuf = 16384;
+    setsockopt(dst[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    std::string data;
+    for (int i = 0; data.size() < 300000; ++i)
+        data += std::to_string(i) + ",";
+    size_t sent = 0;
+    std::string got;
+    Relay r;
+    r.open();
+    bool full = false, partial = false, blocked = false;
+    for (int i = 0; i < 10000 && !r.shut; ++i) {
+        if (sent < data.size()) {
+            ssize_t n = send(src[0], data.data() + sent, data.size() - sent, 0);
+            if (n > 0)
+                sent += n;
+            if (sent == data.size())
+                shutdown(src[0], SHUT_WR);
+        }
+        bool now_full;
+        if (!r.eof && r.read(src[1], buf, now_full) > 0)
+            full |= now_full;
+        // destination is drained every other round only
+        ssize_t n = r.write(dst[0], buf);
+        if (n < 0 && errno == EAGAIN)
+            blocked = true;
+        else if (n > 0 && !r.drained(buf))
+            partial = true;
+        if (i % 2)
+            got += recv_all(dst[1]);
+    }
+    got += recv_all(dst[1]);
+    if (++check, got != data || !at_eof(dst[1]) || Relay::stats.spliced_bytes < data.size()) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": " << got.size() << " of " << data.size() << " bytes relayed\n";
+        exit(check);
+    }
+    if (++check, !full || !partial || !blocked) {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": pipe full " << full << ", partial splice " << partial
+            << ", EAGAIN " << blocked << "\n";
+        exit(check);
+    }
+    close(dst[0]);
+    close(dst[1]);
+
+    // no pipe: data is copied through buffer
+    Relay copy;
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, dst);
+    send(src[1], "tail", 4, 0);
+    shutdown(src[1], SHUT_WR);
+    size_t copied = Relay::stats.copied_bytes;
+    copy.read(src[0], buf, full);
+    copy.write(dst[0], buf);
+    bool was_eof = copy.eof;
+    copy.read(src[0], buf, full);
+    copy.write(dst[0], buf);
+    if (++check, was_eof || !copy.eof || !copy.shut || recv_all(dst[1]) != "tail" ||
+        !at_eof(dst[1]) || Relay::stats.copied_bytes != copied + 4)
+    {
+        std::cerr << "Failed check " << check_invocation <<
+            "." << check << ": wrong copy without pipe\n";
+        exit(check);
+    }
+}
+
+// Server connection persistence after response head (RFC 7230 3.3.3)
+void check18()
+{
+    ++check_invocation;
+    int check = 0;
+    char in_data[1024], out_data[1024];
+    IOBuffer in(buffer::string(in_data, sizeof(in_data))), out(buffer::string(out_data, sizeof(out_data)));
+    HTTPParser parser(in, out);
+    static const struct {
+        const char *method;
+        const char *head;
+        bool keep_alive;
+    } cases[] = {
+        {"GET", "HTTP/1.1 200 OK\r\n\r\n", false}, // close-delimited
+        {"GET", "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n\r\n", false},
+        {"GET", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n", true},
+        {"GET", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n", true},
+        {"GET", "HTTP/1.1 204 No Content\r\n\r\n", true},
+        {"GET", "HTTP/1.1 304 Not Modified\r\n\r\n", true},
+        {"HEAD", "HTTP/1.1 200 OK\r\n\r\n", true},
+        {"GET", "HTTP/1.0 200 OK\r\nContent-Length: 5\r\n\r\n", false},
+    };
+    for (auto &c: cases) {
+        in.clear();
+        out.clear();
+        parser.restart_request(in);
+        in.append(c.method);
+        in.append(" / HTTP/1.1\r\nHost: www.example.com\r\n\r\n");
+        buffer::string chunk(in.begin(), in.size());
+        if (parser.parse_head(chunk) != HTTPParser::PROCEED) {
+            std::cerr << "Failed check " << check_invocation << ": wrong request\n";
+            exit(1);
+        }
+        out.clear();
+        parser.start_response();
+        out.append(c.head);
+        chunk.assign(out.begin(), out.size());
+        HTTPParser::Status s = parser.parse_head(chunk);
+        if (++check, s != HTTPParser::PROCEED || parser.keep_alive != c.keep_alive) {
+            std::cerr << "Failed check " << check_invocation << "." << check <<
+                ": wrong keep-alive after " << c.method << " response:\n" << c.head;
+            exit(check);
+        }
+    }
+}
+
+// Close-delimited response goes to client chunked when both sides allow it
+void check19()
+{
+    ++check_invocation;
+    int check = 0;
+    char in_data[1024], out_data[1024];
+    IOBuffer in(buffer::string(in_data, sizeof(in_data))), out(buffer::string(out_data, sizeof(out_data)));
+    HTTPParser parser(in, out);
+    static const struct {
+        const char *request;
+        const char *head;
+        bool rechunk;
+    } cases[] = {
+        // usual HTTP/1.1 server without Content-Length and "Connection: close"
+        {"GET / HTTP/1.1\r\n", "HTTP/1.1 200 OK\r\n\r\n", true},
+        {"GET / HTTP/1.1\r\n", "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n", true},
+        {"GET / HTTP/1.1\r\n", "HTTP/1.0 200 OK\r\n\r\n", true},
+        {"GET / HTTP/1.0\r\n", "HTTP/1.1 200 OK\r\n\r\n", false},
+        {"GET / HTTP/1.1\r\nConnection: close\r\n", "HTTP/1.1 200 OK\r\n\r\n", false},
+        {"HEAD / HTTP/1.1\r\n", "HTTP/1.1 200 OK\r\n\r\n", false},
+        {"GET / HTTP/1.1\r\n", "HTTP/1.1 304 Not Modified\r\n\r\n", false},
+    };
+    for (auto &c: cases) {
+        in.clear();
+        out.clear();
+        parser.restart_request(in);
+        in.append(c.request);
+        in.append("Host: www.example.com\r\n\r\n");
+        buffer::string chunk(in.begin(), in.size());
+        if (parser.parse_head(chunk) != HTTPParser::PROCEED) {
+            std::cerr << "Failed check " << check_invocation << ": wrong request\n";
+            exit(1);
+        }
+        out.clear();
+        parser.start_response();
+        out.append(c.head);
+        chunk.assign(out.begin(), out.size());
+        HTTPParser::Status s = parser.parse_head(chunk);
+        // Backend re-chunks response it waits shutdown for
+        bool close_delimited = parser.content_length == HTTPParser::cl_unset && !parser.chunked &&
+            !parser.bodiless_response();
+        if (++check, s != HTTPParser::PROCEED || (close_delimited && parser.can_rechunk()) != c.rechunk) {
+            std::cerr << "Failed check " << check_invocation << "." << check <<
+                ": wrong re-chunking of response to " << c.request << c.head;
+            exit(check);
+        }
+    }
+}
+
 int main()
 {
     check<Test>(10);
     check2(10, 3);
+    check3(10, 3, 5, 1);
+    check4(10, 1, 2);
+    check5(10);
+    check6();
+    check7();
+    check8();
+    check9();
+    check10();
+    check11();
+    check12();
+    check13();
+    check14();
+    check15();
+    check16();
+    check17();
+    check18();
+    check19();
 }
 
@@ -1,5 +1,5 @@
 #ifndef __cd_threads_h
-#define __cd_trheads_h
+#define __cd_threads_h
 
 #include <thread>
 #include <mutex>
@@ -22,7 +22,7 @@ public:
     virtual void release_thread(size_t managed_id) = 0;
 };
 
-const int MAX_TASK_SIZE = 128;
+const int MAX_TASK_SIZE = 512;
 
 class TaskHolder
 {
@@ -131,25 +131,27 @@ public:
     AnyTask *
     add_task(AnyTask &task)
     {
-        std::unique_lock<std::mutex> lock(free_threads_mx_);
-        if (!free_threads.empty()) {
-            Thread *thread;
-            {
-                thread = free_threads.back();
+        // Locked as in release_thread(): thread which is being released
+        // either is free already or takes the task from queue
+        std::lock_guard<std::mutex> queue_lock(queue_mx_);
+        {
+            std::lock_guard<std::mutex> lock(free_threads_mx_);
+            if (!free_threads.empty()) {
+                Thread *thread = free_threads.back();
                 free_threads.pop_back();
+                return thread->assign_task(std::move(task));
             }
-            return thread->assign_task(std::move(task));
-        } else {
-            lock.unlock();
-            std::lock_guard<std::mutex> lock(queue_mx_);
-            task_queue.push_back(task);
-            return static_cast<AnyTask *>(&(*task_queue.back()));
         }
+        task_queue.push_back(task);
+        return static_cast<AnyTask *>(&(*task_queue.back()));
     }
     virtual ~ThreadPool()
     {
         for (auto &thread: threads) {
             (*thread)->detach();
+            // Detached thread may still wait on its condition variable,
+            // destroying it would block forever (on exit after shutdown).
+            thread.release();
         }
     }
 };
@@ -0,0 +1,138 @@
+#pragma once
+#ifndef __evx_timer_h
+#define __evx_timer_h
+
+#include <cstdint>
+#include <cmath>
+
+/* Intrusive list node of TimerWheel, embedded into its owner */
+struct TimerNode
+{
+    typedef void (*callback_f)(TimerNode *node);
+
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0; // tick
+    callback_f callback = nullptr;
+    void *data = nullptr;
+
+    bool armed() const
+    {
+        return prev;
+    }
+
+    void unlink()
+    {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+};
+
+/* Hashed timing wheel for coarse connection timeouts: arm and cancel are
+   O(1) list operations, so any number of connections costs only one
+   ev_timer (which calls advance() every tick). Timeouts longer than one
+   wheel revolution stay in their slot until tick of expiration comes.
+   Precision is one tick. */
+class TimerWheel
+{
+public:
+    static const unsigned slot_count = 1024; // power of 2
+
+private:
+    TimerNode slots[slot_count]; // list heads
+    double resolution; // tick length in seconds
+    uint64_t current = 0; // last processed tick
+    size_t armed = 0;
+
+    uint64_t tick(double now) const
+    {
+        return (uint64_t) (now / resolution);
+    }
+
+public:
+    TimerWheel(double _resolution = 1.) :
+        resolution {_resolution}
+    {
+        for (TimerNode &head: slots)
+            head.prev = head.next = &head;
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    void operator=(const TimerWheel &) = delete;
+
+    void start(double now)
+    {
+        current = tick(now);
+    }
+
+    size_t size() const
+    {
+        return armed;
+    }
+
+    double tick_length() const
+    {
+        return resolution;
+    }
+
+    // Re-arming armed node is allowed
+    void arm(TimerNode &node, double timeout)
+    {
+        cancel(node);
+        uint64_t ticks = (uint64_t) std::ceil(timeout / resolution);
+        node.expires = current + (ticks ? ticks : 1);
+        TimerNode &head = slots[node.expires & (slot_count - 1)];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+        ++armed;
+    }
+
+    void cancel(TimerNode &node)
+    {
+        if (node.armed()) {
+            node.unlink();
+            --armed;
+        }
+    }
+
+    // Fires callbacks of expired nodes. Callback may arm or cancel any node.
+    void advance(double now)
+    {
+        uint64_t target = tick(now);
+        if (target <= current)
+            return;
+        // after long pause every slot is visited once
+        uint64_t from = target - current > slot_count ? target - slot_count : current;
+        current = target; // nodes armed in callbacks expire after target
+        for (uint64_t t = from + 1; t <= target; ++t) {
+            TimerNode &head = slots[t & (slot_count - 1)];
+            // nodes armed in callbacks go to list tail (behind the marker)
+            TimerNode marker;
+            marker.prev = head.prev;
+            marker.next = &head;
+            head.prev->next = &marker;
+            head.prev = &marker;
+            while (head.next != &marker) {
+                TimerNode *node = head.next;
+                if (node->expires > target) {
+                    // next revolution: move behind the marker
+                    node->unlink();
+                    node->prev = head.prev;
+                    node->next = &head;
+                    head.prev->next = node;
+                    head.prev = node;
+                    continue;
+                }
+                node->unlink();
+                --armed;
+                node->callback(node);
+            }
+            marker.unlink();
+        }
+    }
+};
+
+#endif // __evx_timer_h
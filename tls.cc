@@ -0,0 +1,270 @@
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <openssl/err.h>
+
+#include "connection.h"
+#include "tls.h"
+
+thread_local TlsConnection::Stats TlsConnection::stats;
+
+static std::string
+ssl_error()
+{
+    char buf[256];
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+SSL_CTX *
+TlsConnection::load_context(const char *cert, const char *key, std::string &err)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        err = "SSL_CTX_new: " + ssl_error();
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        err = std::string("--tls-cert ") + cert + ": " + ssl_error();
+    } else if (SSL_CTX_use_PrivateKey_file(ctx, key ? key : cert, SSL_FILETYPE_PEM) != 1) {
+        err = std::string("--tls-key ") + (key ? key : cert) + ": " + ssl_error();
+    } else if (SSL_CTX_check_private_key(ctx) != 1) {
+        err = "--tls-key doesn't match --tls-cert: " + ssl_error();
+    } else {
+        return ctx;
+    }
+    SSL_CTX_free(ctx);
+    return nullptr;
+}
+
+TlsConnection::TlsConnection(struct ev_loop *event_loop_, SSL_CTX *ctx, int fd, const in_addr &local_,
+        const in_addr &peer_, open_f open_, void *open_ctx_) :
+    event_loop {event_loop_},
+    ssl {SSL_new(ctx)},
+    local (local_),
+    peer (peer_),
+    open {open_},
+    open_ctx {open_ctx_}
+{
+    if (!ssl || !SSL_set_fd(ssl, fd)) {
+        if (ssl)
+            SSL_free(ssl);
+        throw std::bad_alloc();
+    }
+    ev_io_init(&watcher, callback, fd, EV_READ);
+    watcher.data = this;
+    ev_io_init(&inner, callback, -1, 0);
+    inner.data = this;
+    timer.callback = timeout_callback;
+    timer.data = this;
+    SSL_set_accept_state(ssl);
+    ev_io_start(event_loop, &watcher);
+    stats.in_progress++;
+    if (OPT_VALUE_CLIENT_HEADER_TIMEOUT)
+        OnEventLoop::timers.arm(timer, OPT_VALUE_CLIENT_HEADER_TIMEOUT);
+}
+
+TlsConnection::~TlsConnection()
+{
+    if (handshaking)
+        stats.in_progress--;
+    SSL_free(ssl);
+    ev_io_stop(event_loop, &watcher);
+    ev_io_stop(event_loop, &inner);
+    if (watcher.fd >= 0)
+        close(watcher.fd);
+    if (inner.fd >= 0)
+        close(inner.fd);
+    OnEventLoop::timers.cancel(timer);
+}
+
+void
+TlsConnection::timeout_callback(TimerNode *node)
+{
+    stats.failures++;
+    cdebug("timeout_callback", "TLS handshake timeout");
+    delete (TlsConnection *) node->data;
+}
+
+void
+TlsConnection::set_events(struct ev_loop *loop, ev_io &w, int events)
+{
+    if (events == (w.events & (EV_READ | EV_WRITE)))
+        return;
+    ev_io_stop(loop, &w);
+    ev_io_set(&w, w.fd, events);
+    if (events)
+        ev_io_start(loop, &w);
+}
+
+void
+TlsConnection::update()
+{
+    set_events(event_loop, watcher, (!client_eof && in.size() < buffer_limit ? EV_READ : 0) |
+        (out.empty() ? 0 : EV_WRITE));
+    set_events(event_loop, inner, (!proxy_eof && out.size() < buffer_limit ? EV_READ : 0) |
+        (in.empty() ? 0 : EV_WRITE));
+}
+
+void
+TlsConnection::callback(EV_P_ ev_io *w, int revents)
+{
+    TlsConnection *self = (TlsConnection *) w->data;
+    if (!self->bridged) {
+        self->handshake();
+        return;
+    }
+    bool closed;
+    if (w == &self->watcher) {
+        closed = ((revents & EV_READ) && self->client_read()) ||
+            ((revents & EV_WRITE) && self->client_write());
+    } else {
+        // data left in OpenSSL buffer is taken once there is room for it
+        closed = ((revents & EV_READ) && self->inner_read()) ||
+            ((revents & EV_WRITE) && (self->inner_write() || self->client_read()));
+    }
+    if (!closed)
+        self->update();
+}
+
+bool
+TlsConnection::handshake()
+{
+    ERR_clear_error();
+    int r = SSL_do_handshake(ssl);
+    if (r <= 0) {
+        int err = SSL_get_error(ssl, r);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+            set_events(event_loop, watcher, err == SSL_ERROR_WANT_READ ? EV_READ : EV_WRITE);
+            return false;
+        }
+        stats.failures++;
+        debug("TLS handshake with ", inet_ntoa(peer), " failed: ", ssl_error());
+        delete this;
+        return true;
+    }
+    stats.handshakes++;
+    stats.in_progress--;
+    handshaking = false;
+    OnEventLoop::timers.cancel(timer);
+    set_events(event_loop, watcher, 0);
+
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+        // kernel has the keys, socket goes on as plain one (close_notify is not sent)
+        stats.ktls++;
+        int fd = watcher.fd;
+        watcher.fd = -1;
+        if (open(open_ctx, fd, local, peer))
+            close(fd);
+        delete this;
+        return true;
+    }
+
+    stats.userspace++;
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+        error("TLS: socketpair: ", strerror(errno));
+        delete this;
+        return true;
+    }
+    if (open(open_ctx, fds[0], local, peer)) {
+        close(fds[0]);
+        close(fds[1]);
+        delete this;
+        return true;
+    }
+    ev_io_set(&inner, fds[1], 0);
+    bridged = true;
+    // request may have come along with handshake
+    if (client_read())
+        return true;
+    update();
+    return false;
+}
+
+bool
+TlsConnection::client_read()
+{
+    while (!client_eof && in.size() < buffer_limit) {
+        char buf[16384];
+        ERR_clear_error();
+        int n = SSL_read(ssl, buf, sizeof(buf));
+        if (n > 0) {
+            in.append(buf, n);
+            continue;
+        }
+        int err = SSL_get_error(ssl, n);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            break;
+        // close_notify, EOF or error: no more requests
+        client_eof = true;
+    }
+    return inner_write();
+}
+
+bool
+TlsConnection::inner_write()
+{
+    if (!in.empty()) {
+        ssize_t n = send(inner.fd, in.data(), in.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            in.erase(0, n);
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            // Proxy has closed, its response may be still there
+            in.clear();
+            client_eof = true;
+        }
+    }
+    if (in.empty() && client_eof && !inner_shut) {
+        shutdown(inner.fd, SHUT_WR);
+        inner_shut = true;
+    }
+    return false;
+}
+
+bool
+TlsConnection::inner_read()
+{
+    while (!proxy_eof && out.size() < buffer_limit) {
+        char buf[16384];
+        ssize_t n = recv(inner.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            out.append(buf, n);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            break;
+        proxy_eof = true;
+    }
+    return client_write();
+}
+
+bool
+TlsConnection::client_write()
+{
+    while (!out.empty()) {
+        ERR_clear_error();
+        int n = SSL_write(ssl, out.data(), out.size());
+        if (n > 0) {
+            out.erase(0, n);
+            continue;
+        }
+        int err = SSL_get_error(ssl, n);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+            return false;
+        delete this;
+        return true;
+    }
+    if (proxy_eof) {
+        SSL_shutdown(ssl);
+        delete this;
+        return true;
+    }
+    return false;
+}
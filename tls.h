@@ -0,0 +1,81 @@
+#pragma once
+#ifndef __evx_tls_h
+#define __evx_tls_h
+
+#include <ev.h>
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <string>
+
+#include "timer.h"
+#include "util.h"
+
+/* TLS client connection of --tls-port. Handshake is done by OpenSSL on
+   event loop, then session keys are installed into kernel (kTLS), so
+   socket is passed on as plain one: recv, send and splice of Proxy work
+   on it unchanged. If kernel can't take the keys (no tls module or
+   cipher), connection is bridged to Proxy over socketpair and encrypted
+   by OpenSSL here. */
+class TlsConnection :
+    public virtual non_copyable
+{
+public:
+    // fd is client end for new Proxy (or link stream); true means error
+    typedef bool (*open_f)(void *ctx, int fd, const in_addr &local, const in_addr &peer);
+
+    struct Stats
+    {
+        size_t handshakes = 0; // completed
+        size_t failures = 0;
+        size_t ktls = 0;
+        size_t userspace = 0; // bridged
+        size_t in_progress = 0; // handshakes, they take connection slots
+    };
+    static thread_local Stats stats;
+
+    // Server context of PEM files (key may be in cert); nullptr means error (message is in err)
+    static SSL_CTX *load_context(const char *cert, const char *key, std::string &err);
+
+    // Deletes itself when connection is passed on or closed; throws std::bad_alloc
+    TlsConnection(struct ev_loop *event_loop_, SSL_CTX *ctx, int fd, const in_addr &local_, const in_addr &peer_,
+        open_f open_, void *open_ctx_);
+    ~TlsConnection();
+
+private:
+    static const size_t buffer_limit = 65536; // of each direction
+
+    struct ev_loop *event_loop;
+    ev_io watcher; // client
+    ev_io inner; // Proxy end of bridge
+    SSL *ssl;
+    in_addr local;
+    in_addr peer;
+    open_f open;
+    void *open_ctx;
+    TimerNode timer; // handshake
+
+    bool handshaking = true;
+    bool bridged = false;
+    std::string in; // decrypted, not written to Proxy yet
+    std::string out; // from Proxy, not encrypted yet
+    bool client_eof = false;
+    bool inner_shut = false;
+    bool proxy_eof = false;
+
+    static void set_events(struct ev_loop *loop, ev_io &w, int events);
+    void update();
+    // true means connection is deleted
+    bool handshake();
+    bool client_read();
+    bool client_write();
+    bool inner_read();
+    bool inner_write();
+
+    static void
+    callback(EV_P_ ev_io *w, int revents);
+
+    static void
+    timeout_callback(TimerNode *node);
+};
+
+#endif // __evx_tls_h
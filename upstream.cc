@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+void
+UpstreamPool::init(struct ev_loop *event_loop_, TimerWheel &timers_, size_t capacity, double timeout_)
+{
+    event_loop = event_loop_;
+    timers = &timers_;
+    timeout = timeout_;
+    slots.resize(capacity);
+    for (Idle &i: slots) {
+        ev_init(&i.watcher, read_callback);
+        i.watcher.data = nullptr;
+        i.timer.callback = timeout_callback;
+        i.timer.data = &i;
+        i.pool = this;
+    }
+}
+
+void
+UpstreamPool::close(Idle &i)
+{
+    ev_io_stop(event_loop, &i.watcher);
+    timers->cancel(i.timer);
+    ::close(i.watcher.fd);
+    --idle;
+}
+
+void
+UpstreamPool::put(int fd, const HostAddress &addr, uint16_t port)
+{
+    for (Idle &i: slots) {
+        if (ev_is_active(&i.watcher))
+            continue;
+        i.addr = addr;
+        i.port = port;
+        ev_io_set(&i.watcher, fd, EV_READ);
+        ev_io_start(event_loop, &i.watcher);
+        if (timeout)
+            timers->arm(i.timer, timeout);
+        ++idle;
+        stats.parked++;
+        return;
+    }
+    ::close(fd);
+}
+
+int
+UpstreamPool::take(const HostAddresses &addrs, uint16_t port, HostAddress &peer)
+{
+    if (!idle)
+        return -1;
+    for (Idle &i: slots) {
+        if (!ev_is_active(&i.watcher) || i.port != port || !addrs.contains(i.addr))
+            continue;
+        int fd = i.watcher.fd;
+        ev_io_stop(event_loop, &i.watcher);
+        timers->cancel(i.timer);
+        --idle;
+        stats.reused++;
+        peer = i.addr;
+        return fd;
+    }
+    return -1;
+}
+
+void
+SourcePool::init(const std::vector<HostAddress> &addrs, bool fastopen_)
+{
+    fastopen = fastopen_;
+    sources.resize(addrs.size());
+    for (size_t i = 0; i < addrs.size(); ++i)
+        sources[i].addr = addrs[i];
+}
+
+SourcePool::Source *
+SourcePool::pick(sa_family_t family)
+{
+    for (size_t i = 0; i < sources.size(); ++i) {
+        Source &s = sources[next++ % sources.size()];
+        if (s.addr.family == family)
+            return &s;
+    }
+    return nullptr;
+}
+
+int
+SourcePool::connect(const HostAddress &addr, uint16_t port, bool allow_fastopen, bool *deferred)
+{
+    bool use_fastopen = fastopen && allow_fastopen;
+    sockaddr_storage sa;
+    socklen_t sa_len = addr.sockaddr(sa, port);
+    // every source of the family is tried once
+    size_t tries = std::count_if(sources.begin(), sources.end(),
+        [&addr] (const Source &s) { return s.addr.family == addr.family; });
+    for (size_t i = 0; i < std::max<size_t>(tries, 1); ++i) {
+        int fd = socket(addr.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            if (errno != EAFNOSUPPORT)
+                throw Errno("socket");
+            return -1;
+        }
+        Source *src = pick(addr.family);
+        if (src) {
+            sockaddr_storage local;
+            socklen_t local_len = src->addr.sockaddr(local, 0);
+        #ifdef IP_BIND_ADDRESS_NO_PORT
+            int no_port = 1;
+            setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &no_port, sizeof(no_port));
+        #endif
+            if (bind(fd, (sockaddr *) &local, local_len) < 0) {
+                int err = errno;
+                ::close(fd);
+                errno = err;
+                // source address is not configured (anymore)
+                if (err != EADDRNOTAVAIL)
+                    return -1;
+                stats.unavailable++;
+                continue;
+            }
+        }
+    #ifdef TCP_FASTOPEN_CONNECT
+        int on = 1;
+        if (use_fastopen)
+            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+    #endif
+        int err = ::connect(fd, (sockaddr *) &sa, sa_len);
+        if (err == 0 || errno == EINPROGRESS) {
+            if (src)
+                src->connects++;
+            // SYN is deferred until request head is written
+            if (err == 0 && use_fastopen)
+                stats.fastopens++;
+            if (deferred)
+                *deferred = err == 0 && use_fastopen;
+            return fd;
+        }
+        err = errno;
+        ::close(fd);
+        errno = err;
+        if (err != EADDRNOTAVAIL)
+            return -1;
+        stats.unavailable++;
+    }
+    return -1;
+}
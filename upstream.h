@@ -0,0 +1,131 @@
+#pragma once
+#ifndef __evx_upstream_h
+#define __evx_upstream_h
+
+#include <ev.h>
+#include <vector>
+
+#include "cache.h"
+#include "timer.h"
+#include "util.h"
+
+/* Idle persistent server connections of one event loop thread. Connection
+   is parked when its client goes away (or switches to another server) and
+   is taken by any client of the same address and port. Parked connection
+   is closed on idle timeout, on any data from server (normally it is FIN)
+   and when there is no free slot. */
+class UpstreamPool :
+    public virtual non_copyable
+{
+    struct Idle
+    {
+        ev_io watcher; // must be first
+        TimerNode timer;
+        HostAddress addr;
+        uint16_t port;
+        UpstreamPool *pool;
+    };
+
+    struct ev_loop *event_loop = nullptr;
+    TimerWheel *timers = nullptr;
+    double timeout = 0;
+    std::vector<Idle> slots; // inactive watcher means free slot
+    size_t idle = 0;
+
+    void close(Idle &i);
+
+    static void
+    read_callback(EV_P_ ev_io *w, int revents)
+    {
+        Idle *i = (Idle *) w;
+        i->pool->close(*i);
+    }
+
+    static void
+    timeout_callback(TimerNode *node)
+    {
+        Idle *i = (Idle *) node->data;
+        i->pool->stats.expired++;
+        i->pool->close(*i);
+    }
+
+public:
+    struct Stats
+    {
+        size_t parked = 0;
+        size_t reused = 0;
+        size_t expired = 0;
+        size_t stale = 0; // reused one was closed by server before response
+    } stats;
+
+    // capacity == 0 turns off parking
+    void init(struct ev_loop *event_loop_, TimerWheel &timers_, size_t capacity, double timeout_);
+
+    size_t size() const
+    {
+        return idle;
+    }
+
+    // Takes ownership of fd (closes it if there is no room)
+    void put(int fd, const HostAddress &addr, uint16_t port);
+    // Returns -1 if there is no idle connection to any of addrs
+    int take(const HostAddresses &addrs, uint16_t port, HostAddress &peer);
+};
+
+/* Local addresses of server connections (--source-address). Socket is
+   bound to address only (IP_BIND_ADDRESS_NO_PORT), so kernel chooses port
+   on connect() by whole 4-tuple, and every source has its own ephemeral
+   port range towards a server. Sources of server address family are
+   taken in turn; when ports of one are exhausted or its address is gone
+   from the host (EADDRNOTAVAIL), next one is tried at once.
+
+   With TCP Fast Open (--upstream-fastopen) connect() of server which gave
+   a cookie completes at once without handshake: the request head written
+   next goes in SYN. It is not used for tunnels, where client speaks first
+   only by chance. */
+class SourcePool :
+    public virtual non_copyable
+{
+    struct Source
+    {
+        HostAddress addr;
+        size_t connects = 0;
+    };
+
+    std::vector<Source> sources;
+    unsigned next = 0;
+    bool fastopen = false;
+
+    // Next source of family, nullptr if there is none
+    Source *pick(sa_family_t family);
+
+public:
+    struct Stats
+    {
+        size_t unavailable = 0; // EADDRNOTAVAIL: no free local port or address
+        size_t fastopens = 0; // connected without handshake
+        size_t fastopen_failures = 0; // server didn't accept deferred connection
+    } stats;
+
+    void init(const std::vector<HostAddress> &addrs, bool fastopen_);
+
+    size_t size() const
+    {
+        return sources.size();
+    }
+    const HostAddress &address(size_t i) const
+    {
+        return sources[i].addr;
+    }
+    size_t connects(size_t i) const
+    {
+        return sources[i].connects;
+    }
+
+    /* Nonblocking socket which is connecting to addr:port; -1 means error
+       (in errno). Fast Open is not used unless allowed, deferred tells if
+       it was: then connect errors come from first send or recv. */
+    int connect(const HostAddress &addr, uint16_t port, bool allow_fastopen = true, bool *deferred = nullptr);
+};
+
+#endif // __evx_upstream_h
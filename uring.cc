@@ -0,0 +1,792 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+thread_local Uring::Stats Uring::stats;
+const size_t Uring::buffer_size;
+const size_t Uring::send_limit;
+
+static const unsigned ring_entries = 1024; // SQ, CQ is 4 times bigger
+static const unsigned buffer_count = 256; // provided to receives, power of 2
+static const uint16_t buffer_group = 1;
+static const ev_tstamp close_linger = 10.;
+
+// user_data is object address with operation in low bits
+enum Op
+{
+    NONE = 0, // cancel
+    RECV,
+    SEND,
+    SHUT,
+    CLOSE,
+    ACCEPT
+};
+static const uint64_t op_mask = 7;
+
+static int
+io_uring_setup(unsigned entries, io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring::Uring(struct ev_loop *event_loop_) :
+    event_loop{event_loop_}
+{
+}
+
+Uring *
+Uring::create(struct ev_loop *event_loop, std::string &err)
+{
+    Uring *ring = new Uring(event_loop);
+    if (ring->setup(err)) {
+        delete ring;
+        return nullptr;
+    }
+    return ring;
+}
+
+bool
+Uring::setup(std::string &err)
+{
+    io_uring_params p;
+    for (unsigned flags: {IORING_SETUP_SINGLE_ISSUER, 0u}) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | flags;
+        p.cq_entries = ring_entries * 4;
+        ring_fd = io_uring_setup(ring_entries, &p);
+        // single issuer is optimization of 6.0
+        if (ring_fd >= 0 || errno != EINVAL)
+            break;
+    }
+    if (ring_fd < 0) {
+        err = std::string("io_uring_setup: ") + strerror(errno);
+        return true;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        err = "kernel is too old";
+        return true;
+    }
+
+    ring_mem_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+        p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe));
+    ring_mem = mmap(nullptr, ring_mem_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes_mem = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring_mem == MAP_FAILED || sqes_mem == MAP_FAILED) {
+        if (ring_mem == MAP_FAILED)
+            ring_mem = nullptr;
+        if (sqes_mem != MAP_FAILED)
+            sqes = (io_uring_sqe *)sqes_mem;
+        err = std::string("mmap: ") + strerror(errno);
+        return true;
+    }
+    sqes = (io_uring_sqe *)sqes_mem;
+    char *mem = (char *)ring_mem;
+    sq_entries = p.sq_entries;
+    sq_mask = *(unsigned *)(mem + p.sq_off.ring_mask);
+    sq_head = (unsigned *)(mem + p.sq_off.head);
+    sq_tail = (unsigned *)(mem + p.sq_off.tail);
+    sq_flags = (unsigned *)(mem + p.sq_off.flags);
+    unsigned *sq_array = (unsigned *)(mem + p.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i)
+        sq_array[i] = i;
+    sqe_tail = *sq_tail;
+    cq_mask = *(unsigned *)(mem + p.cq_off.ring_mask);
+    cq_head = (unsigned *)(mem + p.cq_off.head);
+    cq_tail = (unsigned *)(mem + p.cq_off.tail);
+    cqes = (io_uring_cqe *)(mem + p.cq_off.cqes);
+
+    void *ring = mmap(nullptr, buffer_count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *data = mmap(nullptr, buffer_count * buffer_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring != MAP_FAILED)
+        buf_ring = (io_uring_buf *)ring;
+    if (data != MAP_FAILED)
+        buffers = (char *)data;
+    if (!buf_ring || !buffers) {
+        err = std::string("mmap: ") + strerror(errno);
+        return true;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)buf_ring;
+    reg.ring_entries = buffer_count;
+    reg.bgid = buffer_group;
+    // provided buffer ring is 5.19, as multishot accept
+    if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        err = std::string("provided buffers: ") + strerror(errno);
+        return true;
+    }
+    for (unsigned bid = 0; bid < buffer_count; ++bid)
+        provide(bid);
+
+    ev_io_init(&ring_watcher, ring_callback, ring_fd, EV_READ);
+    ring_watcher.data = this;
+    // it holds ev_run() as accept watchers do in readiness mode
+    ev_io_start(event_loop, &ring_watcher);
+    // after other prepare watchers, which may arm receives
+    ev_prepare_init(&submit_watcher, submit_callback);
+    ev_set_priority(&submit_watcher, EV_MINPRI);
+    submit_watcher.data = this;
+    ev_prepare_start(event_loop, &submit_watcher);
+    ev_unref(event_loop);
+    ev_idle_init(&dispatch_watcher, dispatch_callback);
+    dispatch_watcher.data = this;
+    ev_timer_init(&linger_watcher, linger_callback, 1., 1.);
+    linger_watcher.data = this;
+    return false;
+}
+
+Uring::~Uring()
+{
+    if (ev_is_active(&ring_watcher)) {
+        ev_io_stop(event_loop, &ring_watcher);
+        ev_ref(event_loop);
+        ev_prepare_stop(event_loop, &submit_watcher);
+        ev_idle_stop(event_loop, &dispatch_watcher);
+        ev_timer_stop(event_loop, &linger_watcher);
+    }
+    for (Acceptor *a: acceptors)
+        delete a;
+    while (Segment *s = free_segments) {
+        free_segments = s->next;
+        delete s;
+    }
+    if (buffers)
+        munmap(buffers, buffer_count * buffer_size);
+    if (buf_ring)
+        munmap(buf_ring, buffer_count * sizeof(io_uring_buf));
+    if (sqes)
+        munmap(sqes, sqes_size);
+    if (ring_mem)
+        munmap(ring_mem, ring_mem_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+}
+
+Uring::Channel *
+Uring::open(int fd, event_f callback, void *owner)
+{
+    return new Channel(*this, fd, callback, owner);
+}
+
+Uring::Acceptor *
+Uring::listen(int fd, accept_f callback, void *ctx)
+{
+    acceptors.push_back(new Acceptor(*this, fd, callback, ctx));
+    return acceptors.back();
+}
+
+io_uring_sqe *
+Uring::get_sqe()
+{
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        submit();
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+            throw Runtime("io_uring: submission queue is full");
+    }
+    io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe_tail++;
+    return sqe;
+}
+
+void
+Uring::reserve(unsigned count)
+{
+    if (sqe_tail + count - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_entries)
+        submit();
+}
+
+void
+Uring::submit()
+{
+    unsigned count = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (!count)
+        return;
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    stats.enters++;
+    if (io_uring_enter(ring_fd, count, 0, 0) < 0) {
+        // EBUSY: completions must be reaped first, SQEs stay for next submit
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            throw Errno("io_uring_enter");
+    }
+}
+
+void
+Uring::reap()
+{
+    unsigned head = *cq_head;
+    for (;;) {
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            // completions which didn't fit into CQ are kept by kernel
+            if (!(__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+                break;
+            stats.enters++;
+            io_uring_enter(ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+                break;
+        }
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+        stats.completions++;
+        unsigned op = cqe.user_data & op_mask;
+        void *object = (void *)(uintptr_t)(cqe.user_data & ~op_mask);
+        if (op == ACCEPT)
+            ((Acceptor *)object)->complete(cqe.res, cqe.flags);
+        else if (op != NONE)
+            ((Channel *)object)->complete(op, cqe.res, cqe.flags);
+    }
+}
+
+/* Owners are called here only, never from completion handling, so a
+   callback doesn't see state of other sockets changing under it. */
+void
+Uring::dispatch()
+{
+    dispatching.swap(ready);
+    for (Channel *ch: dispatching) {
+        ch->listed = false;
+        if (!ch->owner) {
+            ch->collect();
+            continue;
+        }
+        int revents = ch->ready() & ch->wanted;
+        if (revents)
+            ch->callback(ch->owner, revents);
+        // level-triggered: what is left is reported again
+        ch->notify();
+    }
+    dispatching.clear();
+    if (ready.empty())
+        ev_idle_stop(event_loop, &dispatch_watcher);
+}
+
+void
+Uring::provide(int bid)
+{
+    // not io_uring_buf_ring: its flexible array is misplaced in C++
+    io_uring_buf &b = buf_ring[buf_tail & (buffer_count - 1)];
+    b.addr = (uintptr_t)(buffers + bid * buffer_size);
+    b.len = buffer_size;
+    b.bid = bid;
+    __atomic_store_n(&buf_ring[0].resv, ++buf_tail, __ATOMIC_RELEASE);
+    while (!starved.empty()) {
+        Channel *ch = starved.back();
+        starved.pop_back();
+        ch->starving = false;
+        if (ch->owner) {
+            ch->arm();
+            break;
+        }
+        ch->collect();
+    }
+}
+
+Uring::Segment *
+Uring::new_segment()
+{
+    Segment *s = free_segments;
+    if (s)
+        free_segments = s->next;
+    else
+        s = new Segment;
+    s->next = nullptr;
+    s->size = 0;
+    return s;
+}
+
+void
+Uring::free_segment(Segment *s)
+{
+    s->next = free_segments;
+    free_segments = s;
+}
+
+void
+Uring::ring_callback(EV_P_ ev_io *w, int revents)
+{
+    Uring *self = (Uring *)w->data;
+    self->reap();
+    self->dispatch();
+}
+
+void
+Uring::submit_callback(EV_P_ ev_prepare *w, int revents)
+{
+    Uring *self = (Uring *)w->data;
+    for (size_t i = 0; i < self->flush_list.size(); ++i) {
+        Channel *ch = self->flush_list[i];
+        ch->flushing = false;
+        if (!ch->sending && ch->queued)
+            ch->submit_sends();
+        ch->collect();
+    }
+    self->flush_list.clear();
+    for (Channel *ch: self->garbage)
+        delete ch;
+    self->garbage.clear();
+    self->submit();
+}
+
+void
+Uring::dispatch_callback(EV_P_ ev_idle *w, int revents)
+{
+    Uring *self = (Uring *)w->data;
+    self->dispatch();
+}
+
+void
+Uring::linger_callback(EV_P_ ev_timer *w, int revents)
+{
+    Uring *self = (Uring *)w->data;
+    ev_tstamp now = ev_now(EV_A);
+    auto stuck = std::remove_if(self->lingering.begin(), self->lingering.end(),
+        [now] (Channel *ch) {
+            if (ch->sending && now - ch->closed_at < close_linger)
+                return false;
+            if (ch->sending) {
+                stats.cancelled_sends++;
+                ch->cancel(SEND);
+            }
+            ch->lingering = false;
+            ch->collect();
+            return true;
+        });
+    self->lingering.erase(stuck, self->lingering.end());
+    if (self->lingering.empty())
+        ev_timer_stop(EV_A_ w);
+}
+
+Uring::Channel::Channel(Uring &ring_, int fd_, event_f callback_, void *owner_) :
+    ring(ring_),
+    fd{fd_},
+    callback{callback_},
+    owner{owner_}
+{
+}
+
+Uring::Channel::~Channel()
+{
+    drop_queued();
+}
+
+uint64_t
+Uring::Channel::tag(unsigned op) const
+{
+    return (uintptr_t)this | op;
+}
+
+int
+Uring::Channel::ready() const
+{
+    int events = 0;
+    if (bid >= 0 || eof || error)
+        events |= EV_READ;
+    if (error || buffered < send_limit)
+        events |= EV_WRITE;
+    return events;
+}
+
+void
+Uring::Channel::arm()
+{
+    if (receiving || starving || bid >= 0 || eof || error || !owner || !(wanted & EV_READ))
+        return;
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = buffer_size;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffer_group;
+    sqe->user_data = tag(RECV);
+    receiving = true;
+    ops++;
+}
+
+void
+Uring::Channel::notify()
+{
+    if (listed || !owner || !(ready() & wanted))
+        return;
+    listed = true;
+    ring.ready.push_back(this);
+    ev_idle_start(ring.event_loop, &ring.dispatch_watcher);
+}
+
+void
+Uring::Channel::submit_sends()
+{
+    unsigned count = 0;
+    for (Segment *s = queued; s; s = s->next)
+        count++;
+    ring.reserve(count);
+    for (Segment *s = queued; s; s = s->next) {
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)s->data;
+        sqe->len = s->size;
+        // stream socket: partial send is retried by kernel
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        // failed send cancels the rest of chain
+        if (s->next)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = tag(SEND);
+        sending++;
+        ops++;
+        stats.sends++;
+    }
+    if (flight)
+        flight_tail->next = queued;
+    else
+        flight = queued;
+    flight_tail = queued_tail;
+    queued = queued_tail = nullptr;
+}
+
+void
+Uring::Channel::drop_queued()
+{
+    while (Segment *s = queued) {
+        queued = s->next;
+        buffered -= s->size;
+        ring.free_segment(s);
+    }
+    queued_tail = nullptr;
+}
+
+void
+Uring::Channel::cancel(unsigned op)
+{
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag(op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+
+// Closes fd of closed channel when its sends and receive are done
+void
+Uring::Channel::finish()
+{
+    if (!closing || sending || queued || receiving || fd < 0)
+        return;
+    if (shut_how >= 0 && !shut_sent) {
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_SHUTDOWN;
+        sqe->fd = fd;
+        sqe->len = shut_how;
+        // close goes after it even if it fails
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = tag(SHUT);
+        shut_sent = true;
+        ops++;
+    }
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = tag(CLOSE);
+    ops++;
+    fd = -1;
+}
+
+void
+Uring::Channel::collect()
+{
+    if (owner || ops || listed || flushing || starving || lingering || dead)
+        return;
+    if (closing && fd >= 0)
+        return;
+    dead = true;
+    ring.garbage.push_back(this);
+}
+
+void
+Uring::Channel::complete(unsigned op, int res, unsigned flags)
+{
+    ops--;
+    switch (op) {
+    case RECV:
+        receiving = false;
+        if (flags & IORING_CQE_F_BUFFER) {
+            int b = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (res > 0 && owner) {
+                bid = b;
+                offset = 0;
+                length = res;
+                stats.recvs++;
+            } else {
+                ring.provide(b);
+            }
+        }
+        if (res == 0) {
+            eof = true;
+        } else if (res == -ENOBUFS) {
+            stats.buffer_waits++;
+            if (owner) {
+                starving = true;
+                ring.starved.push_back(this);
+            }
+        } else if (res < 0 && res != -ECANCELED && !error) {
+            error = -res;
+        }
+        break;
+    case SEND: {
+        sending--;
+        Segment *s = flight;
+        flight = s->next;
+        if (!flight)
+            flight_tail = nullptr;
+        buffered -= s->size;
+        if (res >= 0 && (size_t)res < s->size)
+            res = -EPIPE;
+        ring.free_segment(s);
+        if (res < 0 && !error)
+            error = -res;
+        if (error)
+            drop_queued();
+        if (!sending) {
+            if (queued)
+                submit_sends();
+            else if (shut_how == SHUT_WR && !shut_sent && !closing) {
+                io_uring_sqe *sqe = ring.get_sqe();
+                sqe->opcode = IORING_OP_SHUTDOWN;
+                sqe->fd = fd;
+                sqe->len = SHUT_WR;
+                sqe->user_data = tag(SHUT);
+                shut_sent = true;
+                ops++;
+            }
+        }
+        break;
+    }
+    default: // SHUT, CLOSE
+        break;
+    }
+    finish();
+    if (owner)
+        notify();
+    else
+        collect();
+}
+
+ssize_t
+Uring::Channel::recv(char *buf, size_t len)
+{
+    if (bid >= 0) {
+        size_t n = std::min(len, length);
+        memcpy(buf, ring.buffers + bid * buffer_size + offset, n);
+        offset += n;
+        length -= n;
+        if (!length) {
+            ring.provide(bid);
+            bid = -1;
+            arm();
+        }
+        return n;
+    }
+    if (eof)
+        return 0;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    arm();
+    errno = EAGAIN;
+    return -1;
+}
+
+ssize_t
+Uring::Channel::send(const char *buf, size_t len)
+{
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    if (shut_how >= 0) {
+        errno = EPIPE;
+        return -1;
+    }
+    size_t n = std::min(len, send_limit - buffered);
+    if (!n) {
+        errno = EAGAIN;
+        return len ? -1 : 0;
+    }
+    for (size_t done = 0; done < n; ) {
+        if (!queued || queued_tail->size == buffer_size) {
+            Segment *s = ring.new_segment();
+            if (queued)
+                queued_tail->next = s;
+            else
+                queued = s;
+            queued_tail = s;
+        }
+        size_t part = std::min(n - done, buffer_size - queued_tail->size);
+        memcpy(queued_tail->data + queued_tail->size, buf + done, part);
+        queued_tail->size += part;
+        done += part;
+    }
+    buffered += n;
+    // segments of this iteration go in one chain
+    if (!flushing) {
+        flushing = true;
+        ring.flush_list.push_back(this);
+    }
+    return n;
+}
+
+void
+Uring::Channel::watch(int events)
+{
+    wanted = events;
+    arm();
+    notify();
+}
+
+void
+Uring::Channel::shutdown_write()
+{
+    if (shut_how >= 0)
+        return;
+    shut_how = SHUT_WR;
+    if (sending || queued)
+        return;
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = fd;
+    sqe->len = SHUT_WR;
+    sqe->user_data = tag(SHUT);
+    shut_sent = true;
+    ops++;
+}
+
+void
+Uring::Channel::close(bool shut)
+{
+    owner = nullptr;
+    wanted = 0;
+    closing = true;
+    closed_at = ev_now(ring.event_loop);
+    if (shut) {
+        shut_how = SHUT_RDWR;
+        shut_sent = false;
+    }
+    if (bid >= 0) {
+        ring.provide(bid);
+        bid = -1;
+    }
+    if (receiving)
+        cancel(RECV);
+    if (sending || queued) {
+        lingering = true;
+        ring.lingering.push_back(this);
+        if (!ev_is_active(&ring.linger_watcher))
+            ev_timer_start(ring.event_loop, &ring.linger_watcher);
+    }
+    finish();
+    collect();
+}
+
+int
+Uring::Channel::detach()
+{
+    assert(flushed());
+    owner = nullptr;
+    wanted = 0;
+    if (bid >= 0) {
+        ring.provide(bid);
+        bid = -1;
+    }
+    if (receiving)
+        cancel(RECV);
+    int detached = fd;
+    fd = -1;
+    collect();
+    return detached;
+}
+
+Uring::Acceptor::Acceptor(Uring &ring_, int fd_, accept_f callback_, void *ctx_) :
+    ring(ring_),
+    fd{fd_},
+    callback{callback_},
+    ctx{ctx_}
+{
+}
+
+void
+Uring::Acceptor::start()
+{
+    active = true;
+    size_t taken = 0;
+    while (active && taken < backlog.size())
+        callback(ctx, fd, backlog[taken++]);
+    backlog.erase(backlog.begin(), backlog.begin() + taken);
+    if (!active || armed)
+        return;
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t)this | ACCEPT;
+    armed = true;
+}
+
+void
+Uring::Acceptor::stop()
+{
+    if (!active)
+        return;
+    active = false;
+    if (!armed)
+        return;
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)this | ACCEPT;
+}
+
+void
+Uring::Acceptor::complete(int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE)) {
+        armed = false;
+        // multishot ends on error (or when CQ overflows)
+        if (active)
+            start();
+    }
+    if (res >= 0) {
+        stats.accepts++;
+        if (active)
+            callback(ctx, fd, res);
+        else
+            backlog.push_back(res);
+    } else if (res != -ECANCELED) {
+        errno = -res;
+        callback(ctx, fd, -1);
+    }
+}
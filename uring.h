@@ -0,0 +1,212 @@
+#pragma once
+#ifndef __evx_uring_h
+#define __evx_uring_h
+
+#include <ev.h>
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf;
+
+/* Completion-driven socket I/O of event loop thread (--event-backend
+   io_uring). Client sockets come from multishot accept; proxy sockets get
+   channels instead of readiness watchers: receives take buffers which are
+   provided to kernel, sends are copied into segments and go as linked
+   SQEs. SQEs of whole loop iteration are submitted by one io_uring_enter()
+   before polling, ring fd is polled by libev together with other watchers.
+   Channel looks like nonblocking socket to its owner (EAGAIN, level-
+   triggered EV_READ/EV_WRITE), so proxy logic is the same for both paths. */
+class Uring :
+    public virtual non_copyable
+{
+public:
+    typedef void (*event_f)(void *owner, int revents);
+    typedef void (*accept_f)(void *ctx, int listen_fd, int conn_fd);
+
+    static const size_t buffer_size = 16384; // provided buffer and send segment
+    static const size_t send_limit = 4 * buffer_size; // queued by channel
+
+    struct Segment
+    {
+        Segment *next;
+        size_t size;
+        char data[buffer_size];
+    };
+
+    class Channel
+    {
+        friend class Uring;
+        Uring &ring;
+        int fd;
+        event_f callback;
+        void *owner; // nullptr when closed or detached
+        int wanted = 0;
+        unsigned ops = 0; // SQEs in flight; channel is freed when released and none left
+        bool listed = false; // in ready list
+        bool flushing = false; // in flush list
+        bool starving = false; // waits for provided buffer
+        bool lingering = false; // closed with sends in flight
+        bool dead = false; // in garbage list
+
+        // receive: one at a time, and only when owner wants EV_READ and has
+        // taken previous data, so slow peer doesn't pin buffers
+        bool receiving = false;
+        int bid = -1; // received buffer, not taken yet
+        size_t offset = 0;
+        size_t length = 0;
+        bool eof = false;
+        int error = 0; // of receive or send, sticky
+
+        // send: one chain in flight keeps order
+        Segment *queued = nullptr; // not submitted
+        Segment *queued_tail = nullptr;
+        Segment *flight = nullptr; // submitted, completed in order
+        Segment *flight_tail = nullptr;
+        size_t buffered = 0; // queued and in flight
+        unsigned sending = 0;
+        int shut_how = -1; // shutdown() after sends
+        bool shut_sent = false;
+        bool closing = false;
+        ev_tstamp closed_at = 0;
+
+        Channel(Uring &ring, int fd, event_f callback, void *owner);
+        ~Channel();
+
+        uint64_t tag(unsigned op) const;
+        int ready() const;
+        void arm();
+        void notify();
+        void submit_sends();
+        void drop_queued();
+        void cancel(unsigned op);
+        void finish();
+        void collect();
+        void complete(unsigned op, int res, unsigned flags);
+
+    public:
+        // Like ::recv() and ::send() of nonblocking socket: -1 with errno (EAGAIN too)
+        ssize_t recv(char *buf, size_t len);
+        ssize_t send(const char *buf, size_t len);
+
+        // Events are level-triggered like EV_READ/EV_WRITE of ev_io
+        void watch(int events);
+
+        // SHUT_WR when queued data is sent
+        void shutdown_write();
+
+        // Nothing is waiting to be sent
+        bool flushed() const
+        {
+            return !buffered;
+        }
+
+        /* Owner is gone; fd is closed when queued data is sent (shut:
+           SHUT_RDWR before), sends of stuck peer are cancelled after linger */
+        void close(bool shut);
+
+        // Owner is gone, fd is left open (flushed channel only)
+        int detach();
+    };
+
+    class Acceptor
+    {
+        friend class Uring;
+        Uring &ring;
+        int fd;
+        accept_f callback;
+        void *ctx;
+        bool active = false;
+        bool armed = false; // multishot accept in flight
+        // accepted after stop(): they wait for start() as in listen backlog
+        std::vector<int> backlog;
+
+        Acceptor(Uring &ring, int fd, accept_f callback, void *ctx);
+        void complete(int res, unsigned flags);
+
+    public:
+        void start();
+        void stop();
+    };
+
+    struct Stats
+    {
+        size_t enters = 0; // io_uring_enter() calls
+        size_t completions = 0;
+        size_t accepts = 0;
+        size_t recvs = 0;
+        size_t sends = 0; // SQEs, one per segment
+        size_t buffer_waits = 0; // receives which found no provided buffer
+        size_t cancelled_sends = 0; // of stuck closed channels
+    };
+    static thread_local Stats stats;
+
+    // nullptr means running kernel can't do it (reason is in err), caller falls back to readiness
+    static Uring *create(struct ev_loop *event_loop, std::string &err);
+    ~Uring();
+
+    Channel *open(int fd, event_f callback, void *owner);
+    Acceptor *listen(int fd, accept_f callback, void *ctx);
+
+private:
+    struct ev_loop *event_loop;
+    int ring_fd = -1;
+    void *ring_mem = nullptr;
+    size_t ring_mem_size = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_mask = 0;
+    unsigned sqe_tail = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_flags = nullptr;
+    unsigned cq_mask = 0;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    struct io_uring_cqe *cqes = nullptr;
+
+    struct io_uring_buf *buf_ring = nullptr; // tail is in resv of first entry
+    char *buffers = nullptr;
+    uint16_t buf_tail = 0;
+
+    Segment *free_segments = nullptr;
+    std::vector<Channel *> ready;
+    std::vector<Channel *> dispatching;
+    std::vector<Channel *> flush_list;
+    std::vector<Channel *> starved;
+    std::vector<Channel *> lingering;
+    std::vector<Channel *> garbage;
+    std::vector<Acceptor *> acceptors;
+
+    ev_io ring_watcher;
+    ev_prepare submit_watcher;
+    ev_idle dispatch_watcher;
+    ev_timer linger_watcher;
+
+    Uring(struct ev_loop *event_loop);
+    bool setup(std::string &err); // true means error
+
+    struct io_uring_sqe *get_sqe();
+    void reserve(unsigned count); // SQEs of one link chain go in one submit
+    void submit();
+    void reap();
+    void dispatch();
+
+    void provide(int bid);
+    Segment *new_segment();
+    void free_segment(Segment *s);
+
+    static void ring_callback(EV_P_ ev_io *w, int revents);
+    static void submit_callback(EV_P_ ev_prepare *w, int revents);
+    static void dispatch_callback(EV_P_ ev_idle *w, int revents);
+    static void linger_callback(EV_P_ ev_timer *w, int revents);
+};
+
+#endif // __evx_uring_h